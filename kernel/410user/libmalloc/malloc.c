@@ -101,6 +101,7 @@ static const size_t wsize = sizeof(word_t);   // word and header size (bytes)
 static const size_t dsize = 2*sizeof(word_t);          // double word size (bytes)
 static const size_t min_block_size = 4*sizeof(word_t); // Minimum block size
 static const size_t chunksize = (1 << 12);    // requires (chunksize % 16 == 0)
+static const size_t trim_threshold = 16 * (1 << 12); // free tail worth trimming
 
 static const word_t alloc_mask = 0x1;
 static const word_t size_mask = ~(word_t)0xF;
@@ -131,6 +132,7 @@ static block_t *extend_heap(size_t size);
 static void place(block_t *block, size_t asize);
 static block_t *find_fit(size_t asize);
 static block_t *coalesce(block_t *block);
+static void trim_heap(block_t *block);
 
 static size_t max(size_t x, size_t y);
 static size_t round_up(size_t size, size_t n);
@@ -260,7 +262,7 @@ void _free(void *bp)
     write_header(block, size, false);
     write_footer(block, size, false);
 
-    coalesce(block);
+    trim_heap(coalesce(block));
 
 }
 
@@ -414,6 +416,31 @@ static block_t *coalesce(block_t * block)
     return block;
 }
 
+/*
+ * trim_heap: If block is a free block at the end of the heap larger than
+ *            trim_threshold, shrinks it to chunksize and gives the rest of
+ *            the heap back through mem_sbrk.
+ */
+static void trim_heap(block_t *block)
+{
+    size_t size = get_size(block);
+    if (get_size(find_next(block)) != 0 || size < trim_threshold)
+    {
+        return;
+    }
+
+    size_t excess = size - chunksize;
+    if (mem_sbrk(-(int)excess) == NULL)
+    {
+        return;
+    }
+
+    write_header(block, chunksize, false);
+    write_footer(block, chunksize, false);
+    // Move the epilogue header down to the new end of the heap
+    write_header(find_next(block), 0, true);
+}
+
 /*
  * place: Places block with size of asize at the start of bp. If the remaining
  *        size is at least the minimum block size, then split the block to the
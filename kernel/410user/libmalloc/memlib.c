@@ -18,6 +18,7 @@
 #endif
 
 /* private global variables */
+static char *mem_start;      /* start of the heap, never given back */
 static char *mem_max_addr;   /* max virtual address for the heap */
 static char *mem_brkp; /* Simulated brk pointer */
 static char *mem_alloctop; /* Maximum allocated address */
@@ -35,20 +36,42 @@ void mem_init(int max_heap_addr)
   mem_brkp = (char*)((int)mem_brkp & PAGE_ALIGN_MASK);
   while (new_pages(mem_brkp, PAGE_SIZE))
     mem_brkp += PAGE_SIZE;
+  mem_start = mem_brkp;
   mem_alloctop = mem_brkp + PAGE_SIZE;
 }
 
 /* 
  * mem_sbrk - simply uses the the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area.
+ *    A negative incr shrinks the heap, giving whole pages above the
+ *    new break back to the kernel.
  */
 void *mem_sbrk(int incr) 
 {
     char *old_brk = mem_brkp;
 
+    if (incr < 0) {
+      if (old_brk + incr < mem_start) {
+        return (void *)NULL;
+      }
+      mem_brkp += incr;
+
+      /* Keep the first page, which grow_pages() extends. */
+      char *keeptop = mem_brkp + PAGE_SIZE - 1;
+      keeptop = (char *)((int)keeptop & PAGE_ALIGN_MASK);
+      if (keeptop < mem_start + PAGE_SIZE) {
+        keeptop = mem_start + PAGE_SIZE;
+      }
+      if (keeptop < mem_alloctop &&
+          remove_pages_range(keeptop, mem_alloctop - keeptop) == 0) {
+        mem_alloctop = keeptop;
+      }
+
+      return (void *)old_brk;
+    }
+
     /* Error check the request. */
-    if ( (incr < 0) || ((old_brk + incr) > mem_max_addr)) {
+    if ((old_brk + incr) > mem_max_addr) {
       return (void *)NULL;
     }
 
@@ -57,8 +80,8 @@ void *mem_sbrk(int incr)
       allocincr += PAGE_SIZE - 1;
       allocincr &= PAGE_ALIGN_MASK;
 
-      /* Issue a SBRK for more memory. */
-      if (new_pages((void*)mem_alloctop, allocincr)) {
+      /* Issue a SBRK for more memory, as part of the heap's region. */
+      if (grow_pages((void*)mem_alloctop, allocincr)) {
 	return (void *)NULL;
       }
 
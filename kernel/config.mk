@@ -56,7 +56,7 @@ UPDATE_METHOD = afs
 # A list of the test programs you want compiled in from the user/progs
 # directory.
 #
-STUDENTTESTS =
+STUDENTTESTS = fork_latency vm_stats switch_cost shared_text fault_around file_map_bench heap_trim echo_latency smp_speedup
 
 ###########################################################################
 # Data files provided by course staff to build into the RAM disk
@@ -97,7 +97,8 @@ SYSCALL_OBJS = syscall.o\
 	       set_status.o get_ticks.o sleep.o print.o set_term_color.o\
 	       get_cursor_pos.o set_cursor_pos.o remove_pages.o\
 	       deschedule.o make_runnable.o yield.o readline.o\
-	       swexn.o halt.o readfile.o\
+	       swexn.o halt.o readfile.o get_vm_stats.o map_file.o\
+	       grow_pages.o remove_pages_range.o set_priority.o\
 
 ###########################################################################
 # Object files for your automatic stack handling
@@ -115,7 +116,8 @@ AUTOSTACK_OBJS = autostack.o
 # Kernel object files you provide in from kern/
 #
 KERNEL_OBJS = console.o kernel.o handlers.o task.o vm.o scheduler.o\
-	      asm_kern_to_user.o asm_page_inval.o\
+	      page_cache.o swap.o user_copy.o\
+	      asm_kern_to_user.o asm_page_inval.o asm_cpuid.o asm_user_copy.o\
 	      asm_context_switch.o\
 	      \
 	      drivers/timer_driver.o drivers/keyboard_driver.o\
@@ -123,7 +125,7 @@ KERNEL_OBJS = console.o kernel.o handlers.o task.o vm.o scheduler.o\
 	      \
 	      utils/kern_cond.o utils/kern_sem.o utils/list.o utils/loader.o\
 	      utils/malloc_wrappers.o utils/maps.o utils/kern_mutex.o\
-	      utils/tcb_hashtab.o\
+	      utils/tcb_hashtab.o utils/spinlock.o\
 	      \
 	      syscalls/asm_life_cycle.o syscalls/asm_syscalls.o\
 	      syscalls/life_cycle.o syscalls/thread_management.o\
@@ -8,7 +8,7 @@
 #include <keyhelp.h>
 
 /* libc includes */
-#include <asm.h>                /* disable_interrupts(), enable_interrupts() */
+#include <asm.h>                /* inb(), outb() */
 #include <interrupt_defines.h>  /* INT_ACK_CURRENT, INT_CTL_PORT */
 #include <console.h>
 
@@ -55,10 +55,13 @@ void add_to_kb_buf(void) {
     int new_buf_ending = 0;
     /* whether new line character is encountered */
     int if_newline = 0;
+    /* readline() may be looking at the buffer from another CPU */
+    sche_lock();
     switch (ch) {
     case '\b':
         if (kb_buf.buf_start == kb_buf.buf_ending) {
             /* buffer is empty */
+            sche_unlock();
             outb(INT_ACK_CURRENT, INT_CTL_PORT);
             return;
         }
@@ -85,11 +88,15 @@ void add_to_kb_buf(void) {
         /* normal character */
         new_buf_ending = (kb_buf.buf_ending + 1) % KB_BUF_LEN;
         /* if buffer is full */
-        if (new_buf_ending == kb_buf.buf_start) return;
+        if (new_buf_ending == kb_buf.buf_start) {
+            sche_unlock();
+            return;
+        }
         kb_buf.buf[kb_buf.buf_ending] = ch;
         kb_buf.buf_ending = new_buf_ending;
         break;
     }
+    sche_unlock();
     /* report port here, then we can get more input */
     outb(INT_ACK_CURRENT, INT_CTL_PORT);
 
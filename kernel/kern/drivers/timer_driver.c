@@ -11,6 +11,7 @@
 #include <asm.h>                /* outb() */
 #include <interrupt_defines.h>  /* INT_ACK_CURRENT, INT_CTL_PORT */
 #include <stdio.h>              /* NULL */
+#include <smp/apic.h>           /* apic_eoi, apic_ipi_others */
 
 /* debug includes */
 #include <simics.h>             /* lprintf() */
@@ -21,6 +22,8 @@
 
 static int num_ticks;
 static void (*callback_func)(); /* to store the address of callback function */
+/* set once other CPUs run, which only hear the PIT through the boot CPU */
+static int forward_ticks;
 
 /**
  * @brief Initialize timer.
@@ -36,15 +39,32 @@ void timer_init(void (*tickback)(unsigned int)) {
     outb(TIMER_PERIOD_IO_PORT, MSB(cycles_per_interrupt));
     /* initiallize callback function */
     num_ticks = 0;
+    forward_ticks = 0;
     callback_func = tickback;
 }
 
+/**
+ * @brief Passes every tick on to the other CPUs from now on.
+ */
+void timer_forward_ticks(void) {
+    forward_ticks = 1;
+}
+
 /**
  * @brief Increment num_ticks per 10 ms and set callback function.
  */
 void timer_handler() {
     num_ticks++;
     outb(INT_ACK_CURRENT, INT_CTL_PORT);
+    if (forward_ticks) apic_ipi_others(TICK_IPI_IDT_ENTRY);
+    callback_func(num_ticks);
+}
+
+/**
+ * @brief Handles a tick passed on by the boot CPU.
+ */
+void tick_ipi_handler() {
+    apic_eoi();
     callback_func(num_ticks);
 }
 
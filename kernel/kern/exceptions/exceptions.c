@@ -26,6 +26,7 @@
 #include "scheduler.h"                  /* get_cur_tcb */
 #include "asm_page_inval.h"             /* asm_page_inval */
 #include "syscalls/syscalls.h"          /* kern_halt, kern_vanish */
+#include "user_copy.h"                  /* search_fixup */
 
 /* internal functions */
 /**
@@ -44,25 +45,78 @@ static void _exn_print_error_msg(ureg_t *ureg);
  */
 static void _exn_print_ureg(ureg_t *ureg);
 
+/**
+ * @brief      handle a page fault that could not be resolved. A fault taken
+ *             by the kernel while copying user memory resumes at the fixup
+ *             of the faulting instruction, any other fault goes to
+ *             exn_handler
+ * @param error_code error code pushed by the processor
+ * @param eip        where the faulting eip is saved on the kernel stack
+ */
+static void _pagefault_unhandled(int error_code, uint32_t *eip);
+
 /**
  * @brief   handle with PAGEFAULT fault, when it is a ZFOD frame just assign a
- *          new frame to the page fault address
+ *          new frame to the page fault address, and when it is a write to a
+ *          copy-on-write page give the task its own copy of the frame
+ * @param error_code error code pushed by the processor
+ * @param eip        where the faulting eip is saved on the kernel stack
  */
-void pagefault_handler() {
+void pagefault_handler(int error_code, uint32_t *eip) {
     /* get the page fault address from cr2 */
     uint32_t pf_addr = get_cr2();
     /* get which page table entry this address belongs to  */
     uint32_t pte = get_pte(pf_addr);
 
-    if ((pte & PAGE_ALIGN_MASK) == get_zfod_frame()) {
-        /* we need to invalidate this address in TLB because we put new frame */
+    if (!(pte & PTE_PRESENT)) {
+        /* program pages are filled in on first touch */
+        if (demand_fault(pf_addr, error_code & ERROR_CODE_WR) < 0) {
+            _pagefault_unhandled(error_code, eip);
+        }
+        return;
+    }
+
+    /* the reclaim scanner leaves the task alone while it edits mappings */
+    task_t *task = get_cur_tcb()->task;
+    int handled = 1;
+    kern_mutex_lock(&(task->vm_mutex));
+    pte = get_pte(pf_addr);
+    if (!(pte & PTE_PRESENT)) {
+        /* evicted while we waited for the mutex, fault again */
+    } else if ((error_code & ERROR_CODE_WR) && (pte & PTE_USER) &&
+               !(get_pde(pf_addr) & PDE_PAGE_SIZE) &&
+               (pte & PAGE_ALIGN_MASK) == get_zfod_frame()) {
+        /* a user write to a ZFOD page, whose frame new_pages reserved; the
+         * direct map of the zero frame is a large kernel page instead.
+         * we need to invalidate this address in TLB because we put new frame */
         asm_page_inval((void *)pf_addr);
         uint32_t frame_addr = get_frame();
         set_pte(pf_addr, frame_addr, PTE_WRITE | PTE_USER | PTE_PRESENT);
+    } else if ((error_code & ERROR_CODE_WR) && cow_fault(pf_addr) == 0) {
+        /* the write can be retried on the now private frame */
+    } else if ((error_code & ERROR_CODE_WR) &&
+               (pte & (PTE_WRITE | PTE_USER)) == (PTE_WRITE | PTE_USER)) {
+        /* another thread made the page writable while we waited */
     } else {
+        handled = 0;
+    }
+    kern_mutex_unlock(&(task->vm_mutex));
+
+    if (!handled) {
         /* otherwise call handler to handle page fault */
-        exn_handler(SWEXN_CAUSE_PAGEFAULT, ERROR_CODE);
+        _pagefault_unhandled(error_code, eip);
+    }
+}
+
+static void _pagefault_unhandled(int error_code, uint32_t *eip) {
+    if (!(error_code & ERROR_CODE_US)) {
+        uint32_t fixup = search_fixup(*eip);
+        if (fixup != 0) {
+            *eip = fixup;
+            return;
+        }
     }
+    exn_handler(SWEXN_CAUSE_PAGEFAULT, ERROR_CODE);
 }
 
 /**
@@ -23,7 +23,7 @@
 #include "vm.h"
 #include "task.h"
 #include "asm_page_inval.h"
-#include "scheduler.h"              /* sche_yield */
+#include "scheduler.h"              /* sche_tick */
 #include "syscalls/asm_syscalls.h"
 #include "exceptions/asm_exceptions.h"
 #include "drivers/asm_interrupts.h"
@@ -109,6 +109,11 @@ int syscall_init() {
     idt_install(VANISH_INT,         asm_vanish,         kern_cs, flag);
     idt_install(READFILE_INT,       asm_readfile,       kern_cs, flag);
     idt_install(SWEXN_INT,          asm_swexn,          kern_cs, flag);
+    idt_install(GET_VM_STATS_INT,   asm_get_vm_stats,   kern_cs, flag);
+    idt_install(MAP_FILE_INT,       asm_map_file,       kern_cs, flag);
+    idt_install(GROW_PAGES_INT,     asm_grow_pages,     kern_cs, flag);
+    idt_install(REMOVE_RANGE_INT,   asm_remove_pages_range, kern_cs, flag);
+    idt_install(SET_PRIORITY_INT,   asm_set_priority,   kern_cs, flag);
     return 0;
 }
 
@@ -122,6 +127,7 @@ int device_init() {
     timer_init(timer_callback);
     idt_install(TIMER_IDT_ENTRY, asm_timer_handler,    kern_cs, flag);
     idt_install(KEY_IDT_ENTRY,   asm_keyboard_handler, kern_cs, flag);
+    idt_install(TICK_IPI_IDT_ENTRY, asm_tick_ipi_handler, kern_cs, flag);
     return 0;
 }
 
@@ -144,5 +150,5 @@ void idt_install(int idt_idx, void (*entry)(), int selector, int flag) {
  * @param num_ticks the number of 10 ms that is triggered.
  */
 void timer_callback(unsigned int num_ticks) {
-    sche_yield(RUNNABLE);
+    sche_tick();
 }
@@ -4,9 +4,6 @@
 #include <stdint.h>
 
 void asm_switch_to_runnable(uint32_t *cur_sp, uint32_t new_sp);
-void asm_switch_to_initialized(uint32_t *cur_sp,
-                               uint32_t new_sp,
-                               uint32_t new_ip);
 void asm_switch_to_forked(uint32_t *cur_sp,
                           uint32_t new_sp,
                           uint32_t new_ip);
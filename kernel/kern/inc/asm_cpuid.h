@@ -0,0 +1,17 @@
+/** @file asm_cpuid.h
+ *
+ */
+
+#ifndef _ASM_CPUID_H_
+#define _ASM_CPUID_H_
+
+#include <stdint.h>
+
+/* cpuid leaf 1 reports the processor feature flags in %edx */
+#define CPUID_FEATURES 1
+#define CPUID_EDX_PSE (1 << 3)
+#define CPUID_EDX_PGE (1 << 13)
+
+uint32_t asm_cpuid_edx(uint32_t leaf);
+
+#endif
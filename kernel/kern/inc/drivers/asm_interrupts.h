@@ -18,4 +18,9 @@ void asm_keyboard_handler(void);
  */
 void asm_timer_handler(void);
 
+/**
+ * @brief handler of the timer ticks passed on to the other CPUs.
+ */
+void asm_tick_ipi_handler(void);
+
 #endif
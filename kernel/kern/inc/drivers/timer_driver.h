@@ -11,6 +11,8 @@
 
 #define MS_PER_INTERRUPT 10
 #define MS_PER_S 1000
+/* the boot CPU passes timer ticks on to the others with this vector */
+#define TICK_IPI_IDT_ENTRY 0x30
 
 #define LSB(addr) (addr & 0x00ff)
 #define MSB(addr) ((addr & 0xff00) >> 8)
@@ -21,6 +23,8 @@
  */
 void timer_init(void (*tickback)(unsigned int));
 
+void timer_forward_ticks(void);
+
 int get_timer_ticks();
 
 #endif
@@ -5,6 +5,8 @@
 #ifndef _EXCEPTIONS_H_
 #define _EXCEPTIONS_H_
 
+#include <stdint.h>
+
 /* flags for whether an exception pushes an error code */
 #define NO_ERROR_CODE 0
 #define ERROR_CODE 1
@@ -19,7 +21,7 @@
 #define N_REGISTERS 8
 #define N_SEGMENTS 4
 
-void pagefault_handler();
+void pagefault_handler(int error_code, uint32_t *eip);
 
 void hwerror_handler(int cause, int ec_flag);
 
@@ -0,0 +1,43 @@
+/** @file page_cache.h
+ *  @brief Cache of read-only program pages shared between tasks.
+ *  @author Newton Xie (ncx)
+ *  @author Qiaoyu Deng (qdeng)
+ *  @bug No known bugs.
+ */
+
+#ifndef _PAGE_CACHE_H_
+#define _PAGE_CACHE_H_
+
+#include <stdint.h>
+#include <vm_stats.h>
+
+/* number of hash buckets, and most frames the cache may keep */
+#define PAGE_CACHE_BUCKETS 64
+#define PAGE_CACHE_MAX_FRAMES 1024
+
+/** @brief  A cached page of a file image.
+ *
+ *  A page is identified by the image bytes that start it and the user
+ *  address it is mapped at, since a page straddling two sections holds the
+ *  tail of one and the head of the next.
+ */
+typedef struct page_cache_entry {
+    const char *src;
+    uint32_t page;
+    uint32_t frame;
+    struct page_cache_entry *next;
+} page_cache_entry_t;
+
+int page_cache_init(void);
+
+uint32_t page_cache_get(const char *src, uint32_t page);
+
+void page_cache_put(const char *src, uint32_t page, uint32_t frame);
+
+int page_cache_reclaim(int n);
+
+void page_cache_count_direct(void);
+
+void page_cache_get_stats(vm_stats_t *stats);
+
+#endif /* _PAGE_CACHE_H_ */
@@ -1,6 +1,8 @@
 #ifndef __H_SCHEDULER__
 #define __H_SCHEDULER__
 
+#include <syscall.h>                  /* PRIORITY_LOW */
+#include <smp/smp.h>                  /* MAX_CPUS */
 #include "utils/kern_mutex.h"
 #include "utils/list.h"
 #include "task.h"
@@ -18,20 +20,43 @@
 #define TCB_TO_SCHE_NODE(tcb_ptr)\
         ((sche_node_t *)((char *)tcb_ptr - 24))
 
-typedef struct schedule_list_struct {
-    list_t *active_list;
-    list_t *sleeping_list;
-} schedule_t;
+/* run queue levels, from the highest priority down */
+#define SCHE_NUM_LEVELS (PRIORITY_LOW + 1)
+/* time slice of the highest level in ticks, doubled at each level below */
+#define SCHE_BASE_SLICE 1
+/* every thread goes back to its highest level this often, in ticks */
+#define SCHE_BOOST_TICKS 100
 
 typedef node_t sche_node_t;
 typedef node_t tcb_tb_node_t;
 
+/* one FIFO list per priority level for each CPU, and what the CPU runs */
+typedef struct run_queue_struct {
+    list_t *active_lists[SCHE_NUM_LEVELS];
+    sche_node_t *cur_sche_node;
+    thread_t *idle_thread;
+} run_queue_t;
+
 int scheduler_init();
 
+void sche_lock(void);
+
+void sche_unlock(void);
+
+void sche_set_idle_thread(int cpu, thread_t *tcb_ptr);
+
+void sche_start_cpu(int cpu);
+
+void sche_get_stats(int *num_cpus, unsigned int *num_steals);
+
 void set_cur_run_thread(thread_t *tcb_ptr);
 
 void sche_yield(int status);
 
+void sche_tick(void);
+
+void sche_set_priority(thread_t *tcb_ptr, int priority);
+
 thread_t *get_cur_tcb();
 
 void sche_push_back(thread_t *tcb_ptr);
@@ -0,0 +1,56 @@
+/** @file swap.h
+ *  @brief Compressed in-memory store for pages evicted from user memory.
+ *  @author Newton Xie (ncx)
+ *  @author Qiaoyu Deng (qdeng)
+ *  @bug No known bugs.
+ */
+
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+#include <stdint.h>
+#include <vm_stats.h>
+
+/* most pages, and most compressed bytes, kept in the kernel heap */
+#define SWAP_MAX_SLOTS 8192
+#define SWAP_MAX_BYTES (4 * 1024 * 1024)
+/* pages that do not compress below this many bytes are not worth storing */
+#define SWAP_MAX_COMPRESSED (PAGE_SIZE * 3 / 4)
+
+/*
+ * A swapped out page keeps a non-present page table entry holding its slot
+ * in the address bits, and the flags it had while present.
+ */
+#define PTE_SWAPPED (0x400)
+#define PTE_TO_SLOT(pte) ((int)((pte) >> 12))
+#define SLOT_TO_PTE(slot) ((uint32_t)(slot) << 12)
+
+/** @brief  A compressed page.
+ *
+ *  A page of zeroes is stored with no data at all. refcount counts the page
+ *  table entries holding the slot, since fork shares swapped out pages
+ *  between parent and child. A free slot has refcount 0.
+ */
+typedef struct swap_slot {
+    char *data;
+    uint16_t len;
+    uint16_t refcount;
+} swap_slot_t;
+
+int swap_init(void);
+
+int swap_store(const void *src);
+
+void swap_load(int slot, void *dest);
+
+void swap_dup(int slot);
+
+void swap_put(int slot);
+
+void swap_count_eviction(void);
+
+void swap_count_refault(void);
+
+void swap_get_stats(vm_stats_t *stats);
+
+#endif /* _SWAP_H_ */
@@ -51,6 +51,16 @@ void asm_readfile(void);
 
 void asm_swexn(void);
 
+void asm_get_vm_stats(void);
+
+void asm_map_file(void);
+
+void asm_grow_pages(void);
+
+void asm_remove_pages_range(void);
+
+void asm_set_priority(void);
+
 /* syscall helper function */
 uint32_t asm_get_esi();
 
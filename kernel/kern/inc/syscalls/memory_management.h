@@ -5,4 +5,12 @@ int kern_new_pages(void);
 
 int kern_remove_pages(void);
 
+int kern_map_file(void);
+
+int kern_grow_pages(void);
+
+int kern_remove_pages_range(void);
+
+int kern_get_vm_stats(void);
+
 #endif
\ No newline at end of file
@@ -13,4 +13,6 @@ int kern_sleep(void);
 
 int kern_swexn(void);
 
+int kern_set_priority(void);
+
 #endif
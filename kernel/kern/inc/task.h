@@ -20,6 +20,15 @@
 #define USER_STACK_SIZE 0x4000
 #define USER_STACK_START 0xFFB03E00
 
+/*
+ * pages mapped by a demand fault, counting the faulting page: the window
+ * starts at FAULT_AROUND_PAGES and doubles up to FAULT_AROUND_MAX_PAGES
+ * while faults keep landing right after the previous window. Setting both
+ * to 1 turns fault-around off.
+ */
+#define FAULT_AROUND_PAGES 4
+#define FAULT_AROUND_MAX_PAGES 32
+
 #define LIST_NODE_TO_TCB(thread_node) ((thread_t *)((char *)thread_node + 8))
 #define TCB_TO_LIST_NODE(thread) ((thread_node_t *)((char *)thread - 8))
 
@@ -62,12 +71,40 @@ typedef struct task {
      */
     kern_mutex_t vanish_mutex;
     struct task *parent_task;
+
+    /*
+     * Frames reserved for pages of the task's regions that have not been
+     * touched yet. The vm_mutex protects the count, and serializes demand
+     * faults so that each page is only filled in once.
+     */
+    int pending_frames;
+    kern_mutex_t vm_mutex;
+
+    /* fault-around window, and where the next sequential fault would be */
+    int fault_window;
+    uint32_t fault_next;
+
+    /*
+     * The CPU whose run queues the task's threads wait in. All of them run
+     * there, so that a change to the task's mappings only has to be flushed
+     * from that CPU's TLB. Protected by the scheduler lock.
+     */
+    int cpu;
+    /*
+     * threads running or waiting in a run queue, the task only moves to
+     * another CPU when this is the one being moved. Protected by the
+     * scheduler lock.
+     */
+    int num_active;
 } task_t;
 
 /** @brief  Thread control block structure.
  *
  *  Contains tid, status, a pointer to the parent task, stack and instruction
- *  pointer information, and exception handler information.
+ *  pointer information, and exception handler information. The scheduler
+ *  keeps the thread's run queue level and what is left of its time slice,
+ *  and the priority hint set by set_priority(), which is the highest level
+ *  the thread may run at.
  */
 typedef struct thread {
     int tid;
@@ -81,6 +118,10 @@ typedef struct thread {
     void *swexn_sp;
     swexn_handler_t swexn_handler;
     void *swexn_arg;
+
+    int priority;
+    int sche_level;
+    int slice_left;
 } thread_t;
 
 /** @brief  Structure used for blocking on wait().
@@ -146,12 +187,13 @@ void thread_destroy(thread_t *thread);
 
 int validate_user_mem(uint32_t addr, uint32_t len, int perms);
 
-int validate_user_string(uint32_t addr, int max_len);
+int load_program(simple_elf_t *header, task_t *task);
+
+int reserve_kernel_maps(map_list_t *maps);
 
-int load_program(simple_elf_t *header, map_list_t *maps);
+int demand_fault(uint32_t addr, int write);
 
-int load_elf_section(const char *fname, unsigned long start, unsigned long len,
-                     long offset, int pte_flags);
+void task_vm_clear(task_t *task);
 
 void orphan_children(task_t *task);
 
@@ -0,0 +1,29 @@
+/** @file user_copy.h
+ *  @author Qiaoyu Deng (qdeng)
+ *  @bug No known bugs.
+ */
+
+#ifndef _USER_COPY_H_
+#define _USER_COPY_H_
+
+#include <stdint.h>
+
+/** @brief  An instruction that may fault on user memory.
+ *
+ *  A fault at insn that cannot be resolved resumes at fixup, which makes the
+ *  copy fail instead of killing the thread.
+ */
+typedef struct fixup_entry {
+    uint32_t insn;
+    uint32_t fixup;
+} fixup_entry_t;
+
+int copy_from_user(void *dest, const void *src, int len);
+
+int copy_to_user(void *dest, const void *src, int len);
+
+int strncpy_from_user(char *dest, const char *src, int max_len);
+
+uint32_t search_fixup(uint32_t eip);
+
+#endif /* _USER_COPY_H_ */
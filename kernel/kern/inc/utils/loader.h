@@ -14,4 +14,6 @@
 
 int getbytes( const char *filename, int offset, int size, char *buf );
 
+const char *get_file_bytes( const char *filename, int *len );
+
 #endif /* _LOADER_H */
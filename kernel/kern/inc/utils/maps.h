@@ -14,17 +14,29 @@
 #define MAP_WRITE 0x2
 #define MAP_EXECUTE 0x4
 #define MAP_REMOVE 0x8
+#define MAP_MERGE 0x10
 
 /** @brief Represents a memory map.
  *
  *  Attributes include the low and high (inclusive) addresses of a memory
  *  region. Also stores the associated permissions in the form of an OR of
  *  flags defined at the top of this header file.
+ *
+ *  A map may be backed by a file image, in which case its pages are filled
+ *  in when first touched: the first file_len bytes of the region come from
+ *  file_bytes, and the rest of the region reads as zero. Anonymous maps have
+ *  a NULL file_bytes.
+ *
+ *  An anonymous MAP_MERGE map does not keep a start of its own: it joins an
+ *  anonymous map with the same other permissions that ends right below it,
+ *  and a MAP_MERGE map inserted right below it joins it in turn.
  */
 typedef struct map {
     uint32_t low;
     uint32_t high;
     int perms;
+    const char *file_bytes;
+    uint32_t file_len;
 } map_t;
 
 /* 
@@ -49,6 +61,9 @@ void maps_destroy(map_list_t *maps);
 void maps_clear(map_list_t *maps);
 
 /** @brief  Inserts a mapped region into a map list.
+ *
+ *  A MAP_MERGE region is merged with its neighbours where they allow it.
+ *
  *  @param  maps    A pointer to a map_list_t structure.
  *          low     The start of the mapped region.
  *          high    The end of the mapped region (inclusive).
@@ -57,7 +72,23 @@ void maps_clear(map_list_t *maps);
  */
 int maps_insert(map_list_t *maps, uint32_t low, uint32_t high, int perms);
 
+/** @brief  Inserts a file backed region into a map list.
+ *  @param  maps        A pointer to a map_list_t structure.
+ *          low         The start of the mapped region.
+ *          high        The end of the mapped region (inclusive).
+ *          perms       An OR of permission flags, as defined above.
+ *          file_bytes  The file contents backing the start of the region.
+ *          file_len    The number of bytes backed by the file.
+ *  @return 0 on success and negative on failure.
+ */
+int maps_insert_file(map_list_t *maps, uint32_t low, uint32_t high, int perms,
+                     const char *file_bytes, uint32_t file_len);
+
 /** @brief  Finds a map in a map list which intersects with a given region.
+ *
+ *  Takes no lock, and answers from the list's cache of recently found
+ *  regions when the search region lies inside one of them.
+ *
  *  @param  maps    A pointer to a map_list_t structure.
  *          low     The start of the search region.
  *          high    The end of the search region (inclusive).
@@ -68,16 +99,44 @@ map_t *maps_find(map_list_t *maps, uint32_t low, uint32_t high);
 /** @brief  Deletes a mapped region from a map list.
  *  @param  maps    A pointer to a map_list_t structure.
  *          low     Must be equal to the low value of a map in the list.
+ *  @return 0 on success and negative on failure, in which case the list is
+ *          unchanged.
  */
-void maps_delete(map_list_t *maps, uint32_t low);
+int maps_delete(map_list_t *maps, uint32_t low);
+
+/** @brief  Deletes part of a mapped region from a map list.
+ *
+ *  What is left of the region below and above the deleted part stays
+ *  mapped as separate regions, file backed ones at the right file offset.
+ *
+ *  @param  maps    A pointer to a map_list_t structure.
+ *          low     The start of the part to delete.
+ *          high    The end of the part to delete (inclusive), which must lie
+ *                  in the same region as low.
+ *  @return 0 on success and negative on failure, in which case the list is
+ *          unchanged.
+ */
+int maps_delete_range(map_list_t *maps, uint32_t low, uint32_t high);
 
 /** @brief  Makes a copy of a map list.
+ *
+ *  Takes constant time: the two lists share their tree, and each copies
+ *  the shared nodes that a later change to it touches.
+ *
  *  @param  from    A pointer to a map_list_t structure.
  *          to      A pointer to a map list which must be empty (initialized).
  *  @return 0 on success and negative on failure.
  */
 int maps_copy(map_list_t *from, map_list_t *to);
 
+/** @brief  Reports how many lookups the list's cache answered.
+ *  @param  maps    A pointer to a map_list_t structure.
+ *          hits    Set to the number of lookups answered by the cache.
+ *          misses  Set to the number of lookups that walked the tree.
+ */
+void maps_get_cache_stats(map_list_t *maps, unsigned int *hits,
+                          unsigned int *misses);
+
 /** @brief  Prints a map list to Simics (debugging tool only).
  *  @param  maps    A pointer to a map_list_t structure.
  */
@@ -9,6 +9,13 @@
 #define _MAPS_INTERNAL_H_
 
 #include "utils/kern_mutex.h"
+#include "utils/spinlock.h"
+#include "utils/maps.h"
+
+/* regions remembered by a map list's lookup cache */
+#define MAPS_CACHE_SIZE 4
+/* no AVL tree of 32 bit regions is deeper than this */
+#define MAPS_MAX_DEPTH 48
 
 /** @brief Wraps a map_t struct with a binary tree node.
  *
@@ -17,30 +24,66 @@
  *  The map_node_t struct is used when creating a new tree node in order
  *  to avoid multiple calls to malloc(). It is not exposed to users of the
  *  maps interface.
+ *
+ *  Trees are persistent: a node may be shared by the trees of several map
+ *  lists, and refs counts the list roots and parent nodes pointing to it.
+ *  A node with more than one reference is never changed; changes copy the
+ *  shared nodes on the path they take instead.
  */
 typedef struct map_node {
     struct map map;
     int height;
+    int refs;
 
     struct map_node *left;
     struct map_node *right;
 } map_node_t;
 
+/** @brief A region found by a lookup, valid while seq is unchanged.
+ */
+typedef struct map_cache_entry {
+    unsigned int seq;
+    map_node_t *node;
+} map_cache_entry_t;
+
 /** @brief Represents a list of memory maps.
  *
  *  This struct is exposed to users as an abstract map_list_t type. A typedef
  *  is given in maps.h. It contains a pointer to the map_node_t at the root
  *  of the maps tree.
+ *
+ *  Changes to the tree are made under the mutex, and bump seq before and
+ *  after, so seq is odd while a change is in progress. Lookups take no lock:
+ *  they walk the tree and retry if seq changed meanwhile. Nodes no longer in
+ *  any tree are kept for reuse instead of being freed, so a lookup racing
+ *  with a change never follows a pointer out of the map nodes. The last few
+ *  regions found are cached, tagged with seq, under cache_lock.
+ *
+ *  Before a change, enough nodes for any copying it does are set aside on
+ *  spare_nodes, so that a change never fails halfway.
  */
 struct map_list {
     map_node_t *root;
     kern_mutex_t mutex;
+    volatile unsigned int seq;
+    map_node_t *spare_nodes;
+    int num_spare_nodes;
+
+    spinlock_t cache_lock;
+    map_cache_entry_t cache[MAPS_CACHE_SIZE];
+    int cache_next;
+    unsigned int cache_hits;
+    unsigned int cache_misses;
 };
 
 /** @brief Returns the max of two integers.
  */
 int max(int a, int b);
 
+/** @brief Returns the min of two addresses or lengths.
+ */
+uint32_t min(uint32_t a, uint32_t b);
+
 /** @brief Returns the height of a tree node.
  */
 int get_height(map_node_t *node);
@@ -71,29 +114,70 @@ int get_balance(map_node_t *tree);
 void copy_map(map_node_t *from, map_node_t *to);
 
 /** @brief  Performs an AVL right rotation on a maps tree.
- *  @param  old_root  A pointer to the tree root.
+ *
+ *  The nodes changed by the rotation are made private first.
+ *
+ *  @param  maps      The map list the tree belongs to.
+ *          old_root  A pointer to the tree root.
  *  @return A pointer to the root of the rotated tree.
  */
-map_node_t *rotate_right(map_node_t *old_root);
+map_node_t *rotate_right(map_list_t *maps, map_node_t *old_root);
 
 /** @brief  Performs an AVL left rotation on a maps tree.
- *  @param  old_root  A pointer to the tree root.
+ *
+ *  The nodes changed by the rotation are made private first.
+ *
+ *  @param  maps      The map list the tree belongs to.
+ *          old_root  A pointer to the tree root.
  *  @return A pointer to the root of the rotated tree.
  */
-map_node_t *rotate_left(map_node_t *old_root);
+map_node_t *rotate_left(map_list_t *maps, map_node_t *old_root);
 
-/** @brief  Makes a map node.
- *  @param  low     Map start.
+/** @brief  Makes a map node with one reference, taking one of the nodes set
+ *          aside for the list if there are any.
+ *  @param  maps    The map list the node is for.
+ *          low     Map start.
  *          high    Map end (inclusive).
  *          perms   Map perms (an OR of flags defined in maps.h).
  *  @return A pointer to a height 1 map node, or NULL on failure.
  */
-map_node_t *tree_node(uint32_t low, uint32_t high, int perms);
+map_node_t *tree_node(map_list_t *maps, uint32_t low, uint32_t high,
+                      int perms);
+
+/** @brief  Returns a map node no longer in any tree to the shared pool of
+ *          spare nodes.
+ *  @param  node    The node to release.
+ */
+void tree_node_release(map_node_t *node);
 
-/** @brief  Deletes a maps tree.
+/** @brief  Sets aside enough spare nodes for a few changes to a tree.
  *
- *  Recursively calls tree_destroy on left and right subtrees, then frees
- *  the map node memory.
+ *  A change copies at most the shared nodes on its path and the shared
+ *  nodes its rotations move, so a few nodes per level of the tree suffice.
+ *
+ *  @param  maps         The map list about to be changed.
+ *          num_changes  The number of inserts and deletes to be made.
+ *  @return 0 on success, negative if the nodes could not be allocated.
+ */
+int tree_reserve(map_list_t *maps, int num_changes);
+
+/** @brief  Makes a tree root private to the caller's tree.
+ *
+ *  If the node has only the caller's reference it is returned as is.
+ *  Otherwise the caller's reference is traded for a copy of the node, which
+ *  takes references to the node's children. The copy comes from the nodes
+ *  set aside by tree_reserve.
+ *
+ *  @param  maps    The map list the tree belongs to.
+ *          tree    A pointer to the tree root (not NULL).
+ *  @return A pointer to a node with one reference.
+ */
+map_node_t *tree_private(map_list_t *maps, map_node_t *tree);
+
+/** @brief  Drops a reference to a maps tree.
+ *
+ *  If it was the last reference, tree_destroy is called recursively on the
+ *  left and right subtrees, and the map node is released.
  *
  *  @param  tree    A pointer to the tree root.
  */
@@ -106,25 +190,30 @@ void tree_destroy(map_node_t *tree);
  *
  *  If the tree is empty (tree == NULL), returns the node.
  *
- *  Otherwise, recursively calls tree_insert to insert the node into the
- *  appropriate subtree. After insertion, the subtrees will be well-formed
- *  and balanced, with correct heights. Subtrees heights are compared, and
- *  if it is determined that the current tree is imbalanced, then necessary
- *  rotations are applied, producing a new tree satisfying AVL invariants.
+ *  Otherwise, makes the root private and recursively calls tree_insert to
+ *  insert the node into the appropriate subtree. After insertion, the
+ *  subtrees will be well-formed and balanced, with correct heights. Subtrees
+ *  heights are compared, and if it is determined that the current tree is
+ *  imbalanced, then necessary rotations are applied, producing a new tree
+ *  satisfying AVL invariants.
  *
- *  @param  tree    A pointer to the tree root.
+ *  Only shared nodes on the insertion path or moved by rotations are
+ *  copied. The caller must have called tree_reserve first.
+ *
+ *  @param  maps    The map list the tree belongs to.
+ *          tree    A pointer to the tree root.
  *          node    A pointer to the map node to be inserted.
  *  @return A pointer to the root of the new tree.
  */
-map_node_t *tree_insert(map_node_t *tree, map_node_t *node);
+map_node_t *tree_insert(map_list_t *maps, map_node_t *tree, map_node_t *node);
 
 /** @brief  Finds a map node which overlaps with a given region.
  *
  *  If the tree is empty (tree == NULL), returns NULL.
  *
- *  If the tree's root map node intersects with the search region, then a
- *  pointer to the root is returned. Otherwise, recursively calls tree_find
- *  on the appropriate subtree.
+ *  Walks down from the root until a map node intersects with the search
+ *  region. The walk gives up after MAPS_MAX_DEPTH nodes, which only happens
+ *  if the tree changed under a lockless lookup.
  *
  *  @param  tree    A pointer to the tree root.
  *          low     Search region start value.
@@ -137,9 +226,13 @@ map_node_t *tree_find(map_node_t *tree, uint32_t low, uint32_t high);
  *
  *  The low parameter must be the start value of a map present in the tree.
  *
- *  CASE 1: The tree is a singleton. Then the root is freed, returning NULL.
- *  CASE 2: The tree only has one subtree. In this case the root is freed, and
- *          a pointer to the non-empty subtree is returned.
+ *  Nodes on the path to the deleted node are made private first, which
+ *  requires the caller to have called tree_reserve.
+ *
+ *  CASE 1: The tree is a singleton. Then the root is released, returning
+ *          NULL.
+ *  CASE 2: The tree only has one subtree. In this case the root is released,
+ *          and a pointer to the non-empty subtree is returned.
  *  CASE 3: The tree has two subtrees. Then the map_t attibutes of the smallest
  *          node in the right subtree are copied to the root of the tree, and
  *          that node is removed by a recursive call to tree_delete.
@@ -148,22 +241,12 @@ map_node_t *tree_find(map_node_t *tree, uint32_t low, uint32_t high);
  *          the current tree is imbalanced, then necessary rotations are
  *          applied, producing a new tree satisfying AVL invariants.
  *
- *  @param  tree    A pointer to the tree root.
+ *  @param  maps    The map list the tree belongs to.
+ *          tree    A pointer to the tree root.
  *          low     The start value in the map_t of the map node to be deleted.
  *  @return A pointer to the root of the new tree.
  */
-map_node_t *tree_delete(map_node_t *tree, uint32_t low);
-
-/** @brief  Makes a copy of a maps tree.
- *
- *  If the tree is empty, then NULL is returned. Otherwise, a new node is
- *  created with the same map_t attributes as the tree's root. The left and
- *  right subtree copies are then filled in by recursive calls.
- *
- *  @param  tree    A pointer to the root of the tree to be copied.
- *  @return A pointer to the root of the copy, or NULL on failure.
- */
-map_node_t *tree_copy(map_node_t *tree);
+map_node_t *tree_delete(map_list_t *maps, map_node_t *tree, uint32_t low);
 
 /** @brief  Prints the contents of a maps tree to Simics.
  *
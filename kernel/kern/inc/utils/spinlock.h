@@ -0,0 +1,32 @@
+/** @file spinlock.h
+ *  @brief Spinlock header file.
+ *
+ *  @author Qiaoyu Deng (qdeng)
+ *  @bug none known
+ */
+
+#ifndef _SPINLOCK_H_
+#define _SPINLOCK_H_
+
+#include <stdint.h>
+
+/*
+ * A lock for data shared between CPUs, held only for a few instructions.
+ * Interrupts are disabled while it is held, so the holder is neither
+ * preempted nor interrupted by a handler that wants the lock too.
+ */
+typedef struct spinlock {
+    volatile int locked;
+    int cpu;            /* the CPU holding the lock, -1 when it is free */
+    uint32_t eflags;    /* the holder's eflags before it took the lock */
+} spinlock_t;
+
+void spin_init(spinlock_t *lock);
+
+void spin_lock(spinlock_t *lock);
+
+void spin_unlock(spinlock_t *lock);
+
+int spin_held(spinlock_t *lock);
+
+#endif
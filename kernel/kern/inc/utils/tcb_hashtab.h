@@ -16,6 +16,8 @@ typedef struct tcb_hashtab {
 int tcb_hashtab_init();
 void tcb_hashtab_put(thread_t *tcb);
 thread_t *tcb_hashtab_get(int tid);
+thread_t *tcb_hashtab_get_locked(int tid);
+void tcb_hashtab_cli_unlock(int tid);
 void tcb_hashtab_rmv(thread_t *tcb);
 
 #endif /* _TCB_HASHTAB_H_ */
@@ -7,6 +7,9 @@
 #define _VM_H_
 
 #include <stdint.h>
+#include <vm_stats.h>
+
+#include "utils/kern_mutex.h"
 
 #define PAGE_ALIGN_MASK (~(PAGE_SIZE - 1))
 #define PAGE_FLAG_MASK (~PAGE_ALIGN_MASK)
@@ -14,45 +17,163 @@
 #define PTE_PRESENT (0x1)
 #define PTE_WRITE (0x2)
 #define PTE_USER (0x4)
+/* for device registers: writes go straight through and nothing is cached */
+#define PTE_WRITE_THROUGH (0x8)
+#define PTE_NO_CACHE (0x10)
+/* set by the processor when the page is read or written, and written */
+#define PTE_ACCESSED (0x20)
+#define PTE_DIRTY (0x40)
+/* the translation is kept in the TLB across cr3 reloads */
+#define PTE_GLOBAL (0x100)
+/* software bit: write-protected because the frame is shared copy-on-write */
+#define PTE_COW (0x200)
 
 #define PDE_PRESENT (0x1)
 #define PDE_WRITE (0x2)
 #define PDE_USER (0x4)
+/* the entry maps a 4MB page instead of pointing to a page table */
+#define PDE_PAGE_SIZE (0x80)
+
+#define LARGE_PAGE_SIZE (0x400000)
+#define LARGE_PAGE_MASK (~(LARGE_PAGE_SIZE - 1))
 
 #define CR0_PG (1 << 31)
 #define CR4_PGE (1 << 7)
 
-#define RW_PHYS_PD_INDEX 1023
-#define RW_PHYS_PT_INDEX 1023
-#define RW_PHYS_VA 0xFFFFF000
+/*
+ * the top 4MB of every address space belongs to the kernel, and its last
+ * KMAP_NUM_SLOTS pages are slots for temporarily mapping physical frames
+ */
+#define KMAP_PD_INDEX 1023
+#define KMAP_REGION_LOW 0xFFC00000
+#define KMAP_NUM_SLOTS 16
+#define KMAP_VA_LOW 0xFFFF0000
+/* the last slot is only used by the idle thread to clear frames */
+#define KMAP_IDLE_SLOT (KMAP_NUM_SLOTS - 1)
+
+/*
+ * the direct map of physical memory ends right below the page table of the
+ * user stack, and covers at most 1GB
+ */
+#define DIRECT_MAP_HIGH 0xFF800000
+#define DIRECT_MAP_MAX_TABLES 256
 
 #define NUM_PD_ENTRIES 1024
 #define NUM_PT_ENTRIES 1024
 #define NUM_KERN_TABLES 4
 #define NUM_KERN_PAGES 4096
 
-int vm_init();
+/* buddy allocator block sizes go from 1 frame up to 4MB */
+#define MAX_ORDER (VM_STATS_ORDERS - 1)
+#define NUM_ORDERS VM_STATS_ORDERS
+/* a 4MB large page is backed by a single buddy block of this order */
+#define LARGE_PAGE_ORDER 10
+#define FRAMES_PER_LARGE_PAGE (1 << LARGE_PAGE_ORDER)
+
+/* a chain of frames on their way to or from the buddy allocator */
+typedef struct frame_batch {
+    struct page *head;
+    int num_frames;
+} frame_batch_t;
+
+/* more pages than this to invalidate at once and the whole TLB is flushed */
+#define TLB_GATHER_MAX 32
+
+/* pages of an address space whose stale translations must be dropped */
+typedef struct tlb_gather {
+    uint32_t *page_dir;
+    uint32_t addrs[TLB_GATHER_MAX];
+    int num_pages;
+} tlb_gather_t;
+
+int vm_init(int use_direct_map);
+
+uint32_t get_direct_map_low(void);
+
+void vm_init_cpu(void);
+
+void vm_map_lapic(void);
 
 uint32_t get_pte(uint32_t addr);
 
 int set_pte(uint32_t addr, uint32_t frame_addr, int flags);
 
+uint32_t get_pde(uint32_t addr);
+
+int map_large_page(uint32_t addr);
+
+void unmap_large_page(uint32_t addr);
+
+int split_large_page(uint32_t addr);
+
 uint32_t get_frame();
 
 void free_frame(uint32_t frame);
 
+void zero_pool_refill(void);
+
+uint32_t alloc_frames(int order);
+
+void free_frames(uint32_t addr, int order);
+
+void frame_batch_init(frame_batch_t *batch);
+
+uint32_t frame_batch_pop(frame_batch_t *batch);
+
+void put_frame_batched(frame_batch_t *batch, uint32_t frame);
+
+void free_frames_batch(frame_batch_t *batch);
+
+int get_frames_batch(frame_batch_t *batch, int n);
+
+void tlb_gather_init(tlb_gather_t *gather, uint32_t *page_dir);
+
+void tlb_gather_page(tlb_gather_t *gather, uint32_t addr);
+
+void tlb_gather_flush(tlb_gather_t *gather);
+
+void vm_get_stats(vm_stats_t *stats);
+
+void inc_frame_ref(uint32_t frame);
+
+int get_frame_ref(uint32_t frame);
+
+void put_frame(uint32_t frame);
+
 int dec_num_free_frames(int n);
 
 void inc_num_free_frames(int n);
 
 uint32_t *page_dir_init();
 
+int page_dir_num_tables(uint32_t *page_dir);
+
 int page_dir_clear(uint32_t *page_dir);
 
+void page_dir_destroy(uint32_t *page_dir);
+
 int page_dir_copy(uint32_t *new_page_dir, uint32_t *old_page_dir);
 
+int cow_fault(uint32_t addr);
+
+void *kmap(uint32_t frame);
+
+void kunmap(void *addr);
+
+void copy_frame(uint32_t dest, uint32_t src);
+
 void undo_page_dir_copy(uint32_t *page_dir);
 
+void vm_set_page_dir_lock(uint32_t *page_dir, kern_mutex_t *lock);
+
+void merge_scan(void);
+
+int swap_in_page(uint32_t addr);
+
+void vm_count_demand_fault(int num_around);
+
+void vm_switch_page_dir(uint32_t *page_dir);
+
 uint32_t *get_kern_page_dir(void);
 
 uint32_t get_zfod_frame(void);
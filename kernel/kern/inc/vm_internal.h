@@ -10,11 +10,75 @@
 
 #define PD_INDEX(addr) ((addr >> 22) & 0x3FF)
 #define PT_INDEX(addr) ((addr >> 12) & 0x3FF)
+#define INDEX_TO_ADDR(pd_index, pt_index) \
+    (((uint32_t)(pd_index) << 22) | ((uint32_t)(pt_index) << 12))
 #define ENTRY_TO_ADDR(pte) ((void *)(pte & PAGE_ALIGN_MASK))
+#define FRAME_TO_PAGE(frame) (&pages[(frame) / PAGE_SIZE])
+#define PAGE_TO_FRAME(page) ((uint32_t)((page) - pages) * PAGE_SIZE)
+
+/* page_t flags */
+#define PAGE_FREE 0x1
+#define PAGE_KERNEL 0x2
+#define PAGE_ZEROED 0x4
+/* read-only frame shared by pages found to have the same contents */
+#define PAGE_MERGED 0x8
+
+/* frames kept cleared for get_frame(), and how many to clear per idle tick */
+#define ZERO_POOL_SIZE 256
+#define ZERO_POOL_REFILL_BATCH 16
+
+/* zeroed page tables kept for reuse instead of going back to the heap */
+#define PAGE_TAB_CACHE_SIZE 64
+
+/* slots in each same-page merging table, and frames scanned per idle call */
+#define MERGE_TABLE_SIZE 1024
+#define MERGE_SCAN_BATCH 32
 
 #define CHECK_ALLOC(addr) if (addr == NULL) lprintf("bad malloc")
 
-void access_physical(uint32_t addr);
+/** @brief  Metadata kept for every physical frame.
+ *
+ *  The first page of a free buddy block is linked into the free area of its
+ *  order through next and prev, so allocating and freeing never has to map
+ *  the frame itself. owner is the page directory that allocated the frame,
+ *  and is cleared once the frame is shared between address spaces. vaddr is
+ *  where the frame was last mapped in it, which lets the reclaim scanner
+ *  find the page table entry of a private frame.
+ *
+ *  Page directories and page tables live in kernel memory, whose frames
+ *  never reach the allocator. For those, refcount counts the page tables of
+ *  a page directory, or the non-zero entries of a page table. The owner of
+ *  a page directory is the mutex of its task, see vm_set_page_dir_lock().
+ */
+typedef struct page {
+    struct page *next;
+    struct page *prev;
+    uint16_t refcount;
+    uint8_t flags;
+    uint8_t order;
+    void *owner;
+    uint32_t vaddr;
+} page_t;
+
+/** @brief  A page remembered by the same-page merging scanner.
+ *
+ *  Entries of the stable table are PAGE_MERGED frames. Entries of the
+ *  unstable table are private pages seen once, which may have changed or
+ *  moved since, so they are checked again before use.
+ */
+typedef struct merge_entry {
+    uint32_t frame;
+    uint32_t hash;
+    uint32_t *page_dir;
+    uint32_t vaddr;
+} merge_entry_t;
+
+/** @brief  List of free buddy blocks of one order.
+ */
+typedef struct free_area {
+    page_t *head;
+    int num_blocks;
+} free_area_t;
 
 void read_physical(void *virtual_dest, uint32_t phys_src, uint32_t n);
 
@@ -10,6 +10,8 @@
 
 /* libc includes. */
 #include <stdio.h>
+#include <stdlib.h>                     /* panic */
+#include <string.h>                     /* strcmp */
 #include <simics.h>                     /* lprintf() */
 #include <console.h>                    /* clear_console */
 
@@ -17,29 +19,39 @@
 #include <multiboot.h>                  /* boot_info */
 
 /* x86 specific includes */
-#include <x86/asm.h>                    /* enable_interrupts() */
 #include <x86/cr.h>
 #include <x86/eflags.h>
 
+/* multiprocessor support */
+#include <smp/smp.h>                    /* smp_boot, smp_get_cpu */
+#include <smp/mptable.h>                /* smp_init, smp_num_cpus */
+
 #include "handlers.h"                   /* handler_init */
 #include "vm.h"                         /* vm_init */
+#include "page_cache.h"                 /* page_cache_init */
+#include "swap.h"                       /* swap_init */
 #include "task.h"                       /* task_init, thread_init */
 #include "asm_kern_to_user.h"           /* kern_to_user */
 #include "scheduler.h"                  /* scheduler_init */
 #include "utils/tcb_hashtab.h"          /* tcb_hashtab_init */
 #include "drivers/keyboard_driver.h"    /* keyboard_init */
+#include "drivers/timer_driver.h"       /* timer_forward_ticks */
 
 // will need to find a better way to do this eventually
 extern kern_mutex_t malloc_mutex;
 extern kern_mutex_t print_mutex;
 
-extern thread_t *idle_thread;
 extern thread_t *init_thread;
 
 /* internal functions */
 void mutexes_init();
 void helper_init();
 thread_t *setup_task(const char *fname);
+thread_t *setup_idle_thread(void);
+void idle_loop(void);
+void smp_start(mbinfo_t *mbinfo);
+void ap_main(int cpu);
+int has_boot_option(int argc, char **argv, const char *option);
 
 /** @brief Kernel entrypoint.
  *
@@ -53,8 +65,11 @@ int kernel_main(mbinfo_t *mbinfo, int argc, char **argv, char **envp) {
 
     /* install exception handler, device driver and all of syscalls */
     handler_init();
-    /* set up kernel page directory, and set up physical memory allocator */
-    vm_init();
+    /*
+     * set up kernel page directory, and set up physical memory allocator,
+     * booting with "nodirectmap" falls back to reaching frames through kmap
+     */
+    vm_init(!has_boot_option(argc, argv, "nodirectmap"));
     /* initialize basic mutexes that are need before kernel start running */
     mutexes_init();
     /* initialize scheduler's list */
@@ -64,12 +79,19 @@ int kernel_main(mbinfo_t *mbinfo, int argc, char **argv, char **envp) {
     /* set up other essentials like tcb table, tid counter */
     helper_init();
 
-    /* set up an idle task for thread to switch when there is no more thread */
-    idle_thread = setup_task("idle");
+    /* set up an idle thread to switch to when there is no more thread */
+    sche_set_idle_thread(0, setup_idle_thread());
 
     /* step up the first real task running */
     init_thread = setup_task("init");
     set_cur_run_thread(init_thread);
+
+    /*
+     * the other CPUs find nothing to run until init forks, booting with
+     * "nosmp" keeps the kernel on this one
+     */
+    if (!has_boot_option(argc, argv, "nosmp")) smp_start(mbinfo);
+
     set_esp0(init_thread->kern_sp);
     kern_to_user(init_thread->cur_sp, init_thread->ip);
 
@@ -90,6 +112,100 @@ void mutexes_init() {
     kern_mutex_init(&print_mutex);
 }
 
+/**
+ * Sets up the idle thread. It runs idle_loop() in kernel mode and has no user
+ * memory of its own, so the scheduler can leave the previous address space
+ * loaded while it runs. Its task only exists for bookkeeping.
+ * @return the idle thread, NULL on failure
+ */
+thread_t *setup_idle_thread(void) {
+    task_t *task = task_init();
+    if (task == NULL) return NULL;
+    task->parent_task = NULL;
+
+    thread_t *thread = thread_init();
+    if (thread == NULL) {
+        task_destroy(task);
+        return NULL;
+    }
+    thread->task = task;
+    /* the first switch to a FORKED thread jumps to ip on its own stack */
+    thread->status = FORKED;
+    thread->cur_sp = thread->kern_sp;
+    thread->ip = (uint32_t)idle_loop;
+
+    add_node_to_head(task->live_thread_list, TCB_TO_LIST_NODE(thread));
+    return thread;
+}
+
+/**
+ * Body of the idle threads, which use the time nobody else wants to clear
+ * frames for the zero pool. Same-page merging is left to the boot CPU's, so
+ * that two scans never race. An idle thread never blocks, and is preempted by
+ * the timer as soon as another thread becomes runnable.
+ */
+void idle_loop(void) {
+    /* the first switch to an idle thread leaves the scheduler locked */
+    sche_unlock();
+    /* idle threads never move to another CPU */
+    int merge = (smp_get_cpu() == 0);
+    while (1) {
+        zero_pool_refill();
+        if (merge) merge_scan();
+    }
+}
+
+/**
+ * Boots the application processors, if the machine has any, each with an
+ * idle thread of its own. The threads of a task only run on one CPU at a
+ * time, so its TLB entries never have to be shot down elsewhere. The kmap
+ * slots are shared by all CPUs though, so without the direct map the kernel
+ * stays on the boot CPU.
+ * @param mbinfo the multiboot info, where the MP table is looked for
+ */
+void smp_start(mbinfo_t *mbinfo) {
+    if (get_direct_map_low() == 0 || smp_init(mbinfo) < 0) return;
+
+    int num_cpus = smp_num_cpus();
+    int cpu;
+    for (cpu = 1; cpu < num_cpus; cpu++) {
+        thread_t *idle = setup_idle_thread();
+        if (idle == NULL) panic("no idle thread for cpu %d", cpu);
+        sche_set_idle_thread(cpu, idle);
+    }
+
+    /* smp_get_cpu() reads the local APIC once other CPUs are up */
+    vm_map_lapic();
+    smp_boot(ap_main);
+    timer_forward_ticks();
+    lprintf("%d cpus online", num_cpus);
+}
+
+/**
+ * Entry point of an application processor, which arrives here from the boot
+ * code with paging disabled and never returns.
+ * @param cpu the CPU number
+ */
+void ap_main(int cpu) {
+    vm_init_cpu();
+    sche_start_cpu(cpu);
+}
+
+/**
+ * Checks whether an option was given on the kernel command line.
+ * @param  argc   number of kernel arguments
+ * @param  argv   kernel arguments
+ * @param  option the option to look for
+ * @return        1 if the option is present, 0 otherwise
+ */
+int has_boot_option(int argc, char **argv, const char *option) {
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], option) == 0) return 1;
+    }
+    return 0;
+}
+
 /**
  * helper function initialization
  */
@@ -98,6 +214,10 @@ void helper_init() {
     tcb_hashtab_init();
     /* initialize tid counter */
     id_counter_init();
+    /* initialize the cache of shared read-only program pages */
+    page_cache_init();
+    /* initialize the compressed store for evicted pages */
+    swap_init();
 }
 
 thread_t *setup_task(const char *fname) {
@@ -105,23 +225,20 @@ thread_t *setup_task(const char *fname) {
     if (task == NULL) return NULL;
     task->parent_task = NULL;
 
-    int ret = 0;
-    /* validate the memory map for the kernel memory, 16MB */
-    ret += maps_insert(task->maps, 0, PAGE_SIZE * NUM_KERN_PAGES - 1, 0);
-    /* validate the memory map for last page used to access physical frames */
-    ret += maps_insert(task->maps, RW_PHYS_VA, RW_PHYS_VA + (PAGE_SIZE - 1), 0);
+    /* validate the memory map for the memory that belongs to the kernel */
+    int ret = reserve_kernel_maps(task->maps);
     if (ret < 0) {
         task_destroy(task);
         return NULL;
     }
 
     /* set page directory for loading program data */
-    set_cr3((uint32_t)task->page_dir);
+    vm_switch_page_dir(task->page_dir);
 
     /* load program from memory */
     simple_elf_t elf_header;
     ret += elf_load_helper(&elf_header, fname);
-    ret += load_program(&elf_header, task->maps);
+    ret += load_program(&elf_header, task);
     if (ret < 0) {
         task_destroy(task);
         return NULL;
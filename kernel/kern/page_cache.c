@@ -0,0 +1,186 @@
+/**
+ * @file   page_cache.c
+ * @brief  This file contains a cache of read-only program pages, so that
+ *         every task running the same executable maps the same frames for
+ *         its text and rodata instead of getting a private copy.
+ *
+ * Cached frames hold one reference and one frame reservation for the cache
+ * itself. A frame that no task maps anymore is kept until its entry is
+ * wanted for another page, or its frame is wanted by dec_num_free_frames().
+ *
+ * @author Newton Xie (ncx)
+ * @author Qiaoyu Deng (qdeng)
+ * @bug    No known bugs
+ */
+
+#include <stdlib.h>
+
+#include "page_cache.h"
+#include "vm.h"                 /* inc_frame_ref, put_frame */
+#include "utils/kern_mutex.h"
+
+static page_cache_entry_t *buckets[PAGE_CACHE_BUCKETS];
+static int num_cached;
+static unsigned int hits;
+static unsigned int direct_faults;
+static kern_mutex_t page_cache_mutex;
+
+static int bucket_index(const char *src, uint32_t page);
+static int drop_unused(int n);
+
+/**
+ * Initializes the page cache.
+ * @return 0 as success, -1 as failure
+ */
+int page_cache_init(void) {
+    num_cached = 0;
+    hits = 0;
+    direct_faults = 0;
+    return kern_mutex_init(&page_cache_mutex);
+}
+
+/**
+ * Looks up a cached page, taking a reference to its frame for the caller to
+ * map.
+ * @param  src   image bytes at the start of the page
+ * @param  page  user address of the page
+ * @return       physical address of the frame, 0 if the page is not cached
+ */
+uint32_t page_cache_get(const char *src, uint32_t page) {
+    kern_mutex_lock(&page_cache_mutex);
+    page_cache_entry_t *entry = buckets[bucket_index(src, page)];
+    while (entry != NULL) {
+        if (entry->src == src && entry->page == page) {
+            inc_frame_ref(entry->frame);
+            hits++;
+            kern_mutex_unlock(&page_cache_mutex);
+            return entry->frame;
+        }
+        entry = entry->next;
+    }
+    kern_mutex_unlock(&page_cache_mutex);
+    return 0;
+}
+
+/**
+ * Adds a freshly filled read-only page to the cache. When the cache is full,
+ * a page no task maps anymore makes room for it. The page is simply not
+ * cached if there is none, or no frame can be reserved for it.
+ * @param src   image bytes at the start of the page
+ * @param page  user address of the page
+ * @param frame physical address of the frame holding the page
+ */
+void page_cache_put(const char *src, uint32_t page, uint32_t frame) {
+    /* reserve first, since running short may call page_cache_reclaim() */
+    if (dec_num_free_frames(1) < 0) return;
+
+    kern_mutex_lock(&page_cache_mutex);
+    if (num_cached >= PAGE_CACHE_MAX_FRAMES && drop_unused(1) == 0) {
+        kern_mutex_unlock(&page_cache_mutex);
+        inc_num_free_frames(1);
+        return;
+    }
+
+    int index = bucket_index(src, page);
+    page_cache_entry_t *entry = buckets[index];
+    while (entry != NULL) {
+        /* filled in by another task at the same time */
+        if (entry->src == src && entry->page == page) {
+            kern_mutex_unlock(&page_cache_mutex);
+            inc_num_free_frames(1);
+            return;
+        }
+        entry = entry->next;
+    }
+
+    entry = malloc(sizeof(page_cache_entry_t));
+    if (entry == NULL) {
+        kern_mutex_unlock(&page_cache_mutex);
+        inc_num_free_frames(1);
+        return;
+    }
+
+    inc_frame_ref(frame);
+    entry->src = src;
+    entry->page = page;
+    entry->frame = frame;
+    entry->next = buckets[index];
+    buckets[index] = entry;
+    num_cached++;
+    kern_mutex_unlock(&page_cache_mutex);
+}
+
+/**
+ * Gives back the frames and reservations of up to n cached pages that no
+ * task maps anymore.
+ * @param  n  number of frames wanted
+ * @return    number of frames given back
+ */
+int page_cache_reclaim(int n) {
+    kern_mutex_lock(&page_cache_mutex);
+    int dropped = drop_unused(n);
+    kern_mutex_unlock(&page_cache_mutex);
+    return dropped;
+}
+
+/**
+ * Counts a fault on a page-aligned image page that was mapped in place,
+ * without using a frame of its own.
+ */
+void page_cache_count_direct(void) {
+    kern_mutex_lock(&page_cache_mutex);
+    direct_faults++;
+    kern_mutex_unlock(&page_cache_mutex);
+}
+
+/**
+ * Fills in the page cache part of a memory statistics snapshot.
+ * @param stats the snapshot
+ */
+void page_cache_get_stats(vm_stats_t *stats) {
+    kern_mutex_lock(&page_cache_mutex);
+    stats->page_cache_frames = num_cached;
+    stats->page_cache_hits = hits;
+    stats->page_cache_direct = direct_faults;
+    kern_mutex_unlock(&page_cache_mutex);
+}
+
+/**
+ * Hashes a cache key to its bucket.
+ * @param  src   image bytes at the start of the page
+ * @param  page  user address of the page
+ * @return       bucket index
+ */
+static int bucket_index(const char *src, uint32_t page) {
+    uint32_t key = (uint32_t)src ^ (page >> 12);
+    return (key ^ (key >> 6) ^ (key >> 12)) % PAGE_CACHE_BUCKETS;
+}
+
+/**
+ * Drops up to n entries whose frame only the cache holds, giving back their
+ * frames and reservations. Must be called with page_cache_mutex held, which
+ * keeps anyone from taking a new reference to a cached frame.
+ * @param  n  number of entries wanted
+ * @return    number of entries dropped
+ */
+static int drop_unused(int n) {
+    int dropped = 0;
+    int i;
+    for (i = 0; i < PAGE_CACHE_BUCKETS && dropped < n; i++) {
+        page_cache_entry_t **link = &buckets[i];
+        while (*link != NULL && dropped < n) {
+            page_cache_entry_t *entry = *link;
+            if (get_frame_ref(entry->frame) > 1) {
+                link = &entry->next;
+                continue;
+            }
+            *link = entry->next;
+            put_frame(entry->frame);
+            free(entry);
+            num_cached--;
+            dropped++;
+        }
+    }
+    if (dropped > 0) inc_num_free_frames(dropped);
+    return dropped;
+}
@@ -1,6 +1,20 @@
 /**
  * @file   scheduler.c
- * @brief  This file contains the functions that are used to switch context
+ * @brief  This file contains the functions that are used to switch context.
+ *         Runnable threads wait in a multi-level feedback queue: a thread
+ *         that uses up its time slice moves down a level, where slices are
+ *         longer, and one that blocks first moves up a level. The highest
+ *         non-empty level runs first, and a thread of a higher level that
+ *         becomes runnable preempts the running one at the next tick.
+ *
+ *         Every CPU has run queues of its own, and a CPU that runs out of
+ *         threads takes one from the CPU with the most threads waiting. The
+ *         threads of a task all run on the same CPU, the task's cpu, so that
+ *         a change to its mappings only has to be flushed from that CPU's
+ *         TLB; a task only moves to another CPU with the thread taken when
+ *         its other threads are all blocked. Run queues, thread states and
+ *         the internals of kern_mutex are protected by a single spinlock, see
+ *         sche_lock().
  * @author Newton Xie (ncx)
  * @author Qiaoyu Deng (qdeng)
  * @bug    No known bugs
@@ -12,6 +26,7 @@
 
 /* x86 specific includes */
 #include <x86/cr.h>                   /* set_cr3, set_esp0 */
+#include <x86/eflags.h>               /* get_eflags, EFL_IF */
 
 /* DEBUG includes */
 #include <simics.h>                   /* lprintf */
@@ -19,42 +34,322 @@
 #include "scheduler.h"
 #include "task.h"                     /* thread_t, task_t */
 #include "asm_kern_to_user.h"         /* kern_to_user */
-#include "asm_context_switch.h"       /* three switch functions */
+#include "asm_context_switch.h"       /* switch functions */
 #include "drivers/timer_driver.h"     /* get_num_ticks */
+#include "vm.h"                       /* vm_switch_page_dir */
 #include "utils/kern_mutex.h"         /* kern_mutex */
-
-/* extern global variable  */
-/* when there is no thread that can be switched to, we switch to idle thread */
-extern thread_t *idle_thread;
+#include "utils/spinlock.h"           /* spinlock_t */
 
 /* static global variable */
-static sche_node_t *cur_sche_node;     /* save the current running thread*/
-static schedule_t sche_list;           /* scheduler uses FIFO list to switch */
+static spinlock_t sche_spinlock;       /* protects all of the below */
+static run_queue_t run_queues[MAX_CPUS];
+static list_t *sleeping_list;          /* sleeping threads of every CPU */
+static int num_cpus = 1;               /* CPUs running threads */
+static unsigned int num_steals;        /* threads taken from another CPU */
+static int last_boost_ticks;           /* when every thread was last boosted */
+
+static void sche_enqueue(thread_t *tcb_ptr, int front);
+static sche_node_t *sche_pick(int cpu);
+static sche_node_t *sche_steal(int cpu);
+static int sche_claim(thread_t *tcb_ptr, int cpu);
+static int slice_ticks(int level);
+static void sche_boost(void);
+static void sche_enter_user(void);
 
 /**
  * @brief   Initialize the scheduler's list structures.
  * @return  0 for success, -1 for failure
  */
 int scheduler_init() {
-    sche_list.active_list = list_init();
-    if (sche_list.active_list == NULL) return -1;
+    spin_init(&sche_spinlock);
 
-    sche_list.sleeping_list = list_init();
-    if (sche_list.sleeping_list == NULL) {
-        list_destroy(sche_list.active_list);
-        return -1;
+    int cpu, level;
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        for (level = 0; level < SCHE_NUM_LEVELS; level++) {
+            run_queues[cpu].active_lists[level] = list_init();
+            if (run_queues[cpu].active_lists[level] == NULL) return -1;
+        }
     }
 
+    sleeping_list = list_init();
+    if (sleeping_list == NULL) return -1;
+
     return 0;
 }
 
 /**
- * Set current running threads
+ * Locks the scheduler. This takes the place that disabling interrupts had
+ * when there was a single CPU: a thread locks the scheduler to put itself on
+ * a wait list and switch away before anybody can wake it up, and since
+ * kern_mutex takes it too, no mutex changes hands while it is locked. Just
+ * like disabling interrupts, it may be locked again by the CPU holding it,
+ * which does nothing, and one sche_unlock() releases it. sche_yield() keeps
+ * it locked across the switch, and the next thread unlocks it.
+ */
+void sche_lock(void) {
+    disable_interrupts();
+    if (!spin_held(&sche_spinlock)) spin_lock(&sche_spinlock);
+}
+
+/**
+ * Unlocks the scheduler, if this CPU holds it, and enables interrupts.
+ */
+void sche_unlock(void) {
+    if (spin_held(&sche_spinlock)) spin_unlock(&sche_spinlock);
+    enable_interrupts();
+}
+
+/**
+ * Sets the thread a CPU runs when it has nothing else to do.
+ * @param cpu     the CPU number
+ * @param tcb_ptr the idle thread, which must not have run yet
+ */
+void sche_set_idle_thread(int cpu, thread_t *tcb_ptr) {
+    run_queues[cpu].idle_thread = tcb_ptr;
+    tcb_ptr->task->cpu = cpu;
+}
+
+/**
+ * Starts scheduling on an application processor, with its idle thread. The
+ * CPU takes threads from the busier ones from then on.
+ * @param cpu the CPU number
+ */
+void sche_start_cpu(int cpu) {
+    run_queue_t *rq = &run_queues[cpu];
+    thread_t *idle = rq->idle_thread;
+    uint32_t boot_sp;
+
+    sche_lock();
+    rq->cur_sche_node = TCB_TO_SCHE_NODE(idle);
+    num_cpus++;
+    set_esp0(idle->kern_sp);
+    idle->status = RUNNABLE;
+    /* the boot stack is left for good, idle_loop() unlocks the scheduler */
+    asm_switch_to_forked(&boot_sp, idle->cur_sp, idle->ip);
+}
+
+/**
+ * Gets the scheduler statistics.
+ * @param cpus   set to the number of CPUs running threads
+ * @param steals set to the number of threads taken from another CPU
+ */
+void sche_get_stats(int *cpus, unsigned int *steals) {
+    sche_lock();
+    *cpus = num_cpus;
+    *steals = num_steals;
+    sche_unlock();
+}
+
+/**
+ * Gets the time slice of a run queue level. CPU bound threads sink to the
+ * lower levels, where they run for longer at a time but less often.
+ * @param  level run queue level
+ * @return       the time slice in ticks
+ */
+static int slice_ticks(int level) {
+    return SCHE_BASE_SLICE << level;
+}
+
+/**
+ * Adds a runnable thread to the run queue of its level, on its task's CPU. A
+ * thread that has used up its time slice, or never had one, gets a fresh
+ * one. The scheduler must be locked.
+ * @param tcb_ptr the thread
+ * @param front   nonzero to run it before the others of its level
+ */
+static void sche_enqueue(thread_t *tcb_ptr, int front) {
+    sche_node_t *sche_node = TCB_TO_SCHE_NODE(tcb_ptr);
+    run_queue_t *rq = &run_queues[tcb_ptr->task->cpu];
+    list_t *list = rq->active_lists[tcb_ptr->sche_level];
+
+    if (tcb_ptr->slice_left <= 0) {
+        tcb_ptr->slice_left = slice_ticks(tcb_ptr->sche_level);
+    }
+    if (front) add_node_to_head(list, sche_node);
+    else add_node_to_tail(list, sche_node);
+}
+
+/**
+ * Takes the first thread of the highest non-empty level off a CPU's run
+ * queue, or steals one if the CPU has none. The scheduler must be locked.
+ * @param  cpu the CPU
+ * @return     the thread's scheduler node, NULL if nothing is runnable
+ */
+static sche_node_t *sche_pick(int cpu) {
+    run_queue_t *rq = &run_queues[cpu];
+    int level;
+    for (level = 0; level < SCHE_NUM_LEVELS; level++) {
+        sche_node_t *sche_node = pop_first_node(rq->active_lists[level]);
+        if (sche_node != NULL) return sche_node;
+    }
+    return sche_steal(cpu);
+}
+
+/**
+ * Takes a waiting thread off the CPU with the most threads waiting, for a
+ * CPU that has run out of its own. Only a thread whose task has no other
+ * thread running or waiting to run can be taken, and its task moves along.
+ * The highest level is searched first, from its longest waiting thread. The
+ * scheduler must be locked.
+ * @param  cpu the CPU looking for work
+ * @return     the thread's scheduler node, NULL if there is none to take
+ */
+static sche_node_t *sche_steal(int cpu) {
+    int victim = -1;
+    int most = 0;
+    int other, level;
+
+    for (other = 0; other < MAX_CPUS; other++) {
+        if (other == cpu) continue;
+        int waiting = 0;
+        for (level = 0; level < SCHE_NUM_LEVELS; level++) {
+            waiting += get_list_size(run_queues[other].active_lists[level]);
+        }
+        if (waiting > most) {
+            most = waiting;
+            victim = other;
+        }
+    }
+    if (victim < 0) return NULL;
+
+    for (level = 0; level < SCHE_NUM_LEVELS; level++) {
+        list_t *list = run_queues[victim].active_lists[level];
+        sche_node_t *sche_node = get_first_node(list);
+        while (sche_node != NULL) {
+            thread_t *tcb_ptr = SCHE_NODE_TO_TCB(sche_node);
+            if (sche_claim(tcb_ptr, cpu)) {
+                remove_node(list, sche_node);
+                num_steals++;
+                return sche_node;
+            }
+            sche_node = get_next_node(list, sche_node);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Checks whether a runnable thread that is not running may run on a CPU, and
+ * moves its task to the CPU if it has to and can. The task's other threads
+ * are all blocked then, and follow it when they wake up. The live thread
+ * list is not looked at, since it changes under its own mutex. The scheduler
+ * must be locked.
+ * @param  tcb_ptr the thread
+ * @param  cpu     the CPU
+ * @return         1 if the thread may run on cpu, 0 if its task has other
+ *                 threads running or waiting to run on another CPU
+ */
+static int sche_claim(thread_t *tcb_ptr, int cpu) {
+    task_t *task = tcb_ptr->task;
+    if (task->cpu == cpu) return 1;
+    if (task->num_active != 1) return 0;
+    task->cpu = cpu;
+    return 1;
+}
+
+/**
+ * Moves every runnable thread back up to the level of its priority hint, so
+ * that CPU bound threads are not starved by a steady stream of interactive
+ * ones. The scheduler must be locked.
+ */
+static void sche_boost(void) {
+    int cpu, level;
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        run_queue_t *rq = &run_queues[cpu];
+        for (level = 1; level < SCHE_NUM_LEVELS; level++) {
+            list_t *list = rq->active_lists[level];
+            int num_nodes = get_list_size(list);
+            while (num_nodes-- > 0) {
+                sche_node_t *sche_node = pop_first_node(list);
+                thread_t *tcb_ptr = SCHE_NODE_TO_TCB(sche_node);
+                if (tcb_ptr->sche_level != tcb_ptr->priority) {
+                    tcb_ptr->sche_level = tcb_ptr->priority;
+                    tcb_ptr->slice_left = 0;
+                }
+                sche_enqueue(tcb_ptr, 0);
+            }
+        }
+
+        if (rq->cur_sche_node == NULL) continue;
+        thread_t *cur_tcb_ptr = SCHE_NODE_TO_TCB(rq->cur_sche_node);
+        if (cur_tcb_ptr != rq->idle_thread) {
+            cur_tcb_ptr->sche_level = cur_tcb_ptr->priority;
+            cur_tcb_ptr->slice_left = slice_ticks(cur_tcb_ptr->sche_level);
+        }
+    }
+    last_boost_ticks = get_timer_ticks();
+}
+
+/**
+ * Accounts a timer tick to the running thread. It keeps the CPU until its
+ * time slice runs out, which moves it down a level, unless a thread of a
+ * higher level became runnable or a sleeping thread is due.
+ */
+void sche_tick(void) {
+    sche_lock();
+    run_queue_t *rq = &run_queues[smp_get_cpu()];
+    thread_t *cur_tcb_ptr = SCHE_NODE_TO_TCB(rq->cur_sche_node);
+
+    if (get_timer_ticks() - last_boost_ticks >= SCHE_BOOST_TICKS) {
+        sche_boost();
+    }
+
+    if (cur_tcb_ptr != rq->idle_thread) {
+        int level = cur_tcb_ptr->sche_level;
+        int preempt = 0;
+
+        if (--cur_tcb_ptr->slice_left <= 0) {
+            if (level < SCHE_NUM_LEVELS - 1) cur_tcb_ptr->sche_level++;
+            cur_tcb_ptr->slice_left = slice_ticks(cur_tcb_ptr->sche_level);
+            preempt = 1;
+        }
+
+        int higher;
+        for (higher = 0; higher < level && !preempt; higher++) {
+            if (get_first_node(rq->active_lists[higher]) != NULL) {
+                preempt = 1;
+            }
+        }
+
+        sleep_node_t *sleeper;
+        sleeper = (sleep_node_t *)get_first_node(sleeping_list);
+        if (sleeper != NULL && sleeper->wakeup_ticks <= get_timer_ticks()) {
+            preempt = 1;
+        }
+
+        if (!preempt) {
+            sche_unlock();
+            return;
+        }
+    }
+
+    sche_yield(RUNNABLE);
+}
+
+/**
+ * Sets the priority hint of a thread, the highest level it may run at. A
+ * thread above its new highest level is moved down at once.
+ * @param tcb_ptr  the thread, which must be the current one
+ * @param priority the hint, from PRIORITY_HIGH to PRIORITY_LOW
+ */
+void sche_set_priority(thread_t *tcb_ptr, int priority) {
+    sche_lock();
+    tcb_ptr->priority = priority;
+    if (tcb_ptr->sche_level < priority) {
+        tcb_ptr->sche_level = priority;
+        tcb_ptr->slice_left = slice_ticks(priority);
+    }
+    sche_unlock();
+}
+
+/**
+ * Set current running threads of this CPU
  * @param tcb_ptr pointer to thread control block structure
  */
 void set_cur_run_thread(thread_t *tcb_ptr) {
     sche_node_t *sche_node = TCB_TO_SCHE_NODE(tcb_ptr);
-    cur_sche_node = sche_node;
+    run_queues[smp_get_cpu()].cur_sche_node = sche_node;
+    tcb_ptr->task->num_active++;
 }
 
 /**
@@ -72,36 +367,59 @@ void set_cur_run_thread(thread_t *tcb_ptr) {
  * #define SLEEPING 7
  */
 void sche_yield(int status) {
-    /* we need disable interrupt to prevent context switch itself is switched */
-    disable_interrupts();
-    sche_node_t *new_sche_node;
+    /*
+    the scheduler stays locked until we are off this thread's stack, so that
+    no other CPU can run the thread before then. The next thread unlocks it.
+     */
+    sche_lock();
+    int cpu = smp_get_cpu();
+    run_queue_t *rq = &run_queues[cpu];
+    sche_node_t *new_sche_node = NULL;
     /*
     to check whether there is sleeping thread need to be waked up, otherwise we
     choose a thread from FIFO list to run.
      */
     sleep_node_t *sleeper;
-    sleeper = (sleep_node_t *)get_first_node(sche_list.sleeping_list);
+    sleeper = (sleep_node_t *)get_first_node(sleeping_list);
     /* check whether the ticks reaches the setting value of sleeping threads */
     if (sleeper != NULL && sleeper->wakeup_ticks <= get_timer_ticks()) {
-        pop_first_node(sche_list.sleeping_list);
+        pop_first_node(sleeping_list);
         sleeper->thread->status = RUNNABLE;
-        new_sche_node = TCB_TO_SCHE_NODE(sleeper->thread);
-    } else {
-        /* get thread from normal FIFO list */
-        new_sche_node = pop_first_node(sche_list.active_list);
+        sleeper->thread->task->num_active++;
+        if (sche_claim(sleeper->thread, cpu)) {
+            new_sche_node = TCB_TO_SCHE_NODE(sleeper->thread);
+        } else {
+            /* the other threads of its task run on another CPU */
+            sche_enqueue(sleeper->thread, 1);
+        }
+    }
+    if (new_sche_node == NULL) {
+        /* get thread from the highest non-empty level */
+        new_sche_node = sche_pick(cpu);
     }
 
-    thread_t *cur_tcb_ptr = SCHE_NODE_TO_TCB(cur_sche_node);
+    thread_t *cur_tcb_ptr = SCHE_NODE_TO_TCB(rq->cur_sche_node);
+    thread_t *idle_thread = rq->idle_thread;
     cur_tcb_ptr->status = status;
 
+    if (status != RUNNABLE && cur_tcb_ptr != idle_thread) {
+        /* a blocked thread no longer keeps its task on this CPU */
+        cur_tcb_ptr->task->num_active--;
+        /* a thread that blocks before its slice is used up moves up a level */
+        if (cur_tcb_ptr->sche_level > cur_tcb_ptr->priority) {
+            cur_tcb_ptr->sche_level--;
+        }
+        cur_tcb_ptr->slice_left = 0;
+    }
+
     /* if there is thread can be switched to */
     if (new_sche_node != NULL) {
         /* if just doing context switch instead of blocking or sleeping */
         if (status == RUNNABLE && cur_tcb_ptr != idle_thread)
-            add_node_to_tail(sche_list.active_list, cur_sche_node);
+            sche_enqueue(cur_tcb_ptr, 0);
 
         thread_t *new_tcb_ptr = SCHE_NODE_TO_TCB(new_sche_node);
-        cur_sche_node = new_sche_node;
+        rq->cur_sche_node = new_sche_node;
         /* set new thread's kernel stack */
         set_esp0(new_tcb_ptr->kern_sp);
 
@@ -110,7 +428,9 @@ void sche_yield(int status) {
             next CPU time slice.
         status = INITIALIZED: This status indicates the thread is initialized in
             kern_main, we need switch from kernel mode to user mode to run them
-            by using iret when running them for the first time.
+            by using iret when running them for the first time. This is done
+            from its own kernel stack, so that the scheduler is only unlocked
+            once this thread's stack is not used anymore.
         status = FORKED: This status indicates the thread is in a newly forked
             task, we need set its eip explicitly into the fork function to let
             it return 0 (because it is a child task).
@@ -118,23 +438,22 @@ void sche_yield(int status) {
         if (new_tcb_ptr->status == RUNNABLE) {
             /*
             we might switch to thread in different tasks, so we need change page
-            directory pointer by set_cr3.
+            directory pointer, unless it is still loaded (e.g. only the idle
+            thread ran in between).
              */
-            int original_task_id = cur_tcb_ptr->task->task_id;
-            int new_task_id = new_tcb_ptr->task->task_id;
-            if (new_task_id != original_task_id)
-                set_cr3((uint32_t)new_tcb_ptr->task->page_dir);
+            vm_switch_page_dir(new_tcb_ptr->task->page_dir);
 
             asm_switch_to_runnable(&cur_tcb_ptr->cur_sp,
                                    new_tcb_ptr->cur_sp);
         } else if (new_tcb_ptr->status == INITIALIZED) {
-            set_cr3((uint32_t)new_tcb_ptr->task->page_dir);
+            vm_switch_page_dir(new_tcb_ptr->task->page_dir);
             new_tcb_ptr->status = RUNNABLE;
 
-            asm_switch_to_initialized(&cur_tcb_ptr->cur_sp,
-                                      new_tcb_ptr->cur_sp, new_tcb_ptr->ip);
+            asm_switch_to_forked(&cur_tcb_ptr->cur_sp,
+                                 new_tcb_ptr->kern_sp,
+                                 (uint32_t)sche_enter_user);
         } else if (new_tcb_ptr->status == FORKED) {
-            set_cr3((uint32_t)new_tcb_ptr->task->page_dir);
+            vm_switch_page_dir(new_tcb_ptr->task->page_dir);
             new_tcb_ptr->status = RUNNABLE;
 
             asm_switch_to_forked(&cur_tcb_ptr->cur_sp,
@@ -143,61 +462,90 @@ void sche_yield(int status) {
         }
     } else if (status != RUNNABLE) {
         /* otherwise wake up idle thread */
-        cur_sche_node = TCB_TO_SCHE_NODE(idle_thread);
+        rq->cur_sche_node = TCB_TO_SCHE_NODE(idle_thread);
         /* set next interrupt kernel stack  */
         set_esp0(idle_thread->kern_sp);
-        /* set page directory pointer */
-        set_cr3((uint32_t)idle_thread->task->page_dir);
+        /*
+        the idle thread only touches kernel memory, which is mapped the same
+        in every page directory, so the last address space stays loaded. With
+        other CPUs running, its task could exit and free the page directory
+        meanwhile, so the kernel's own is loaded instead.
+         */
+        vm_switch_page_dir(num_cpus > 1 ? get_kern_page_dir() : NULL);
         int old_status = idle_thread->status;
         idle_thread->status = RUNNABLE;
 
-        /* idle task is run for the first time */
-        if (old_status == INITIALIZED) {
-            asm_switch_to_initialized(&cur_tcb_ptr->cur_sp,
-                                      idle_thread->cur_sp, idle_thread->ip);
+        /* idle thread is run for the first time */
+        if (old_status == FORKED) {
+            asm_switch_to_forked(&cur_tcb_ptr->cur_sp,
+                                 idle_thread->cur_sp, idle_thread->ip);
         } else {
             asm_switch_to_runnable(&cur_tcb_ptr->cur_sp,
                                    idle_thread->cur_sp);
         }
     }
 
-    enable_interrupts();
+    sche_unlock();
 }
 
 /**
- * Get current running thread's thread control block.
+ * First code run by a thread that the loader set up, on its own kernel stack,
+ * with the scheduler still locked by sche_yield(). Enters user mode at the
+ * program's entry point.
+ */
+static void sche_enter_user(void) {
+    thread_t *tcb_ptr = get_cur_tcb();
+    sche_unlock();
+    kern_to_user(tcb_ptr->cur_sp, tcb_ptr->ip);
+}
+
+/**
+ * Get current running thread's thread control block. Interrupts are disabled
+ * while looking, so that the thread does not move to another CPU meanwhile.
  * @return tcb pointer
  */
 thread_t *get_cur_tcb() {
-    return SCHE_NODE_TO_TCB(cur_sche_node);
+    uint32_t eflags = get_eflags();
+    disable_interrupts();
+    sche_node_t *sche_node = run_queues[smp_get_cpu()].cur_sche_node;
+    if (eflags & EFL_IF) enable_interrupts();
+    return SCHE_NODE_TO_TCB(sche_node);
 }
 
 /**
- * Put the thread control block to the tail of scheduler list
+ * Put the thread control block to the tail of its level's scheduler list.
+ * The thread must be new or blocked, not running or waiting to run.
  * @param tcb_ptr the tcb that needs to be added back to list.
  */
 void sche_push_back(thread_t *tcb_ptr) {
-    sche_node_t *sche_node = TCB_TO_SCHE_NODE(tcb_ptr);
-    add_node_to_tail(sche_list.active_list, sche_node);
+    tcb_ptr->task->num_active++;
+    sche_enqueue(tcb_ptr, 0);
 }
 
 /**
- * Put the thread control block to the head of scheduler list
+ * Put the thread control block to the head of its level's scheduler list.
+ * The thread must be new or blocked, not running or waiting to run.
  * @param tcb_ptr the tcb that needs to be added back to list.
  */
 void sche_push_front(thread_t *tcb_ptr) {
-    sche_node_t *sche_node = TCB_TO_SCHE_NODE(tcb_ptr);
-    add_node_to_head(sche_list.active_list, sche_node);
+    tcb_ptr->task->num_active++;
+    sche_enqueue(tcb_ptr, 1);
 }
 
 /**
- * Move thread control block in the scheduler list to the head of list.
+ * Move thread control block in the scheduler lists to the head of its
+ * current level, so that it runs before the others of that level on its
+ * task's CPU. Its level is kept, so that yielding to a demoted CPU bound
+ * thread does not lift it back up. Nothing is done for a thread that is
+ * running on another CPU.
  * @param tcb_ptr the tcb that needs to be pushed the first one.
  */
 void sche_move_front(thread_t *tcb_ptr) {
     sche_node_t *sche_node = TCB_TO_SCHE_NODE(tcb_ptr);
-    remove_node(sche_list.active_list, sche_node);
-    add_node_to_head(sche_list.active_list, sche_node);
+    run_queue_t *rq = &run_queues[tcb_ptr->task->cpu];
+    if (rq->cur_sche_node == sche_node) return;
+    remove_node(rq->active_lists[tcb_ptr->sche_level], sche_node);
+    sche_enqueue(tcb_ptr, 1);
 }
 
 /**
@@ -210,11 +558,11 @@ void sche_move_front(thread_t *tcb_ptr) {
 void tranquilize(sleep_node_t *sleep_node) {
     sleep_node_t *temp;
     node_t *next;
-    temp = (sleep_node_t *)get_first_node(sche_list.sleeping_list);
+    temp = (sleep_node_t *)get_first_node(sleeping_list);
     while (temp != NULL) {
         /* find the right place to insert */
         if (temp->wakeup_ticks <= sleep_node->wakeup_ticks) {
-            next = get_next_node(sche_list.sleeping_list, (node_t *)temp);
+            next = get_next_node(sleeping_list, (node_t *)temp);
             temp = (sleep_node_t *)next;
         } else {
             break;
@@ -222,7 +570,7 @@ void tranquilize(sleep_node_t *sleep_node) {
     }
 
     if (temp == NULL)
-        add_node_to_tail(sche_list.sleeping_list, (node_t *)sleep_node);
+        add_node_to_tail(sleeping_list, (node_t *)sleep_node);
     else
-        insert_before(sche_list.sleeping_list, (node_t *)temp, (node_t *)sleep_node);
+        insert_before(sleeping_list, (node_t *)temp, (node_t *)sleep_node);
 }
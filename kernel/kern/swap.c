@@ -0,0 +1,268 @@
+/**
+ * @file   swap.c
+ * @brief  This file contains a compressed store in the kernel heap for pages
+ *         evicted from user memory under memory pressure, so that a cold page
+ *         costs a fraction of a frame until it is touched again.
+ *
+ * Pages are compressed with a small LZ77 variant: every group of up to eight
+ * items starts with a control byte, whose bit i tells whether item i is a
+ * literal byte, or a two byte back reference holding a 12 bit offset and a
+ * 4 bit length of 3 to 18 bytes. Candidate matches come from a hash table of
+ * the last position each three byte sequence was seen at.
+ *
+ * @author Newton Xie (ncx)
+ * @author Qiaoyu Deng (qdeng)
+ * @bug    No known bugs
+ */
+
+#include <stdlib.h>
+#include <string.h>             /* memcpy memset */
+#include <syscall.h>            /* PAGE_SIZE */
+#include <assert.h>
+
+#include "swap.h"
+#include "utils/kern_mutex.h"
+
+#define HASH_BITS 12
+#define HASH_SIZE (1 << HASH_BITS)
+#define MIN_MATCH 3
+#define MAX_MATCH 18
+#define MAX_OFFSET 4095
+
+static swap_slot_t slots[SWAP_MAX_SLOTS];
+/* where to start looking for a free slot */
+static int slot_hint;
+static int num_stored;
+static int stored_bytes;
+static unsigned int evictions;
+static unsigned int refaults;
+/* protects everything above, and the compression buffers below */
+static kern_mutex_t swap_mutex;
+
+/* last position + 1 of each hashed three byte sequence, 0 if none */
+static uint16_t hash_tab[HASH_SIZE];
+static uint8_t compress_buf[PAGE_SIZE];
+
+static int compress(const uint8_t *src, uint8_t *dest, int max_len);
+static void decompress(const uint8_t *src, uint8_t *dest);
+static int is_zero_page(const uint32_t *src);
+
+/**
+ * Initializes the swap store.
+ * @return 0 as success, -1 as failure
+ */
+int swap_init(void) {
+    memset(slots, 0, sizeof(slots));
+    slot_hint = 0;
+    num_stored = 0;
+    stored_bytes = 0;
+    evictions = 0;
+    refaults = 0;
+    return kern_mutex_init(&swap_mutex);
+}
+
+/**
+ * Compresses a page into a new slot, held by one page table entry.
+ * @param  src  kernel address of the page
+ * @return      the slot, or -1 if the page does not compress well enough or
+ *              the store is full
+ */
+int swap_store(const void *src) {
+    kern_mutex_lock(&swap_mutex);
+    if (num_stored == SWAP_MAX_SLOTS) {
+        kern_mutex_unlock(&swap_mutex);
+        return -1;
+    }
+
+    int len = 0;
+    if (!is_zero_page(src)) {
+        len = compress(src, compress_buf, SWAP_MAX_COMPRESSED);
+        if (len < 0 || stored_bytes + len > SWAP_MAX_BYTES) {
+            kern_mutex_unlock(&swap_mutex);
+            return -1;
+        }
+    }
+
+    char *data = NULL;
+    if (len > 0) {
+        data = malloc(len);
+        if (data == NULL) {
+            kern_mutex_unlock(&swap_mutex);
+            return -1;
+        }
+        memcpy(data, compress_buf, len);
+    }
+
+    int slot = slot_hint;
+    while (slots[slot].refcount != 0) slot = (slot + 1) % SWAP_MAX_SLOTS;
+    slot_hint = (slot + 1) % SWAP_MAX_SLOTS;
+
+    slots[slot].data = data;
+    slots[slot].len = len;
+    slots[slot].refcount = 1;
+    num_stored++;
+    stored_bytes += len;
+    kern_mutex_unlock(&swap_mutex);
+    return slot;
+}
+
+/**
+ * Decompresses a stored page. The slot is left in place.
+ * @param slot the slot
+ * @param dest kernel address of the page to fill
+ */
+void swap_load(int slot, void *dest) {
+    kern_mutex_lock(&swap_mutex);
+    assert(slots[slot].refcount > 0);
+    if (slots[slot].len == 0) memset(dest, 0, PAGE_SIZE);
+    else decompress((uint8_t *)slots[slot].data, dest);
+    kern_mutex_unlock(&swap_mutex);
+}
+
+/**
+ * Adds a page table entry holding a slot, when fork shares it.
+ * @param slot the slot
+ */
+void swap_dup(int slot) {
+    kern_mutex_lock(&swap_mutex);
+    assert(slots[slot].refcount > 0);
+    slots[slot].refcount++;
+    kern_mutex_unlock(&swap_mutex);
+}
+
+/**
+ * Drops a page table entry holding a slot, freeing the slot with the last.
+ * @param slot the slot
+ */
+void swap_put(int slot) {
+    kern_mutex_lock(&swap_mutex);
+    assert(slots[slot].refcount > 0);
+    if (--slots[slot].refcount == 0) {
+        free(slots[slot].data);
+        stored_bytes -= slots[slot].len;
+        slots[slot].data = NULL;
+        slots[slot].len = 0;
+        num_stored--;
+    }
+    kern_mutex_unlock(&swap_mutex);
+}
+
+/**
+ * Counts a page evicted into the store.
+ */
+void swap_count_eviction(void) {
+    kern_mutex_lock(&swap_mutex);
+    evictions++;
+    kern_mutex_unlock(&swap_mutex);
+}
+
+/**
+ * Counts a page faulted back in from the store.
+ */
+void swap_count_refault(void) {
+    kern_mutex_lock(&swap_mutex);
+    refaults++;
+    kern_mutex_unlock(&swap_mutex);
+}
+
+/**
+ * Fills in the swap part of a memory statistics snapshot.
+ * @param stats the snapshot
+ */
+void swap_get_stats(vm_stats_t *stats) {
+    kern_mutex_lock(&swap_mutex);
+    stats->swap_pages = num_stored;
+    stats->swap_bytes = stored_bytes;
+    stats->swap_evictions = evictions;
+    stats->swap_refaults = refaults;
+    kern_mutex_unlock(&swap_mutex);
+}
+
+/**
+ * Compresses a page.
+ * @param  src      the page
+ * @param  dest     buffer for the compressed data
+ * @param  max_len  size of the buffer
+ * @return          the compressed length, or -1 if it would exceed max_len
+ */
+static int compress(const uint8_t *src, uint8_t *dest, int max_len) {
+    memset(hash_tab, 0, sizeof(hash_tab));
+
+    int in = 0;
+    int out = 0;
+    while (in < PAGE_SIZE) {
+        /* a control byte and eight back references must fit */
+        if (out + 1 + 8 * 2 > max_len) return -1;
+        int control_pos = out++;
+        uint8_t control = 0;
+
+        int bit;
+        for (bit = 0; bit < 8 && in < PAGE_SIZE; bit++) {
+            if (in + MIN_MATCH <= PAGE_SIZE) {
+                uint32_t key = src[in] | (src[in + 1] << 8) |
+                               (src[in + 2] << 16);
+                int hash = ((key * 2654435761u) >> (32 - HASH_BITS));
+                int candidate = hash_tab[hash] - 1;
+                hash_tab[hash] = in + 1;
+
+                int offset = in - candidate;
+                if (candidate >= 0 && offset <= MAX_OFFSET &&
+                        memcmp(src + candidate, src + in, MIN_MATCH) == 0) {
+                    int len = MIN_MATCH;
+                    while (len < MAX_MATCH && in + len < PAGE_SIZE &&
+                           src[candidate + len] == src[in + len]) {
+                        len++;
+                    }
+                    dest[out++] = offset >> 4;
+                    dest[out++] = ((offset & 0xF) << 4) | (len - MIN_MATCH);
+                    control |= 1 << bit;
+                    in += len;
+                    continue;
+                }
+            }
+            dest[out++] = src[in++];
+        }
+        dest[control_pos] = control;
+    }
+    return out;
+}
+
+/**
+ * Decompresses a page.
+ * @param src  compressed data
+ * @param dest the page to fill
+ */
+static void decompress(const uint8_t *src, uint8_t *dest) {
+    int in = 0;
+    int out = 0;
+    while (out < PAGE_SIZE) {
+        uint8_t control = src[in++];
+        int bit;
+        for (bit = 0; bit < 8 && out < PAGE_SIZE; bit++) {
+            if (control & (1 << bit)) {
+                int offset = (src[in] << 4) | (src[in + 1] >> 4);
+                int len = (src[in + 1] & 0xF) + MIN_MATCH;
+                in += 2;
+                /* byte by byte, since a match may overlap its own output */
+                while (len-- > 0) {
+                    dest[out] = dest[out - offset];
+                    out++;
+                }
+            } else {
+                dest[out++] = src[in++];
+            }
+        }
+    }
+}
+
+/**
+ * @param  src  the page
+ * @return      nonzero if every byte of the page is zero
+ */
+static int is_zero_page(const uint32_t *src) {
+    int i;
+    for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+        if (src[i] != 0) return 0;
+    }
+    return 1;
+}
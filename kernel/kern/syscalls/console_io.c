@@ -9,7 +9,6 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <asm.h>                 /* disable_interrupts(), enable_interrupts() */
 #include <console.h>
 
 #include "vm.h"
@@ -18,14 +17,21 @@
 #include "utils/kern_mutex.h"
 #include "utils/kern_cond.h"
 #include "utils/kern_sem.h"
+#include "scheduler.h"
+#include "user_copy.h"
 
 #define MEGABYTES (1024 * 1024)
 #define EXECNAME_MAX 64
+#define READLINE_MAX 4096
+/* bytes of a print() copied to the kernel stack at a time */
+#define PRINT_CHUNK 128
 
 /* keyboard input buffer */
 extern keyboard_buffer_t kb_buf;
 /* mutex make print thread safe */
 kern_mutex_t print_mutex;
+/* the line being read, protected by kb_buf.readline_sem */
+static char readline_buf[READLINE_MAX];
 
 
 /**
@@ -49,9 +55,9 @@ int kern_readline(void) {
     uint32_t *esi = (uint32_t *)asm_get_esi();
     int len = (int)(*esi);
     char *buf = (char *)(*(esi + 1));
-    if (len > 4096 || len <= 0) return -1;
+    if (len > READLINE_MAX || len <= 0) return -1;
 
-    /* check buf validation */
+    /* a bad buffer must not consume the line */
     int ret = validate_user_mem((uint32_t)buf, len, MAP_USER | MAP_WRITE);
     if (ret < 0) return -1;
 
@@ -59,15 +65,15 @@ int kern_readline(void) {
     kern_sem_wait(&kb_buf.readline_sem);
     kern_mutex_lock(&kb_buf.mutex);
     /**
-     * There should be a disable_interrupts because we need to ensure there is
+     * The scheduler should be locked because we need to ensure there is
      * no new line entering to buffer after we check them, if we check new line
      * count is 0, we need to wait on cond_var to be wake up again when a new
      * line character is available.
      */
-    disable_interrupts();
+    sche_lock();
     if (kb_buf.newline_cnt == 0) {
         int kb_buf_ending = kb_buf.buf_ending;
-        enable_interrupts();
+        sche_unlock();
         kb_buf.is_waiting = 1;
         /* if there is input available, just print it to screen */
         for (int i = kb_buf.buf_start;
@@ -77,7 +83,7 @@ int kern_readline(void) {
         }
         /* wait to be waked up when new line character comes */
         kern_cond_wait(&kb_buf.cond, &kb_buf.mutex);
-    } else enable_interrupts();
+    } else sche_unlock();
 
     /**
      * If we have already for new line character to come, which means we have
@@ -98,19 +104,23 @@ int kern_readline(void) {
      */
     int kb_buf_ending = kb_buf.buf_ending;
     kern_mutex_unlock(&kb_buf.mutex);
+    /* the line is put together in the kernel and copied out at once */
+    char *line = readline_buf;
     int actual_len = 0;
+    int copy_len = 0;
     while (kb_buf.buf_start < kb_buf_ending) {
         int new_kb_buf_start = (kb_buf.buf_start + 1) % KB_BUF_LEN;
         char ch = kb_buf.buf[kb_buf.buf_start];
         /* move the cursor */
         kb_buf.buf_start = new_kb_buf_start;
-        buf[actual_len++] = ch;
+        line[actual_len++] = ch;
+        copy_len = actual_len;
         /* if already print when waiting on input */
         if (if_print) putbyte(ch);
         if (ch == '\n') {
             /* make buffer null terminated */
-            if (actual_len < len) buf[actual_len] = '\0';
-            if (actual_len == len) buf[actual_len - 1] = '\0';
+            if (actual_len < len) line[copy_len++] = '\0';
+            if (actual_len == len) line[actual_len - 1] = '\0';
             kern_mutex_lock(&kb_buf.mutex);
             kb_buf.newline_cnt--;
             kern_mutex_unlock(&kb_buf.mutex);
@@ -118,13 +128,14 @@ int kern_readline(void) {
         }
         /* make buffer null terminated */
         if (actual_len == len - 1) {
-            buf[actual_len] = '\0';
+            line[copy_len++] = '\0';
             break;
         }
     }
+    ret = copy_to_user(buf, line, copy_len);
     /* let next thread entering readline */
     kern_sem_signal(&kb_buf.readline_sem);
-    return actual_len;
+    return ret < 0 ? -1 : actual_len;
 }
 
 /**
@@ -140,15 +151,26 @@ int kern_print(void) {
     int len = (int)(*esi);
     char *buf = (char *)(*(esi + 1));
 
-    if (len > MEGABYTES) return -1;
+    if (len <= 0 || len > MEGABYTES) return -1;
+
+    /* nothing is printed from a bad buffer */
     int ret = validate_user_mem((uint32_t)buf, len, MAP_USER);
     if (ret < 0) return -1;
 
+    char chunk[PRINT_CHUNK];
+    int offset;
     /* make it thread safe */
     kern_mutex_lock(&print_mutex);
-    putbytes(buf, len);
+    for (offset = 0; offset < len; offset += PRINT_CHUNK) {
+        int size = (len - offset < PRINT_CHUNK) ? len - offset : PRINT_CHUNK;
+        if (copy_from_user(chunk, buf + offset, size) < 0) {
+            ret = -1;
+            break;
+        }
+        putbytes(chunk, size);
+    }
     kern_mutex_unlock(&print_mutex);
-    return 0;
+    return ret;
 }
 
 /**
@@ -211,8 +233,9 @@ int kern_readfile(void) {
     if (count < 0) return -1;
 
     int ret;
-    // check whether filename is valid
-    ret = validate_user_string((uint32_t)filename, EXECNAME_MAX);
+    // copy filename to kernel memory, which also checks that it is valid
+    char namebuf[EXECNAME_MAX];
+    ret = strncpy_from_user(namebuf, filename, EXECNAME_MAX);
     if (ret <= 0) return -1;
 
     if (count > 0) {
@@ -221,6 +244,6 @@ int kern_readfile(void) {
         if (ret < 0) return -1;
     }
 
-    ret = getbytes(filename, offset, count, buf);
+    ret = getbytes(namebuf, offset, count, buf);
     return ret;
 }
@@ -22,6 +22,7 @@
 #include "scheduler.h"           /* scheduler declaration and interface */
 #include "vm.h"                  /* virtual memory management */
 #include "asm_kern_to_user.h"    /* asm_kern_to_user */
+#include "user_copy.h"           /* copy_from_user, strncpy_from_user */
 
 #define EXECNAME_MAX 64
 #define ARGVEC_MAX 128
@@ -34,6 +35,7 @@ void asm_set_exec_context(uint32_t old_kern_sp,
                           uint32_t *new_cur_sp_ptr,
                           uint32_t *new_ip_ptr);
 void asm_hlt(void);
+static void wait_return_zombie(task_t *task, task_t *zombie);
 
 /**
  * @brief   Creates a new task.
@@ -72,13 +74,24 @@ int kern_fork(void) {
     new_task->parent_task = old_task;
 
     /* copy parent's page directory to the child */
+    kern_mutex_lock(&(old_task->vm_mutex));
     ret = page_dir_copy(new_task->page_dir, old_task->page_dir);
+    kern_mutex_unlock(&(old_task->vm_mutex));
     if (ret != 0) {
         lprintf("page_dir_copy() failed in kern_fork at line %d", __LINE__);
         task_destroy(new_task);
         return -1;
     }
 
+    /* the child needs its own reservations for pages not touched yet */
+    if (dec_num_free_frames(old_task->pending_frames) < 0) {
+        lprintf("dec_num_free_frames() failed in kern_fork at line %d",
+                __LINE__);
+        task_destroy(new_task);
+        return -1;
+    }
+    new_task->pending_frames = old_task->pending_frames;
+
     /* copy parent's memory mapping to child */
     ret = maps_copy(old_task->maps, new_task->maps);
     if (ret != 0) {
@@ -106,6 +119,8 @@ int kern_fork(void) {
     new_thread->swexn_sp = old_thread->swexn_sp;
     new_thread->swexn_handler = old_thread->swexn_handler;
     new_thread->swexn_arg = old_thread->swexn_arg;
+    new_thread->priority = old_thread->priority;
+    new_thread->sche_level = old_thread->priority;
     /* add new thread to new task's thread list */
     add_node_to_head(new_task->live_thread_list, TCB_TO_LIST_NODE(new_thread));
     /* add new task to parent's child task list */
@@ -122,11 +137,13 @@ int kern_fork(void) {
     /* Cannot declare variables here, because we will break the stack */
     cur_thr = get_cur_tcb();
     if (cur_thr->tid != old_tid) {
+        /* the child starts with the scheduler locked by sche_yield() */
+        sche_unlock();
         return 0;
     } else {
-        disable_interrupts();
+        sche_lock();
         sche_push_back(new_thread);
-        enable_interrupts();
+        sche_unlock();
         return new_thread->tid;
     }
 }
@@ -154,6 +171,8 @@ int kern_thread_fork(void) {
 
     new_thread->task = cur_task;
     new_thread->status = FORKED;
+    new_thread->priority = old_thread->priority;
+    new_thread->sche_level = old_thread->priority;
     asm_set_exec_context(old_thread->kern_sp,
                          new_thread->kern_sp,
                          &(new_thread->cur_sp),
@@ -161,11 +180,13 @@ int kern_thread_fork(void) {
 
     cur_thr = get_cur_tcb();
     if (cur_thr->tid != old_tid) {
+        /* the child starts with the scheduler locked by sche_yield() */
+        sche_unlock();
         return 0;
     } else {
-        disable_interrupts();
+        sche_lock();
         sche_push_back(new_thread);
-        enable_interrupts();
+        sche_unlock();
         return new_thread->tid;
     }
 }
@@ -193,64 +214,40 @@ int kern_exec(void) {
     kern_mutex_unlock(&(task->thread_list_mutex));
     if (live_threads > 1) return -1;
 
-    char **temp = argvec;
+    // copy arguments to kernel memory so we can clear user memory
+    char argbuf[ARGVEC_MAX];
+    char *ptrbuf[ARGC_MAX];
+    char *marker = argbuf;
     int argc = 0;
-    int total_len = 0;
     int ret;
     int len;
 
-    /* check whether temp points to a valid location in user meory */
-    ret = validate_user_mem((uint32_t)temp, sizeof(char *), MAP_USER);
-    /* if temp is NULL, argv is empty and we can move on */
-    if (temp && ret < 0) return -1;
+    /* if argvec is NULL, argv is empty and we can move on */
+    while (argvec != NULL) {
+        char *arg;
+        ret = copy_from_user(&arg, argvec + argc, sizeof(char *));
+        if (ret < 0) return -1;
+        if (arg == NULL) break;
+        if (argc == ARGC_MAX) return -1;
 
-    while (temp && *temp) {
-        char *arg = *temp;
-        /* validate_user_string return string length if valid */
-        len = validate_user_string((uint32_t)arg, ARGVEC_MAX);
+        /* the arguments may take ARGVEC_MAX bytes in total */
+        len = strncpy_from_user(marker, arg, argbuf + ARGVEC_MAX - marker);
         if (len <= 0) return -1;
-        total_len += len;
-        if (total_len > ARGVEC_MAX) return -1;
-
-        argc += 1;
-        if (argc > ARGC_MAX) return -1;
-
-        /* increment temp, which points to the next argument */
-        temp += 1;
-        ret = validate_user_mem((uint32_t)temp, sizeof(char *), MAP_USER);
-        if (ret < 0) return -1;
+        // store the argument's kernel memory address
+        ptrbuf[argc++] = marker;
+        // point marker to the next free space in argbuf
+        marker += len;
     }
 
-    ret = validate_user_string((uint32_t)execname, EXECNAME_MAX);
-    if (ret <= 0) return -1;
     // copy execname to kernel memory so we can clear user memory
     char namebuf[EXECNAME_MAX];
-    sprintf(namebuf, "%s", execname);
+    ret = strncpy_from_user(namebuf, execname, EXECNAME_MAX);
+    if (ret <= 0) return -1;
 
     simple_elf_t elf_header;
     ret = elf_load_helper(&elf_header, namebuf);
     if (ret < 0) return -1;
 
-    // copy arguments to kernel memory so we can clear user memory
-    char argbuf[ARGVEC_MAX];
-    char *ptrbuf[ARGC_MAX];
-    char *arg;
-    char *marker = argbuf;
-
-    int i;
-    for (i = 0; i < argc; i++) {
-        // point arg to next argument
-        arg = *(argvec + i);
-        // we can use strlen now since we know that the argument terminates
-        len = strlen(arg);
-        strncpy(marker, arg, len);
-        marker[len] = '\0';
-        // store the argument's kernel memory address
-        ptrbuf[i] = marker;
-        // point marker to the next free space in argbuf
-        marker += len + 1;
-    }
-
     thread->cur_sp = USER_STACK_START;
     thread->ip = elf_header.e_entry;
     // we need to deregister the swexn handler if one exists
@@ -269,24 +266,18 @@ int kern_exec(void) {
      */
 
     maps_clear(task->maps);
-    // reserve the kernel memory region
-    ret = maps_insert(task->maps, 0, PAGE_SIZE * NUM_KERN_PAGES - 1, 0);
-    if (ret < 0) {
-        lprintf("i commited to exec and failed :(");
-        kern_vanish();
-    }
-    // reserve the highest page for physical reads and writes
-    ret = maps_insert(task->maps, RW_PHYS_VA, RW_PHYS_VA + PAGE_SIZE - 1, 0);
+    // reserve the kernel memory regions
+    ret = reserve_kernel_maps(task->maps);
     if (ret < 0) {
         lprintf("i commited to exec and failed :(");
         kern_vanish();
     }
 
-    page_dir_clear(task->page_dir);
-    set_cr3((uint32_t)task->page_dir);
+    /* this also drops the old program's translations from the TLB */
+    task_vm_clear(task);
 
-    // load the new binary into the fresh virtual memory
-    ret = load_program(&elf_header, task->maps);
+    // map the new binary into the fresh virtual memory
+    ret = load_program(&elf_header, task);
     if (ret < 0) {
         lprintf("i commited to exec and failed :(");
         kern_vanish();
@@ -300,15 +291,10 @@ int kern_exec(void) {
     char *buf = (char *)argv;
     buf += (argc + 1) * sizeof(int); // plus one for the argv null terminator
 
-    // copy from kernel memory to user space
-    for (i = 0; i < argc; i++) {
-        arg = *(ptrbuf + i);
-        len = strlen(arg);
-        strncpy(buf, arg, len);
-        buf[len] = '\0';
-        argv[i] = buf;
-        buf += len + 1;
-    }
+    // copy from kernel memory to user space, the arguments are contiguous
+    memcpy(buf, argbuf, marker - argbuf);
+    int i;
+    for (i = 0; i < argc; i++) argv[i] = buf + (ptrbuf[i] - argbuf);
     // null terminate the user argument vector
     argv[argc] = NULL;
 
@@ -373,12 +359,12 @@ void kern_vanish(void) {
 
     if (live_threads > 0) {
         /*
-         * Need to disable interrupts here, before unlocking the thread list
+         * Need to lock the scheduler here, before unlocking the thread list
          * mutex. Otherwise, another thread might be switched to and vanish,
          * finding that it is the last thread to vanish. Then the task could
          * be given to a waiting thread and destroyed while we are running...
          */
-        disable_interrupts();
+        sche_lock();
         cli_kern_mutex_unlock(&(task->thread_list_mutex));
         sche_yield(ZOMBIE);
     } else {
@@ -386,7 +372,7 @@ void kern_vanish(void) {
 
         orphan_children(task);
         orphan_zombies(task);
-        page_dir_clear(task->page_dir);
+        task_vm_clear(task);
         maps_clear(task->maps);
 
         // lock the vanish mutex to access the parent pointer
@@ -412,8 +398,8 @@ void kern_vanish(void) {
             wait_node_t *waiter = (wait_node_t *)node;
             waiter->zombie = task;
 
-            // disable interrupts to protect scheduler structures
-            disable_interrupts();
+            // lock the scheduler to protect its structures
+            sche_lock();
 
             // wake the waiting thread
             waiter->thread->status = RUNNABLE;
@@ -443,11 +429,11 @@ void kern_vanish(void) {
             }
 
             /*
-             * We must disable interrupts before adding the task to the zombie
+             * We must lock the scheduler before adding the task to the zombie
              * task list. Otherwise, a waiting thread could receive the task
              * and destroy it before we finish yielding...
              */
-            disable_interrupts();
+            sche_lock();
             add_node_to_tail(parent->zombie_task_list, TASK_TO_LIST_NODE(task));
             cli_kern_mutex_unlock(&(parent->wait_mutex));
             cli_kern_mutex_unlock(&(task->vanish_mutex));
@@ -480,12 +466,6 @@ int kern_wait(void) {
     thread_t *thread = get_cur_tcb();
     task_t *task = thread->task;
 
-    if (status_ptr != NULL) {
-        int perms = MAP_USER | MAP_WRITE;
-        int ret = validate_user_mem((uint32_t)status_ptr, sizeof(int), perms);
-        if (ret < 0) return -1;
-    }
-
     task_t *zombie;
 
     // get access to the waiting threads and zombie task lists
@@ -508,10 +488,10 @@ int kern_wait(void) {
         wait_node_t wait_node;
         wait_node.thread = thread;
 
-        disable_interrupts();
+        sche_lock();
 
         /*
-         * We must disable interrupts here before adding ourselves to the
+         * We must lock the scheduler here before adding ourselves to the
          * waiting thread list. Otherwise, we could be "woken up" before
          * we block...
          */
@@ -524,12 +504,42 @@ int kern_wait(void) {
     }
 
     int ret = zombie->task_id;
-    if (status_ptr != NULL) *status_ptr = zombie->status;
+    int status = zombie->status;
+    if (status_ptr != NULL &&
+            copy_to_user(status_ptr, &status, sizeof(int)) < 0) {
+        /* the child is not lost, a later wait() can still collect it */
+        wait_return_zombie(task, zombie);
+        return -1;
+    }
 
     task_destroy(zombie);
     return ret;
 }
 
+/**
+ * Gives back a zombie whose exit status could not be stored, to a thread of
+ * the task that started waiting meanwhile, or else to the front of the
+ * task's zombie list.
+ * @param task   the waiting task
+ * @param zombie the zombie child
+ */
+static void wait_return_zombie(task_t *task, task_t *zombie) {
+    kern_mutex_lock(&(task->wait_mutex));
+    node_t *node = pop_first_node(task->waiting_thread_list);
+    if (node != NULL) {
+        wait_node_t *waiter = (wait_node_t *)node;
+        waiter->zombie = zombie;
+
+        sche_lock();
+        waiter->thread->status = RUNNABLE;
+        sche_push_back(waiter->thread);
+        sche_unlock();
+    } else {
+        add_node_to_head(task->zombie_task_list, TASK_TO_LIST_NODE(zombie));
+    }
+    kern_mutex_unlock(&(task->wait_mutex));
+}
+
 /**
  * Ceases execution of the operating system.
  */
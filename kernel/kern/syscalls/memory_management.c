@@ -7,12 +7,23 @@
  */
 #include <stdlib.h>
 #include <assert.h>
+#include <cr.h>                  /* get_cr3 */
 
 #include "syscalls/syscalls.h"
 #include "task.h"
 #include "vm.h"
 #include "scheduler.h"
-#include "asm_page_inval.h"
+#include "page_cache.h"
+#include "swap.h"
+#include "utils/loader.h"
+#include "user_copy.h"
+
+#define EXECNAME_MAX 64
+
+static int new_region(uint32_t base, uint32_t len, int perms);
+static int remove_range(task_t *task, uint32_t base, uint32_t len);
+static int split_partial(uint32_t addr);
+static int release_pages(uint32_t base, uint32_t len, int *num_swapped);
 
 /**
  * @brief   Allocates new memory to the invoking task, starting at base and
@@ -25,6 +36,34 @@ int kern_new_pages(void) {
     uint32_t base = (*esi);
     uint32_t len = (*(esi + 1));
 
+    return new_region(base, len, MAP_USER | MAP_WRITE | MAP_REMOVE);
+}
+
+/**
+ * @brief   Allocates new memory to the invoking task like new_pages(), but
+ *          the pages join a region ending right below base instead of
+ *          starting a region of their own, as a growing heap wants. They are
+ *          given back with remove_pages() on the start of that region, or
+ *          piecewise with remove_pages_range().
+ * @return  0 as success, -1 as failure
+ */
+int kern_grow_pages(void) {
+    uint32_t *esi = (uint32_t *)asm_get_esi();
+    uint32_t base = (*esi);
+    uint32_t len = (*(esi + 1));
+
+    return new_region(base, len,
+                      MAP_USER | MAP_WRITE | MAP_REMOVE | MAP_MERGE);
+}
+
+/**
+ * Records a new anonymous region of the current task and reserves its frames.
+ * @param  base  start of the region
+ * @param  len   length of the region
+ * @param  perms permissions of the region, as defined in maps.h
+ * @return       0 as success, -1 as failure
+ */
+static int new_region(uint32_t base, uint32_t len, int perms) {
     /* check base alignment */
     if (base & (~PAGE_ALIGN_MASK)) {
         return -1;
@@ -43,46 +82,97 @@ int kern_new_pages(void) {
 
     thread_t *thread = get_cur_tcb();
     task_t *task = thread->task;
+    int num_pages = len / PAGE_SIZE;
+
+    /*
+     * Only the region is recorded here, pages are mapped by demand_fault()
+     * on first touch. Taking the vm_mutex keeps the region from racing
+     * with faults and other threads' new_pages() and remove_pages().
+     */
+    kern_mutex_lock(&(task->vm_mutex));
     if (maps_find(task->maps, base, high)) {
         /* already mapped or reserved */
+        kern_mutex_unlock(&(task->vm_mutex));
         return -1;
     }
 
-    if (dec_num_free_frames(len / PAGE_SIZE) < 0) {
+    if (dec_num_free_frames(num_pages) < 0) {
         /* not enough memory */
+        kern_mutex_unlock(&(task->vm_mutex));
         return -1;
     }
 
-    uint32_t zfod_frame = get_zfod_frame();
-
-    int ret;
-    uint32_t offset;
-    /* set page frame for page table entry region from base to base + len */
-    for (offset = 0; offset < len; offset += PAGE_SIZE) {
-        /* ser page table entry for user */
-        ret = set_pte(base + offset, zfod_frame, PTE_USER | PTE_PRESENT);
-        if (ret < 0) {
-            // set_pte could fail when calling smemalign, so we reset
-            uint32_t reoffset;
-            for (reoffset = 0; reoffset < offset; reoffset += PAGE_SIZE) {
-                // this call will not fail
-                set_pte(base + reoffset, 0, 0);
-            }
-            inc_num_free_frames(len / PAGE_SIZE);
-            return -1;
-        }
-    }
-
     /* map memory region from base to base + len */
-    maps_insert(task->maps, base, high, MAP_USER | MAP_WRITE | MAP_REMOVE);
+    if (maps_insert(task->maps, base, high, perms) < 0) {
+        kern_mutex_unlock(&(task->vm_mutex));
+        inc_num_free_frames(num_pages);
+        return -1;
+    }
+    task->pending_frames += num_pages;
+    kern_mutex_unlock(&(task->vm_mutex));
 
     return 0;
 }
 
+/**
+ * @brief   Maps a file from the exec2obj table read-only into the invoking
+ *          task at base, which must be page aligned, and rounded up to whole
+ *          pages. Nothing is copied here: pages are filled in by
+ *          demand_fault() from the kernel's copy of the file, which is mapped
+ *          in place where it is page aligned. The region is released by
+ *          remove_pages().
+ * @return  the length of the file as success, -1 as failure
+ */
+int kern_map_file(void) {
+    uint32_t *esi = (uint32_t *)asm_get_esi();
+    char *filename = (char *)(*esi);
+    uint32_t base = (*(esi + 1));
+
+    if (base & (~PAGE_ALIGN_MASK)) return -1;
+
+    /* look the file up before the vm_mutex is held, the name may fault */
+    char namebuf[EXECNAME_MAX];
+    int ret = strncpy_from_user(namebuf, filename, EXECNAME_MAX);
+    if (ret <= 0) return -1;
+    int file_len;
+    const char *file = get_file_bytes(namebuf, &file_len);
+    if (file == NULL || file_len <= 0) return -1;
+
+    int num_pages = (file_len + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t high = base + (num_pages * PAGE_SIZE - 1);
+    if (high < base) return -1;
+
+    thread_t *thread = get_cur_tcb();
+    task_t *task = thread->task;
+
+    kern_mutex_lock(&(task->vm_mutex));
+    if (maps_find(task->maps, base, high)) {
+        kern_mutex_unlock(&(task->vm_mutex));
+        return -1;
+    }
+
+    /* every page gets a reservation, for when it cannot be mapped in place */
+    if (dec_num_free_frames(num_pages) < 0) {
+        kern_mutex_unlock(&(task->vm_mutex));
+        return -1;
+    }
+
+    int perms = MAP_USER | MAP_REMOVE;
+    if (maps_insert_file(task->maps, base, high, perms, file, file_len) < 0) {
+        kern_mutex_unlock(&(task->vm_mutex));
+        inc_num_free_frames(num_pages);
+        return -1;
+    }
+    task->pending_frames += num_pages;
+    kern_mutex_unlock(&(task->vm_mutex));
+
+    return file_len;
+}
+
 /**
  * @brief   Deallocates the specified memory region, which must presently be
- *          allocated as the result of a previous call to new pages() which
- *          specified the same value of base.
+ *          allocated as the result of a previous call to new pages() or
+ *          map_file() which specified the same value of base.
  * @return  0 as success, -1 as failure
  */
 int kern_remove_pages(void) {
@@ -90,34 +180,185 @@ int kern_remove_pages(void) {
 
     thread_t *thread = get_cur_tcb();
     task_t *task = thread->task;
+
+    kern_mutex_lock(&(task->vm_mutex));
     map_t *map = maps_find(task->maps, base, base);
 
     /* already mapped or reserved */
-    if (!map) return -1;
+    if (!map) {
+        kern_mutex_unlock(&(task->vm_mutex));
+        return -1;
+    }
 
     /* not align */
-    if (map->low != base) return -1;
+    if (map->low != base) {
+        kern_mutex_unlock(&(task->vm_mutex));
+        return -1;
+    }
 
     /* cannot be removed */
-    if (!(map->perms & MAP_REMOVE)) return -1;
+    if (!(map->perms & MAP_REMOVE)) {
+        kern_mutex_unlock(&(task->vm_mutex));
+        return -1;
+    }
 
     uint32_t len = map->high - map->low + 1;
-    inc_num_free_frames(len / PAGE_SIZE);
-
-    uint32_t addr, frame;
-    /* free memory frames to kernel and reset the page table entry */
-    for (addr = map->low; addr < map->high; addr += PAGE_SIZE) {
-        frame = get_pte(addr) & PAGE_ALIGN_MASK;
-        assert(frame != 0);
-        if (frame != get_zfod_frame()) free_frame(frame);
-        inc_num_free_frames(1);
-        asm_page_inval((void *)addr);
-        set_pte(addr, 0, 0);
+    int ret = remove_range(task, base, len);
+    kern_mutex_unlock(&(task->vm_mutex));
+    return ret;
+}
+
+/**
+ * @brief   Deallocates len bytes starting at base, which must be page aligned
+ *          and lie within one region set up by new_pages(), grow_pages() or
+ *          map_file(). What is left of the region on either side stays
+ *          allocated, as regions of their own.
+ * @return  0 as success, -1 as failure
+ */
+int kern_remove_pages_range(void) {
+    uint32_t *esi = (uint32_t *)asm_get_esi();
+    uint32_t base = (*esi);
+    uint32_t len = (*(esi + 1));
+
+    if (base & (~PAGE_ALIGN_MASK)) return -1;
+    if (len == 0 || len % PAGE_SIZE != 0) return -1;
+    uint32_t high = base + (len - 1);
+    if (high < base) return -1;
+
+    thread_t *thread = get_cur_tcb();
+    task_t *task = thread->task;
+
+    kern_mutex_lock(&(task->vm_mutex));
+    map_t *map = maps_find(task->maps, base, base);
+    if (!map || high > map->high || !(map->perms & MAP_REMOVE)) {
+        kern_mutex_unlock(&(task->vm_mutex));
+        return -1;
     }
 
+    int ret = remove_range(task, base, len);
+    kern_mutex_unlock(&(task->vm_mutex));
+    return ret;
+}
+
+/**
+ * Unmaps part of a region of the current task, or all of it, and gives its
+ * frames and reservations back. Large pages the part only covers some of
+ * are broken up first. Assumes the task's vm_mutex is held.
+ * @param  task task control block pointer
+ * @param  base start of the part, page aligned
+ * @param  len  length of the part, a multiple of the page size
+ * @return      0 as success, -1 if out of kernel memory, in which case
+ *              nothing was removed
+ */
+static int remove_range(task_t *task, uint32_t base, uint32_t len) {
+    int num_pages = len / PAGE_SIZE;
+    uint32_t end = base + len;
+
+    if (split_partial(base) < 0 || split_partial(end) < 0) return -1;
+
     /* delete the mapping */
-    maps_delete(task->maps, base);
+    if (maps_delete_range(task->maps, base, end - 1) < 0) return -1;
+
+    int num_swapped;
+    int num_present = release_pages(base, len, &num_swapped);
+
+    /*
+     * pages never touched still hold their reservations in pending_frames,
+     * while swapped out pages gave theirs back when they were evicted
+     */
+    task->pending_frames -= num_pages - num_present - num_swapped;
+    inc_num_free_frames(num_pages - num_swapped);
+    return 0;
+}
 
+
+/**
+ * @brief   Copies a snapshot of physical memory statistics, such as buddy
+ *          allocator fragmentation, to the buffer given by the invoking task.
+ * @return  0 as success, -1 as failure
+ */
+int kern_get_vm_stats(void) {
+    vm_stats_t *stats = (vm_stats_t *)asm_get_esi();
+
+    /* fill a kernel copy so no user page faults while allocator locks held */
+    vm_stats_t snapshot;
+    vm_get_stats(&snapshot);
+    page_cache_get_stats(&snapshot);
+    swap_get_stats(&snapshot);
+    maps_get_cache_stats(get_cur_tcb()->task->maps,
+                         &snapshot.maps_cache_hits,
+                         &snapshot.maps_cache_misses);
+    sche_get_stats(&snapshot.cpus_online, &snapshot.threads_stolen);
+    if (copy_to_user(stats, &snapshot, sizeof(snapshot)) < 0) return -1;
     return 0;
 }
 
+/**
+ * Breaks up the large page around an end of a range being removed, unless
+ * the end falls on its boundary.
+ * @param  addr the start or the end of the range
+ * @return      0 as success, -1 if out of kernel memory
+ */
+static int split_partial(uint32_t addr) {
+    if (!(addr & ~LARGE_PAGE_MASK)) return 0;
+
+    uint32_t pde = get_pde(addr);
+    if (!(pde & PDE_PRESENT) || !(pde & PDE_PAGE_SIZE)) return 0;
+    return split_large_page(addr & LARGE_PAGE_MASK);
+}
+
+/**
+ * Unmaps a region set up by new_pages(), or part of one, which may consist
+ * of 4MB large pages, 4KB pages, swapped out pages and pages never touched,
+ * and frees the frames and swap slots no longer in use. Stale translations
+ * are dropped together before the frames are freed. Reservations are left to
+ * the caller.
+ * @param  base          start of the region
+ * @param  len           length of the region
+ * @param  num_swapped   set to the number of pages that were swapped out
+ * @return               the number of pages that were mapped
+ */
+static int release_pages(uint32_t base, uint32_t len, int *num_swapped) {
+    frame_batch_t batch;
+    frame_batch_init(&batch);
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, (uint32_t *)get_cr3());
+    uint32_t addr = base;
+    uint32_t pte;
+    int num_present = 0;
+    *num_swapped = 0;
+    /* collect memory frames to free and reset the page table entry */
+    while (addr - base < len) {
+        uint32_t pde = get_pde(addr);
+        if (!(pde & PDE_PRESENT)) {
+            /* nothing in this 4MB was touched */
+            addr = (addr & LARGE_PAGE_MASK) + LARGE_PAGE_SIZE;
+            if (addr == 0) break;
+            continue;
+        }
+        if (pde & PDE_PAGE_SIZE) {
+            /* remove_range() broke up the ones not wholly removed */
+            assert(!(addr & ~LARGE_PAGE_MASK) &&
+                   len - (addr - base) >= LARGE_PAGE_SIZE);
+            unmap_large_page(addr);
+            num_present += FRAMES_PER_LARGE_PAGE;
+            addr += LARGE_PAGE_SIZE;
+            continue;
+        }
+        pte = get_pte(addr);
+        if (pte & PTE_PRESENT) {
+            put_frame_batched(&batch, pte & PAGE_ALIGN_MASK);
+            set_pte(addr, 0, 0);
+            tlb_gather_page(&gather, addr);
+            num_present++;
+        } else if (pte & PTE_SWAPPED) {
+            swap_put(PTE_TO_SLOT(pte));
+            set_pte(addr, 0, 0);
+            (*num_swapped)++;
+        }
+        addr += PAGE_SIZE;
+    }
+    tlb_gather_flush(&gather);
+    free_frames_batch(&batch);
+    return num_present;
+}
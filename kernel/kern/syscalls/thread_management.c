@@ -9,7 +9,6 @@
 
 /* libc includes */
 #include <stdlib.h>
-#include <asm.h>                 /* disable_interrupts(), enable_interrupts() */
 #include <x86/eflags.h>
 #include <x86/seg.h>
 #include <string.h>
@@ -21,8 +20,10 @@
 #include "syscalls/syscalls.h"
 #include "task.h"                 /* task thread declaration and interface */
 #include "scheduler.h"            /* scheduler declaration and interface */
+#include "vm.h"                   /* get_pte */
 #include "utils/tcb_hashtab.h"    /* insert and find tcb by tid */
 #include "drivers/timer_driver.h" /* get_timer_ticks */
+#include "user_copy.h"             /* copy_from_user */
 
 /**
  * @brief Get thread id
@@ -49,19 +50,22 @@ int kern_yield(void) {
         return 0;
     }
 
+    /* the bucket stays locked so the thread cannot be reaped meanwhile */
+    thread_t *thr = tcb_hashtab_get_locked(tid);
+    if (thr == NULL) return -1;
     /**
-     * We need disable interrupts here, because we need to ensure no one can
+     * We need lock the scheduler here, because we need to ensure no one can
      * change thread's status before we actually yield to that thread.
      */
-    disable_interrupts();
-    thread_t *thr = tcb_hashtab_get(tid);
-    if (thr == NULL) return -1;
+    sche_lock();
     if (thr->status != RUNNABLE
             && thr->status != INITIALIZED
             && thr->status != FORKED) {
-        enable_interrupts();
+        tcb_hashtab_cli_unlock(tid);
+        sche_unlock();
         return -1;
     }
+    tcb_hashtab_cli_unlock(tid);
     sche_move_front(thr);
     sche_yield(RUNNABLE);
 
@@ -79,11 +83,25 @@ int kern_yield(void) {
  */
 int kern_deschedule(void) {
     int *reject = (int *)asm_get_esi();
+    uint32_t first = (uint32_t)reject;
+    uint32_t last = first + sizeof(int) - 1;
+    int value;
 
-    /* still need to ensure no one can change reject's addressed value */
-    disable_interrupts();
+    while (1) {
+        /* fault the word in now, a fault with the scheduler locked would
+         * unlock it in the vm_mutex and lose a make_runnable() */
+        if (copy_from_user(&value, reject, sizeof(int)) < 0) return -1;
+
+        /* still need to ensure no one can change reject's addressed value */
+        sche_lock();
+        if ((get_pte(first) & PTE_PRESENT) && (get_pte(last) & PTE_PRESENT)) {
+            break;
+        }
+        /* evicted again before we got the lock */
+        sche_unlock();
+    }
     if (*reject != 0) {
-        enable_interrupts();
+        sche_unlock();
         return 0;
     }
     sche_yield(SUSPENDED);
@@ -99,13 +117,19 @@ int kern_deschedule(void) {
 int kern_make_runnable(void) {
     int tid = (int)asm_get_esi();
 
-    disable_interrupts();
-    thread_t *thr = tcb_hashtab_get(tid);
+    /* the bucket stays locked so the thread cannot be reaped meanwhile */
+    thread_t *thr = tcb_hashtab_get_locked(tid);
     if (thr == NULL) return -1;
-    if (thr->status != SUSPENDED) return -1;
+    sche_lock();
+    if (thr->status != SUSPENDED) {
+        tcb_hashtab_cli_unlock(tid);
+        sche_unlock();
+        return -1;
+    }
+    tcb_hashtab_cli_unlock(tid);
     thr->status = RUNNABLE;
     sche_push_front(thr);
-    enable_interrupts();
+    sche_unlock();
 
     return 0;
 }
@@ -137,13 +161,27 @@ int kern_sleep(void) {
     sleep_node.thread = get_cur_tcb();
     sleep_node.wakeup_ticks = wakeup_ticks;
 
-    disable_interrupts();
+    sche_lock();
     tranquilize(&sleep_node);
     sche_yield(SLEEPING);
 
     return 0;
 }
 
+/**
+ * @brief   Sets the calling thread's priority hint, the highest scheduler
+ *          level it may run at, from PRIORITY_HIGH down to PRIORITY_LOW.
+ *          Threads created by the thread keep its hint.
+ * @return  0 as success, -1 if the hint is out of range
+ */
+int kern_set_priority(void) {
+    int priority = (int)asm_get_esi();
+
+    if (priority < PRIORITY_HIGH || priority > PRIORITY_LOW) return -1;
+    sche_set_priority(get_cur_tcb(), priority);
+    return 0;
+}
+
 /** @brief Installs a swexn handler.
  *
  *  If esp3 or eip are zero, the current handler is deregistered if one exists.
@@ -162,10 +200,20 @@ int kern_swexn(void) {
     void *esp3 = (void *)(*esi);
     swexn_handler_t eip = (swexn_handler_t)(*(esi + 1));
     void *arg = (void *)(*(esi + 2));
-    ureg_t *newureg = (ureg_t *)(*(esi + 3));
+    ureg_t *user_newureg = (ureg_t *)(*(esi + 3));
 
     thread_t *thread = get_cur_tcb();
 
+    /* work on a kernel copy, which the caller cannot change under us */
+    ureg_t newureg_copy;
+    ureg_t *newureg = NULL;
+    if (user_newureg != NULL) {
+        if (copy_from_user(&newureg_copy, user_newureg, sizeof(ureg_t)) < 0) {
+            return -1;
+        }
+        newureg = &newureg_copy;
+    }
+
     if (newureg != NULL) {
         uint32_t zero = 0;
         // check that io privilege is not changed
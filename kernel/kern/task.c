@@ -11,20 +11,34 @@
 #include <stdlib.h>
 #include <malloc.h>
 #include <string.h>
-#include <asm.h>                /* disable_interrupts enable_interrupts */
+#include <assert.h>
 
 /* DEBUG */
 #include <simics.h>
-#include <asm.h>            /* disable_interrupts enable_interrupts */
 #include <x86/cr.h>
+#include <smp/smp.h>            /* smp_get_cpu */
 
 #include "task.h"
 #include "vm.h"                 /* predefines for virtual memory */
 #include "scheduler.h"          /* schedule node */
 #include "utils/maps.h"         /* memory mapping */
 #include "utils/tcb_hashtab.h"
+#include "asm_page_inval.h"     /* asm_page_inval */
+#include "utils/loader.h"       /* get_file_bytes */
+#include "page_cache.h"         /* page_cache_get page_cache_put */
+#include "swap.h"               /* PTE_SWAPPED */
+
+static int map_elf_section(task_t *task, const char *file, int file_len,
+                           unsigned long start, unsigned long len,
+                           long offset, int perms);
+static void fill_page(map_list_t *maps, char *dest, uint32_t page,
+                      uint32_t low, uint32_t high, int *pte_flags);
+static uint32_t shared_frame(map_t *map, uint32_t page);
+static int anon_fault(task_t *task, map_t *map, uint32_t page, int write);
+static int file_fault(task_t *task, map_t *map, uint32_t page);
+static int map_fault(task_t *task, map_t *map, uint32_t page, int write);
+static int fault_around(task_t *task, map_t *map, uint32_t page, int write);
 
-thread_t *idle_thread;
 /* used when task is cleared, give all children to init */
 thread_t *init_thread;
 
@@ -81,7 +95,7 @@ task_t *task_init() {
 
     if (task_lists_init(task) < 0) {
         lprintf("task_lists_init() failed in task_init at line %d", __LINE__);
-        sfree(task->page_dir, PAGE_SIZE);
+        page_dir_destroy(task->page_dir);
         free(task_node);
         return NULL;
     }
@@ -89,7 +103,7 @@ task_t *task_init() {
     if (task_mutexes_init(task) < 0) {
         lprintf("task_mutexes_init() failed in task_init at line %d", __LINE__);
         task_lists_destroy(task);
-        sfree(task->page_dir, PAGE_SIZE);
+        page_dir_destroy(task->page_dir);
         free(task_node);
         return NULL;
     }
@@ -99,10 +113,15 @@ task_t *task_init() {
         lprintf("maps_init() failed in task_init at line %d", __LINE__);
         task_mutexes_destroy(task);
         task_lists_destroy(task);
-        sfree(task->page_dir, PAGE_SIZE);
+        page_dir_destroy(task->page_dir);
         free(task_node);
         return NULL;
     }
+    vm_set_page_dir_lock(task->page_dir, &(task->vm_mutex));
+    task->fault_window = FAULT_AROUND_PAGES;
+    /* start next to the task creating it, any CPU would do */
+    task->cpu = smp_get_cpu();
+    task->num_active = 0;
 
     return task;
 }
@@ -117,8 +136,9 @@ void task_clear(task_t *task) {
      * directory pointer as a flag for whether the task has been cleared
      */
     if (task->page_dir != NULL) {
-        page_dir_clear(task->page_dir);
-        sfree(task->page_dir, PAGE_SIZE);
+        inc_num_free_frames(task->pending_frames);
+        task->pending_frames = 0;
+        page_dir_destroy(task->page_dir);
         task->page_dir = NULL;
         maps_destroy(task->maps);
 
@@ -238,6 +258,15 @@ int task_mutexes_init(task_t *task) {
         return -1;
     }
 
+    ret = kern_mutex_init(&(task->vm_mutex));
+    if (ret < 0) {
+        kern_mutex_destroy(&(task->thread_list_mutex));
+        kern_mutex_destroy(&(task->child_task_list_mutex));
+        kern_mutex_destroy(&(task->wait_mutex));
+        kern_mutex_destroy(&(task->vanish_mutex));
+        return -1;
+    }
+
     return 0;
 }
 
@@ -250,6 +279,7 @@ void task_mutexes_destroy(task_t *task) {
     kern_mutex_destroy(&(task->child_task_list_mutex));
     kern_mutex_destroy(&(task->wait_mutex));
     kern_mutex_destroy(&(task->vanish_mutex));
+    kern_mutex_destroy(&(task->vm_mutex));
 }
 
 /**
@@ -338,180 +368,390 @@ int validate_user_mem(uint32_t addr, uint32_t len, int perms) {
 }
 
 /**
- * Checks for validity of a string in user memory.
- * @param  addr    address of string
- * @param  max_len max length that needs to be checked
- * @return         negative if string goes outside user memory
- *                 0 if string is present but does not terminate in max_len
- *                 length including null terminator otherwise
+ * Reserves the parts of an address space that belong to the kernel, so that
+ * they can never be mapped by the task: the 16MB kernel memory, the direct
+ * map of physical memory if there is one, and the top 4MB for kmap slots.
+ * @param  maps memory map list of the task
+ * @return      0 as success, -1 as failure
  */
-int validate_user_string(uint32_t addr, int max_len) {
-    thread_t *thread = get_cur_tcb();
-    task_t *task = thread->task;
-
-    uint32_t low = addr;
-    if (max_len <= 0) return -1;
-    int len = 0;
-
-    while (len < max_len) {
-        /* search for the maps region containing the string's start */
-        map_t *map = maps_find(task->maps, low, low);
-        if (map == NULL) return -1;
-        if (!(MAP_USER & map->perms)) return -1;
-
-        /* coverage = number of bytes covered by current maps region */
-        uint32_t coverage = map->high - low + 1;
-        char *check = (char *)low;
-        int i;
-        for (i = 0; i < coverage; i++) {
-            len++;
-            if (len > max_len)
-                // no null terminator was found
-                return 0;
-            else if (*check == '\0')
-                return len;
-            check++;
-        }
-
-        /* 
-         * we are still under max_len but the string did not terminate, so
-         * increment its starting address and continue searching
-         */
-        low += coverage;
+int reserve_kernel_maps(map_list_t *maps) {
+    int ret = 0;
+    ret += maps_insert(maps, 0, PAGE_SIZE * NUM_KERN_PAGES - 1, 0);
+    uint32_t direct_map_low = get_direct_map_low();
+    if (direct_map_low != 0) {
+        ret += maps_insert(maps, direct_map_low, DIRECT_MAP_HIGH - 1, 0);
     }
-
-    return 0;
+    ret += maps_insert(maps, KMAP_REGION_LOW, 0xFFFFFFFF, 0);
+    return ret < 0 ? -1 : 0;
 }
 
 /**
- * Load program to the memory, and we assumes cr3 is already set.
+ * Sets up the memory regions of a program. Nothing is copied here: each
+ * section is recorded in the task's maps, backed by the program image, and
+ * its pages are filled in by demand_fault() when they are first touched.
+ * Frames for all of them are reserved up front, so that faults cannot fail.
  * @param  header structures that store program data
- * @param  maps   memory map
+ * @param  task   task control block pointer, whose maps must hold no user
+ *                regions
  * @return        0 as success, -1 as failure
  */
-int load_program(simple_elf_t *header, map_list_t *maps) {
-    int flags;
+int load_program(simple_elf_t *header, task_t *task) {
+    int file_len;
+    const char *file = get_file_bytes(header->e_fname, &file_len);
+    if (file == NULL) return -1;
+
     int ret = 0;
-    uint32_t high;
 
     /* load text */
-    ret = load_elf_section(header->e_fname,
-                           header->e_txtstart,
-                           header->e_txtlen,
-                           header->e_txtoff,
-                           PTE_USER | PTE_PRESENT);
-    if (ret < 0) return -1;
-
-    high = header->e_txtstart + (header->e_txtlen - 1);
-    flags = MAP_USER | MAP_EXECUTE;
-    ret = maps_insert(maps, header->e_txtstart, high, flags);
+    ret = map_elf_section(task, file, file_len,
+                          header->e_txtstart,
+                          header->e_txtlen,
+                          header->e_txtoff,
+                          MAP_USER | MAP_EXECUTE);
     if (ret < 0) return -1;
 
     /* load dat */
-    ret = load_elf_section(header->e_fname,
-                           header->e_datstart,
-                           header->e_datlen,
-                           header->e_datoff,
-                           PTE_USER | PTE_WRITE | PTE_PRESENT);
+    ret = map_elf_section(task, file, file_len,
+                          header->e_datstart,
+                          header->e_datlen,
+                          header->e_datoff,
+                          MAP_USER | MAP_WRITE);
     if (ret < 0) return -1;
 
-    if (header->e_datlen > 0) {
-        high = header->e_datstart + (header->e_datlen - 1);
-        flags = MAP_USER | MAP_WRITE;
-        ret = maps_insert(maps, header->e_datstart, high, flags);
-        if (ret < 0) return -1;
-    }
-
     /* load rodat */
-    ret = load_elf_section(header->e_fname,
-                           header->e_rodatstart,
-                           header->e_rodatlen,
-                           header->e_rodatoff,
-                           PTE_USER | PTE_PRESENT);
+    ret = map_elf_section(task, file, file_len,
+                          header->e_rodatstart,
+                          header->e_rodatlen,
+                          header->e_rodatoff,
+                          MAP_USER);
     if (ret < 0) return -1;
 
-    if (header->e_rodatlen > 0) {
-        high = header->e_rodatstart + (header->e_rodatlen - 1);
-        flags = MAP_USER;
-        ret = maps_insert(maps, header->e_rodatstart, high, flags);
-        if (ret < 0) return -1;
-    }
-
     /* load bss */
-    ret = load_elf_section(header->e_fname,
-                           header->e_bssstart,
-                           header->e_bsslen,
-                           -1,
-                           PTE_USER | PTE_WRITE | PTE_PRESENT);
+    ret = map_elf_section(task, file, file_len,
+                          header->e_bssstart,
+                          header->e_bsslen,
+                          -1,
+                          MAP_USER | MAP_WRITE);
     if (ret < 0) return -1;
 
-    if (header->e_bsslen > 0) {
-        high = header->e_bssstart + (header->e_bsslen - 1);
-        flags = MAP_USER | MAP_WRITE;
-        ret = maps_insert(maps, header->e_bssstart, high, flags);
-        if (ret < 0) return -1;
-    }
-
     /* load user stack */
-    ret = load_elf_section(header->e_fname,
-                           USER_STACK_LOW,
-                           USER_STACK_SIZE,
-                           -1,
-                           PTE_USER | PTE_WRITE | PTE_PRESENT);
-    if (ret < 0) return -1;
-
-    high = USER_STACK_LOW + (USER_STACK_SIZE - 1);
-    flags = MAP_USER | MAP_WRITE;
-    ret = maps_insert(maps, USER_STACK_LOW, high, flags);
+    ret = map_elf_section(task, file, file_len,
+                          USER_STACK_LOW,
+                          USER_STACK_SIZE,
+                          -1,
+                          MAP_USER | MAP_WRITE);
     if (ret < 0) return -1;
 
     return 0;
 }
 
 /**
- * Load each program region to memory
- * @param  fname     file name
+ * Records a program region in the task's maps and reserves a frame for each
+ * of its pages that no previously mapped region shares.
+ * @param  task      task control block pointer
+ * @param  file      the program image
+ * @param  file_len  the length of the program image
  * @param  start     where the data region should start
  * @param  len       the length of data region
- * @param  offset    offset of each region
- * @param  pte_flags the flag of page table entry
+ * @param  offset    offset of the region in the image, -1 for bss and stack
+ * @param  perms     permissions of the region, as defined in maps.h
  * @return           0 as success, -1 as failure
  */
-int load_elf_section(const char *fname, unsigned long start, unsigned long len,
-                     long offset, int pte_flags) {
+static int map_elf_section(task_t *task, const char *file, int file_len,
+                           unsigned long start, unsigned long len,
+                           long offset, int perms) {
+    if (len == 0) return 0;
+
     uint32_t low = (uint32_t)start & PAGE_ALIGN_MASK;
-    uint32_t high = (uint32_t)(start + len);
+    uint32_t high = (uint32_t)start + (len - 1);
+    if (high < low) return -1;
 
-    uint32_t addr = low;
-    /**
-     * keep mapping physical frames to page table until entire program can be
-     * loaded into memory
-     */
-    while (addr < high) {
-        if (!(get_pte(addr) & PTE_PRESENT)) {
-            if (dec_num_free_frames(1) < 0) {
-                // freeing resources is deferred to caller
-                return -1;
-            }
-            uint32_t frame_addr = get_frame();
-            if (set_pte(addr, frame_addr, pte_flags) < 0) {
-                // freeing resources is deferred to caller
-                return -1;
-            }
+    const char *bytes = NULL;
+    if (offset != -1) {
+        if (offset < 0 || offset + len > (unsigned long)file_len) return -1;
+        bytes = file + offset;
+    }
+
+    /* pages shared with an earlier section are already reserved */
+    uint32_t addr;
+    int num_new = 0;
+    for (addr = low; addr - low <= high - low; addr += PAGE_SIZE) {
+        if (maps_find(task->maps, addr, addr + (PAGE_SIZE - 1)) == NULL) {
+            num_new++;
         }
-        addr += PAGE_SIZE;
     }
 
-    /**
-     * offset -1 indicates bss or stack sections
-     */
-    if (offset != -1) {
-        getbytes(fname, offset, len, (char *)start);
+    if (dec_num_free_frames(num_new) < 0) return -1;
+    if (maps_insert_file(task->maps, start, high, perms,
+                         bytes, bytes == NULL ? 0 : len) < 0) {
+        inc_num_free_frames(num_new);
+        return -1;
+    }
+
+    kern_mutex_lock(&(task->vm_mutex));
+    task->pending_frames += num_new;
+    kern_mutex_unlock(&(task->vm_mutex));
+    return 0;
+}
+
+/**
+ * Handles a fault on a page that is not present. If the page lies in one of
+ * the current task's regions it is mapped, using up one of the task's
+ * pending reservations: see anon_fault() for regions from new_pages(), and
+ * file_fault() for program regions and files from map_file(). A page
+ * evicted to the swap store is brought back in instead. Untouched pages
+ * following the faulting one are mapped along with it, see fault_around().
+ * @param  addr   the faulting address
+ * @param  write  nonzero if the fault was caused by a write
+ * @return        0 if the page is now mapped, -1 if the access is invalid
+ */
+int demand_fault(uint32_t addr, int write) {
+    task_t *task = get_cur_tcb()->task;
+    uint32_t page = addr & PAGE_ALIGN_MASK;
+
+    /* new_pages() and remove_pages() change the maps under the vm_mutex */
+    kern_mutex_lock(&(task->vm_mutex));
+    map_t *map = maps_find(task->maps, addr, addr);
+    if (map == NULL || !(map->perms & MAP_USER) ||
+            (write && !(map->perms & MAP_WRITE))) {
+        kern_mutex_unlock(&(task->vm_mutex));
+        return -1;
+    }
+
+    /* another thread may have filled the page in while we waited */
+    uint32_t pte = get_pte(page);
+    if (pte & PTE_PRESENT) {
+        kern_mutex_unlock(&(task->vm_mutex));
+        return 0;
+    }
+
+    int ret;
+    int num_around = 0;
+    if (pte & PTE_SWAPPED) {
+        ret = swap_in_page(page);
+    } else {
+        ret = map_fault(task, map, page, write);
+        if (ret == 0) num_around = fault_around(task, map, page, write);
+    }
+    kern_mutex_unlock(&(task->vm_mutex));
+
+    if (ret == 0) vm_count_demand_fault(num_around);
+    return ret;
+}
+
+/**
+ * Maps the untouched pages following a demand faulted page in the same
+ * region, so that a walk over a region does not trap on every page. The
+ * window doubles while each fault lands on the page right after the last
+ * window, and goes back to FAULT_AROUND_PAGES otherwise. It stops early at
+ * the end of the region or at a page that is already mapped or swapped out.
+ * Must be called with the task's vm_mutex held.
+ * @param  task   task control block pointer
+ * @param  map    the region containing the page
+ * @param  page   user address of the faulting page, already mapped
+ * @param  write  nonzero if the fault was caused by a write
+ * @return        the number of pages mapped besides the faulting one
+ */
+static int fault_around(task_t *task, map_t *map, uint32_t page, int write) {
+    if (page == task->fault_next) {
+        task->fault_window *= 2;
+        if (task->fault_window > FAULT_AROUND_MAX_PAGES) {
+            task->fault_window = FAULT_AROUND_MAX_PAGES;
+        }
+    } else {
+        task->fault_window = FAULT_AROUND_PAGES;
+    }
+
+    int num_mapped = 0;
+    uint32_t next = page + PAGE_SIZE;
+    while (num_mapped + 1 < task->fault_window) {
+        /* only pages wholly inside the region, so no other region shares it */
+        if (next < page || next < map->low ||
+                next + (PAGE_SIZE - 1) > map->high) {
+            break;
+        }
+        if (get_pte(next) != 0) break;
+
+        if (map_fault(task, map, next, write) < 0) break;
+
+        num_mapped++;
+        next += PAGE_SIZE;
+    }
+
+    task->fault_next = next;
+    return num_mapped;
+}
+
+/**
+ * Maps an untouched page of a region, depending on what backs the region.
+ * Must be called with the task's vm_mutex held.
+ * @param  task   task control block pointer
+ * @param  map    the region containing the page
+ * @param  page   user address of the page
+ * @param  write  nonzero if the fault was caused by a write
+ * @return        0 as success, -1 as failure
+ */
+static int map_fault(task_t *task, map_t *map, uint32_t page, int write) {
+    /* regions from map_file() are removable but backed by a file */
+    if ((map->perms & MAP_REMOVE) && map->file_bytes == NULL) {
+        return anon_fault(task, map, page, write);
+    }
+    return file_fault(task, map, page);
+}
+
+/**
+ * Maps a page of a region from new_pages(). Reads map the shared zero frame,
+ * which is replaced on the first write. A write to a 4MB aligned block that
+ * lies wholly inside the region and has nothing mapped yet gets a large page
+ * if one is free. Must be called with the task's vm_mutex held.
+ * @param  task   task control block pointer
+ * @param  map    the region containing the page
+ * @param  page   user address of the page
+ * @param  write  nonzero if the fault was caused by a write
+ * @return        0 as success, -1 as failure
+ */
+static int anon_fault(task_t *task, map_t *map, uint32_t page, int write) {
+    uint32_t block = page & LARGE_PAGE_MASK;
+    if (write && block >= map->low &&
+            block + (LARGE_PAGE_SIZE - 1) <= map->high &&
+            map_large_page(block) == 0) {
+        /* nothing in the block was mapped, so all of it is still pending */
+        assert(task->pending_frames >= FRAMES_PER_LARGE_PAGE);
+        task->pending_frames -= FRAMES_PER_LARGE_PAGE;
+        return 0;
+    }
+
+    uint32_t frame;
+    int pte_flags = PTE_USER | PTE_PRESENT;
+    if (write) {
+        frame = get_frame();
+        pte_flags |= PTE_WRITE;
+    } else {
+        frame = get_zfod_frame();
+    }
+
+    if (set_pte(page, frame, pte_flags) < 0) {
+        put_frame(frame);
+        return -1;
+    }
+    assert(task->pending_frames > 0);
+    task->pending_frames--;
+    return 0;
+}
+
+/**
+ * Maps a page of a program region. A zeroed frame is filled in from the
+ * backing file image of every region sharing the page. Read-only file pages
+ * are shared with every other task running the same program, see
+ * shared_frame(). Must be called with the task's vm_mutex held.
+ * @param  task   task control block pointer
+ * @param  map    the region containing the page
+ * @param  page   user address of the page
+ * @return        0 as success, -1 as failure
+ */
+static int file_fault(task_t *task, map_t *map, uint32_t page) {
+    uint32_t page_high = page + (PAGE_SIZE - 1);
+
+    int pte_flags = PTE_USER | PTE_PRESENT;
+    fill_page(task->maps, NULL, page, page, page_high, &pte_flags);
+    int shared = !(pte_flags & PTE_WRITE) && map->file_bytes != NULL;
+    /* the image bytes the page starts with, which identify it in the cache */
+    const char *src = map->file_bytes + (page - map->low);
+
+    uint32_t frame = shared ? shared_frame(map, page) : 0;
+    if (frame == 0) {
+        frame = get_frame();
+        char *dest = kmap(frame);
+        fill_page(task->maps, dest, page, page, page_high, &pte_flags);
+        kunmap(dest);
+        if (shared) page_cache_put(src, page, frame);
     }
 
+    if (set_pte(page, frame, pte_flags) < 0) {
+        put_frame(frame);
+        return -1;
+    }
+    assert(task->pending_frames > 0);
+    task->pending_frames--;
     return 0;
 }
 
+/**
+ * Finds a frame that already holds a read-only file page. If the page lies
+ * entirely within the file bytes of its region, and those are page aligned
+ * in the kernel's copy of the image, the image itself is mapped. Otherwise
+ * the page cache is searched for a copy made by another task.
+ * @param  map   the region containing the page
+ * @param  page  user address of the page
+ * @return       physical address of the frame with a reference taken for the
+ *               caller, 0 if the page has to be filled in
+ */
+static uint32_t shared_frame(map_t *map, uint32_t page) {
+    const char *src = map->file_bytes + (page - map->low);
+
+    if (page >= map->low && page - map->low + PAGE_SIZE <= map->file_len &&
+            ((uint32_t)src & ~PAGE_ALIGN_MASK) == 0 &&
+            (uint32_t)src < PAGE_SIZE * NUM_KERN_PAGES) {
+        /* kernel memory is direct mapped, and its frames are not counted */
+        page_cache_count_direct();
+        return (uint32_t)src;
+    }
+
+    return page_cache_get(src, page);
+}
+
+/**
+ * Copies the file backed contents of every region overlapping [low, high]
+ * into a kernel mapping of a page. The page is writable if any of the
+ * regions are.
+ * @param maps      memory map list of the task
+ * @param dest      kernel address of the page contents, NULL to only work
+ *                  out the page table entry flags
+ * @param page      user address of the page
+ * @param low       start of the part of the page to fill
+ * @param high      end of the part of the page to fill (inclusive)
+ * @param pte_flags page table entry flags, updated with the write permission
+ */
+static void fill_page(map_list_t *maps, char *dest, uint32_t page,
+                      uint32_t low, uint32_t high, int *pte_flags) {
+    map_t *map = maps_find(maps, low, high);
+    if (map == NULL) return;
+
+    if (map->perms & MAP_WRITE) *pte_flags |= PTE_WRITE;
+
+    if (dest != NULL && map->file_bytes != NULL && map->file_len > 0) {
+        uint32_t start = (map->low > low) ? map->low : low;
+        uint32_t end = (map->high < high) ? map->high : high;
+        uint32_t file_end = map->low + (map->file_len - 1);
+        if (file_end < end) end = file_end;
+        if (start <= end) {
+            memcpy(dest + (start - page), map->file_bytes + (start - map->low),
+                   end - start + 1);
+        }
+    }
+
+    /* the page may be shared with the neighbouring regions */
+    if (low < map->low) {
+        fill_page(maps, dest, page, low, map->low - 1, pte_flags);
+    }
+    if (map->high < high) {
+        fill_page(maps, dest, page, map->high + 1, high, pte_flags);
+    }
+}
+
+/**
+ * Frees the user memory of a task: present pages and their reservations,
+ * and the reservations of pages that were never touched.
+ * @param task task control block pointer
+ */
+void task_vm_clear(task_t *task) {
+    kern_mutex_lock(&(task->vm_mutex));
+    page_dir_clear(task->page_dir);
+    inc_num_free_frames(task->pending_frames);
+    task->pending_frames = 0;
+    kern_mutex_unlock(&(task->vm_mutex));
+}
+
 /**
  * sends orphaned children to the init task
  * @param task control block pointer
@@ -576,11 +816,11 @@ void orphan_zombies(task_t *task) {
             wait_node_t *waiter = (wait_node_t *)node;
             waiter->zombie = LIST_NODE_TO_TASK(zombie_node);
 
-            // disable interrupts to protect the scheduler
-            disable_interrupts();
+            // lock the scheduler to protect its structures
+            sche_lock();
             waiter->thread->status = RUNNABLE;
             sche_push_back(waiter->thread);
-            enable_interrupts();
+            sche_unlock();
         } else {
             node_t *last_node = get_last_node(init_task->zombie_task_list);
             if (last_node != NULL) {
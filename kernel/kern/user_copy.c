@@ -0,0 +1,114 @@
+/**
+ * @file   user_copy.c
+ * @brief  Copies between kernel and user memory without looking the user
+ *         addresses up in the task's maps first. The copy simply touches
+ *         user memory: faults on untouched, swapped out or copy-on-write
+ *         pages are resolved as usual, and a fault on an invalid address
+ *         resumes at a fixup that makes the copy return -1. Only the range
+ *         is checked up front, so that no kernel memory is reached through a
+ *         user pointer.
+ *
+ *         These must be called with interrupts enabled and without holding
+ *         the task's vm_mutex, which the fault handler may need.
+ * @author Qiaoyu Deng (qdeng)
+ * @bug    No known bugs
+ */
+
+#include <stdlib.h>
+#include <syscall.h>             /* PAGE_SIZE */
+
+#include "user_copy.h"
+#include "vm.h"
+
+/* defined in asm_user_copy.S */
+int asm_copy_user(void *dest, const void *src, int len);
+int asm_strncpy_user(char *dest, const char *src, int max_len);
+extern const fixup_entry_t user_copy_fixups[];
+extern const int user_copy_num_fixups;
+
+static uint32_t user_limit(uint32_t addr);
+
+/**
+ * Finds where a user address range may be accessed up to.
+ * @param  addr user address
+ * @return      the end of the user memory addr lies in, 0 if addr is not
+ *              user memory
+ */
+static uint32_t user_limit(uint32_t addr) {
+    uint32_t direct_map_low = get_direct_map_low();
+
+    if (addr < PAGE_SIZE * NUM_KERN_PAGES) return 0;
+    if (addr >= KMAP_REGION_LOW) return 0;
+    if (direct_map_low == 0) return KMAP_REGION_LOW;
+    if (addr < direct_map_low) return direct_map_low;
+    if (addr < DIRECT_MAP_HIGH) return 0;
+    return KMAP_REGION_LOW;
+}
+
+/**
+ * Copies len bytes from user memory into the kernel.
+ * @param  dest kernel buffer
+ * @param  src  user address
+ * @param  len  number of bytes
+ * @return      0 as success, -1 if any of the bytes are not readable
+ */
+int copy_from_user(void *dest, const void *src, int len) {
+    if (len < 0) return -1;
+    if (len == 0) return 0;
+
+    uint32_t limit = user_limit((uint32_t)src);
+    if (limit == 0 || (uint32_t)len > limit - (uint32_t)src) return -1;
+    return asm_copy_user(dest, src, len);
+}
+
+/**
+ * Copies len bytes from the kernel into user memory.
+ * @param  dest user address
+ * @param  src  kernel buffer
+ * @param  len  number of bytes
+ * @return      0 as success, -1 if any of the bytes are not writable, in
+ *              which case some of them may have been written already
+ */
+int copy_to_user(void *dest, const void *src, int len) {
+    if (len < 0) return -1;
+    if (len == 0) return 0;
+
+    uint32_t limit = user_limit((uint32_t)dest);
+    if (limit == 0 || (uint32_t)len > limit - (uint32_t)dest) return -1;
+    return asm_copy_user(dest, src, len);
+}
+
+/**
+ * Copies a string from user memory into the kernel.
+ * @param  dest    kernel buffer of max_len bytes
+ * @param  src     user address of the string
+ * @param  max_len max length to copy, including the null terminator
+ * @return         negative if the string starts outside user memory or
+ *                 faults, 0 if it does not terminate in max_len bytes or
+ *                 before the end of user memory, length including the null
+ *                 terminator otherwise
+ */
+int strncpy_from_user(char *dest, const char *src, int max_len) {
+    if (max_len <= 0) return -1;
+
+    uint32_t limit = user_limit((uint32_t)src);
+    if (limit == 0) return -1;
+    if ((uint32_t)max_len > limit - (uint32_t)src) {
+        /* a string running into kernel memory never terminates */
+        max_len = limit - (uint32_t)src;
+    }
+    return asm_strncpy_user(dest, src, max_len);
+}
+
+/**
+ * Looks up the fixup for a kernel instruction that faulted.
+ * @param  eip address of the instruction
+ * @return     where to resume, 0 if the instruction must not fault
+ */
+uint32_t search_fixup(uint32_t eip) {
+    int i;
+    for (i = 0; i < user_copy_num_fixups; i++) {
+        if (user_copy_fixups[i].insn == eip) return user_copy_fixups[i].fixup;
+    }
+    return 0;
+}
@@ -11,12 +11,11 @@
  */
 #include <stdlib.h>
 #include <assert.h>            /* assert */
-#include <asm.h>               /* disable_interrupts, enable_interrupts */
 
 #include "utils/kern_cond.h"
 #include "utils/list.h"         /* list_t */
-#include "scheduler.h"          /* sche_yield */
-#include "utils/tcb_hashtab.h"  /* tcb_hashtab_get */
+#include "scheduler.h"          /* sche_yield, sche_lock */
+#include "utils/tcb_hashtab.h"  /* tcb_hashtab_get_locked */
 
 /* internal function */
 /**
@@ -80,13 +79,12 @@ void kern_cond_wait(kern_cond_t *cv, kern_mutex_t *mp) {
     add_node_to_tail(cv->wait_list, node);
     kern_mutex_unlock(mp);
     /**
-     * we need disable here because we need to ensure no one can make us
-     * before we get suspended
+     * we need lock the scheduler here because we need to ensure no one can
+     * make us runnable before we get suspended
      */
-    disable_interrupts();
-    kern_mutex_unlock(&cv->mutex);
+    sche_lock();
+    cli_kern_mutex_unlock(&cv->mutex);
     sche_yield(SUSPENDED);
-    enable_interrupts();
     kern_mutex_lock(mp);
 }
 
@@ -117,12 +115,18 @@ void kern_cond_signal(kern_cond_t *cv) {
  *             currently non-runnable due to a call to deschedule()
  */
 int kcond_make_runnable(int tid) {
-    thread_t *thr = tcb_hashtab_get(tid);
+    /* the bucket stays locked so the thread cannot be reaped meanwhile */
+    thread_t *thr = tcb_hashtab_get_locked(tid);
     if (thr == NULL) return -1;
-    if (thr->status != SUSPENDED) return -1;
-    disable_interrupts();
+    sche_lock();
+    if (thr->status != SUSPENDED) {
+        tcb_hashtab_cli_unlock(tid);
+        sche_unlock();
+        return -1;
+    }
+    tcb_hashtab_cli_unlock(tid);
     thr->status = RUNNABLE;
     sche_push_back(thr);
-    enable_interrupts();
+    sche_unlock();
     return 0;
 }
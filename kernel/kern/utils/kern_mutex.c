@@ -30,7 +30,7 @@ void kern_mutex_destroy(kern_mutex_t *mp) {
 void kern_mutex_lock(kern_mutex_t *mp) {
     thread_t *cur_thread = get_cur_tcb();
 
-    disable_interrupts();
+    sche_lock();
     if (mp->is_locked == 1) {
         thread_t *kmutex_holder = (thread_t *)mp->mutex_holder;
         if (kmutex_holder->status == RUNNABLE)
@@ -40,12 +40,12 @@ void kern_mutex_lock(kern_mutex_t *mp) {
     } else {
         mp->is_locked = 1;
         mp->mutex_holder = (void *)get_cur_tcb();
-        enable_interrupts();
+        sche_unlock();
     }
 }
 
 void kern_mutex_unlock(kern_mutex_t *mp) {
-    disable_interrupts();
+    sche_lock();
 
     sche_node_t *new_sche_node = pop_first_node(mp->blocked_list);
     if (new_sche_node == NULL) {
@@ -58,9 +58,10 @@ void kern_mutex_unlock(kern_mutex_t *mp) {
         sche_push_back(new_thread);
     }
 
-    enable_interrupts();
+    sche_unlock();
 }
 
+/* the scheduler must be locked */
 void cli_kern_mutex_unlock(kern_mutex_t *mp) {
     sche_node_t *new_sche_node = pop_first_node(mp->blocked_list);
     if (new_sche_node == NULL) {
@@ -39,3 +39,24 @@ int getbytes( const char *filename, int offset, int size, char *buf ) {
 }
 
 /*@}*/
+
+/**
+ * Finds the in-memory image of a file, so that its contents can be mapped
+ * or copied without going through getbytes().
+ *
+ * @param filename   the name of the file to look up
+ * @param len        set to the length of the file in bytes
+ *
+ * @return a pointer to the first byte of the file; NULL if it does not exist
+ */
+const char *get_file_bytes( const char *filename, int *len ) {
+    int i;
+    for (i = 0; i < MAX_NUM_APP_ENTRIES; i++) {
+        const exec2obj_userapp_TOC_entry *entry = &exec2obj_userapp_TOC[i];
+        if (!strcmp(filename, entry->execname)) {
+            *len = entry->execlen;
+            return entry->execbytes;
+        }
+    }
+    return NULL;
+}
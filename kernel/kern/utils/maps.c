@@ -3,92 +3,314 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <simics.h>
 #include <assert.h>
 #include "utils/maps.h"
 #include "utils/maps_internal.h"
+#include "utils/spinlock.h"
 
 #define MAP_LOW(node) (node->map.low)
 #define MAP_HIGH(node) (node->map.high)
 #define MAP_PERMS(node) (node->map.perms)
+#define MAP_FILE_BYTES(node) (node->map.file_bytes)
+#define MAP_FILE_LEN(node) (node->map.file_len)
+
+/* keeps the compiler from moving tree accesses across seq accesses */
+#define compiler_barrier() __asm__ __volatile__("" ::: "memory")
+
+/* nodes copied per tree level by one change, at most */
+#define NODES_PER_LEVEL 3
+
+/* nodes no longer in any tree, never given back to malloc() */
+static map_node_t *free_nodes = NULL;
+/* protects free_nodes and the reference counts of all nodes */
+static spinlock_t nodes_lock = { 0, -1, 0 };
+
+/**
+ * Takes a reference to a node, which may be shared with other map lists.
+ * @param node the node
+ */
+static void node_get(map_node_t *node) {
+    spin_lock(&nodes_lock);
+    node->refs++;
+    spin_unlock(&nodes_lock);
+}
+
+/**
+ * Drops a reference to a node, which may be shared with other map lists.
+ * @param  node the node
+ * @return      the number of references left
+ */
+static int node_put(map_node_t *node) {
+    spin_lock(&nodes_lock);
+    int refs = --node->refs;
+    spin_unlock(&nodes_lock);
+    return refs;
+}
 
 map_list_t *maps_init() {
     map_list_t *maps = malloc(sizeof(map_list_t));
     if (maps == NULL) return NULL;
+    memset(maps, 0, sizeof(map_list_t));
 
     int ret = kern_mutex_init(&(maps->mutex));
     if (ret < 0) {
         free(maps);
         return NULL;
     }
-    
+    spin_init(&(maps->cache_lock));
+
     maps->root = NULL;
     return maps;
 }
 
 void maps_destroy(map_list_t *maps) {
     tree_destroy(maps->root);
+    while (maps->spare_nodes != NULL) {
+        map_node_t *node = maps->spare_nodes;
+        maps->spare_nodes = node->left;
+        tree_node_release(node);
+    }
     kern_mutex_destroy(&(maps->mutex));
     free(maps);
 }
 
+/**
+ * Starts a change to the tree, which lockless lookups will notice. Must be
+ * called with the list's mutex held.
+ * @param maps the map list
+ */
+static void maps_write_begin(map_list_t *maps) {
+    maps->seq++;
+    compiler_barrier();
+}
+
+/**
+ * Ends a change to the tree started by maps_write_begin().
+ * @param maps the map list
+ */
+static void maps_write_end(map_list_t *maps) {
+    compiler_barrier();
+    maps->seq++;
+}
+
 void maps_clear(map_list_t *maps) {
     kern_mutex_lock(&(maps->mutex));
+    maps_write_begin(maps);
     tree_destroy(maps->root);
     maps->root = NULL;
+    maps_write_end(maps);
     kern_mutex_unlock(&(maps->mutex));
 }
 
+/**
+ * Checks whether a new anonymous region may be merged with a neighbour.
+ * @param  node  the neighbour
+ * @param  perms the perms of the new region
+ * @return       nonzero if they can become one region
+ */
+static int maps_can_merge(map_node_t *node, int perms) {
+    return MAP_FILE_BYTES(node) == NULL &&
+           (MAP_PERMS(node) & ~MAP_MERGE) == (perms & ~MAP_MERGE);
+}
+
 int maps_insert(map_list_t *maps, uint32_t low, uint32_t high, int perms) {
+    return maps_insert_file(maps, low, high, perms, NULL, 0);
+}
+
+int maps_insert_file(map_list_t *maps, uint32_t low, uint32_t high, int perms,
+                     const char *file_bytes, uint32_t file_len) {
     kern_mutex_lock(&(maps->mutex));
 
-    map_node_t *node = tree_node(low, high, perms);
-    if (node == NULL) {
+    /* merging deletes up to two neighbours before the insert */
+    if (tree_reserve(maps, 3) < 0) {
         kern_mutex_unlock(&(maps->mutex));
         return -1;
     }
-    maps->root = tree_insert(maps->root, node);
+
+    map_node_t *prev = NULL;
+    map_node_t *next = NULL;
+    if ((perms & MAP_MERGE) && file_bytes == NULL) {
+        if (low != 0) prev = tree_find(maps->root, low - 1, low - 1);
+        if (prev != NULL && !maps_can_merge(prev, perms)) prev = NULL;
+        if (high != 0xFFFFFFFF) {
+            next = tree_find(maps->root, high + 1, high + 1);
+        }
+        if (next != NULL && (!(MAP_PERMS(next) & MAP_MERGE) ||
+                             !maps_can_merge(next, perms))) {
+            next = NULL;
+        }
+    }
+
+    maps_write_begin(maps);
+    if (prev != NULL) {
+        /* the region below keeps its start and its own perms */
+        low = MAP_LOW(prev);
+        perms = MAP_PERMS(prev);
+        maps->root = tree_delete(maps, maps->root, low);
+    }
+    if (next != NULL) {
+        uint32_t next_low = MAP_LOW(next);
+        high = MAP_HIGH(next);
+        maps->root = tree_delete(maps, maps->root, next_low);
+    }
+    map_node_t *node = tree_node(maps, low, high, perms);
+    MAP_FILE_BYTES(node) = file_bytes;
+    MAP_FILE_LEN(node) = file_len;
+    maps->root = tree_insert(maps, maps->root, node);
+    maps_write_end(maps);
 
     kern_mutex_unlock(&(maps->mutex));
     return 0;
 }
 
+/**
+ * Looks a region up in the list's cache of recently found regions.
+ * @param  maps the map list
+ * @param  seq  the sequence number the lookup started at
+ * @param  low  the start of the search region
+ * @param  high the end of the search region (inclusive)
+ * @return      a cached node containing the search region, NULL if none
+ */
+static map_node_t *maps_cache_find(map_list_t *maps, unsigned int seq,
+                                   uint32_t low, uint32_t high) {
+    map_node_t *found = NULL;
+    int i;
+
+    /* threads of the task share the cache */
+    spin_lock(&(maps->cache_lock));
+    for (i = 0; i < MAPS_CACHE_SIZE; i++) {
+        map_cache_entry_t *entry = &(maps->cache[i]);
+        if (entry->seq == seq && entry->node != NULL &&
+                MAP_LOW(entry->node) <= low && high <= MAP_HIGH(entry->node)) {
+            found = entry->node;
+            break;
+        }
+    }
+    spin_unlock(&(maps->cache_lock));
+    return found;
+}
+
+/**
+ * Remembers a node found by a lookup that saw no changes to the tree.
+ * @param maps the map list
+ * @param seq  the sequence number the lookup started at
+ * @param node the node found
+ */
+static void maps_cache_put(map_list_t *maps, unsigned int seq,
+                           map_node_t *node) {
+    spin_lock(&(maps->cache_lock));
+    map_cache_entry_t *entry = &(maps->cache[maps->cache_next]);
+    entry->seq = seq;
+    entry->node = node;
+    maps->cache_next = (maps->cache_next + 1) % MAPS_CACHE_SIZE;
+    spin_unlock(&(maps->cache_lock));
+}
+
 map_t *maps_find(map_list_t *maps, uint32_t low, uint32_t high) {
-    kern_mutex_lock(&(maps->mutex));
+    while (1) {
+        unsigned int seq = maps->seq;
+        if (seq & 1) {
+            /* wait for the change in progress to finish */
+            kern_mutex_lock(&(maps->mutex));
+            kern_mutex_unlock(&(maps->mutex));
+            continue;
+        }
+        compiler_barrier();
 
-    map_node_t *node = tree_find(maps->root, low, high);
-    if (node == NULL) {
-        kern_mutex_unlock(&(maps->mutex));
-        return NULL;
+        map_node_t *node = maps_cache_find(maps, seq, low, high);
+        if (node != NULL) {
+            maps->cache_hits++;
+            return &(node->map);
+        }
+
+        node = tree_find(maps->root, low, high);
+        compiler_barrier();
+        if (maps->seq != seq) continue;
+
+        maps->cache_misses++;
+        if (node == NULL) return NULL;
+        maps_cache_put(maps, seq, node);
+        return &(node->map);
     }
+}
 
+int maps_delete(map_list_t *maps, uint32_t low) {
+    kern_mutex_lock(&(maps->mutex));
+    if (tree_reserve(maps, 1) < 0) {
+        kern_mutex_unlock(&(maps->mutex));
+        return -1;
+    }
+    maps_write_begin(maps);
+    maps->root = tree_delete(maps, maps->root, low);
+    maps_write_end(maps);
     kern_mutex_unlock(&(maps->mutex));
-    return &(node->map);
+    return 0;
 }
 
-void maps_delete(map_list_t *maps, uint32_t low) {
+int maps_delete_range(map_list_t *maps, uint32_t low, uint32_t high) {
     kern_mutex_lock(&(maps->mutex));
-    tree_delete(maps->root, low);
+
+    map_node_t *node = tree_find(maps->root, low, high);
+    if (node == NULL || low < MAP_LOW(node) || MAP_HIGH(node) < high) {
+        kern_mutex_unlock(&(maps->mutex));
+        return -1;
+    }
+    /* the node may be reused by the delete */
+    map_t old = node->map;
+
+    /* the delete and the inserts of the two pieces left */
+    if (tree_reserve(maps, 3) < 0) {
+        kern_mutex_unlock(&(maps->mutex));
+        return -1;
+    }
+
+    maps_write_begin(maps);
+    maps->root = tree_delete(maps, maps->root, old.low);
+    if (old.low < low) {
+        node = tree_node(maps, old.low, low - 1, old.perms);
+        MAP_FILE_BYTES(node) = old.file_bytes;
+        MAP_FILE_LEN(node) = min(old.file_len, low - old.low);
+        maps->root = tree_insert(maps, maps->root, node);
+    }
+    if (high < old.high) {
+        /* the piece above starts further into the file */
+        uint32_t skip = min(old.file_len, high + 1 - old.low);
+        node = tree_node(maps, high + 1, old.high, old.perms);
+        if (old.file_bytes != NULL) {
+            MAP_FILE_BYTES(node) = old.file_bytes + skip;
+            MAP_FILE_LEN(node) = old.file_len - skip;
+        }
+        maps->root = tree_insert(maps, maps->root, node);
+    }
+    maps_write_end(maps);
+
     kern_mutex_unlock(&(maps->mutex));
+    return 0;
 }
 
 int maps_copy(map_list_t *from, map_list_t *to) {
     kern_mutex_lock(&(from->mutex));
     kern_mutex_lock(&(to->mutex));
 
-    map_node_t *copy = tree_copy(from->root);
-    if (copy == NULL && from->root != NULL) {
-        kern_mutex_unlock(&(to->mutex));
-        kern_mutex_unlock(&(from->mutex));
-        return -1;
-    }
-    to->root = copy;
+    assert(to->root == NULL);
+    if (from->root != NULL) node_get(from->root);
+    maps_write_begin(to);
+    to->root = from->root;
+    maps_write_end(to);
 
     kern_mutex_unlock(&(to->mutex));
     kern_mutex_unlock(&(from->mutex));
     return 0;
 }
 
+void maps_get_cache_stats(map_list_t *maps, unsigned int *hits,
+                          unsigned int *misses) {
+    *hits = maps->cache_hits;
+    *misses = maps->cache_misses;
+}
+
 void maps_print(map_list_t *maps) {
     kern_mutex_lock(&(maps->mutex));
     tree_print(maps->root);
@@ -99,6 +321,10 @@ int max(int a, int b) {
     return (a > b) ? a : b;
 }
 
+uint32_t min(uint32_t a, uint32_t b) {
+    return (a < b) ? a : b;
+}
+
 int get_height(map_node_t *node) {
     if (node == NULL) return 0;
     return node->height;
@@ -125,9 +351,13 @@ void copy_map(map_node_t *from, map_node_t *to) {
     MAP_LOW(to) = MAP_LOW(from);
     MAP_HIGH(to) = MAP_HIGH(from);
     MAP_PERMS(to) = MAP_PERMS(from);
+    MAP_FILE_BYTES(to) = MAP_FILE_BYTES(from);
+    MAP_FILE_LEN(to) = MAP_FILE_LEN(from);
 }
 
-map_node_t *rotate_right(map_node_t *old_root) {
+map_node_t *rotate_right(map_list_t *maps, map_node_t *old_root) {
+    old_root = tree_private(maps, old_root);
+    old_root->left = tree_private(maps, old_root->left);
     map_node_t *new_root = old_root->left;
     map_node_t *new_left = new_root->right;
 
@@ -138,7 +368,9 @@ map_node_t *rotate_right(map_node_t *old_root) {
     return new_root;
 }
 
-map_node_t *rotate_left(map_node_t *old_root) {
+map_node_t *rotate_left(map_list_t *maps, map_node_t *old_root) {
+    old_root = tree_private(maps, old_root);
+    old_root->right = tree_private(maps, old_root->right);
     map_node_t *new_root = old_root->right;
     map_node_t *new_right = new_root->left;
 
@@ -149,35 +381,95 @@ map_node_t *rotate_left(map_node_t *old_root) {
     return new_root;
 }
 
-map_node_t *tree_node(uint32_t low, uint32_t high, int perms) {
-    map_node_t *node = malloc(sizeof(map_node_t));
+map_node_t *tree_node(map_list_t *maps, uint32_t low, uint32_t high,
+                      int perms) {
+    map_node_t *node = maps->spare_nodes;
+    if (node != NULL) {
+        maps->spare_nodes = node->left;
+        maps->num_spare_nodes--;
+    } else {
+        node = malloc(sizeof(map_node_t));
+    }
     if (node == NULL) return NULL;
 
     MAP_LOW(node) = low;
     MAP_HIGH(node) = high;
     MAP_PERMS(node) = perms;
+    MAP_FILE_BYTES(node) = NULL;
+    MAP_FILE_LEN(node) = 0;
 
     node->left = node->right = NULL;
     node->height = 1;
+    node->refs = 1;
     return node;
 }
 
+void tree_node_release(map_node_t *node) {
+    /* a lockless lookup may still be looking at the node */
+    spin_lock(&nodes_lock);
+    node->left = free_nodes;
+    node->right = NULL;
+    free_nodes = node;
+    spin_unlock(&nodes_lock);
+}
+
+int tree_reserve(map_list_t *maps, int num_changes) {
+    /* an insert can add a level, and needs its new node too */
+    int height = get_height(maps->root) + num_changes;
+    int needed = num_changes * (NODES_PER_LEVEL * height + 1);
+
+    while (maps->num_spare_nodes < needed) {
+        spin_lock(&nodes_lock);
+        map_node_t *node = free_nodes;
+        if (node != NULL) free_nodes = node->left;
+        spin_unlock(&nodes_lock);
+
+        if (node == NULL) node = malloc(sizeof(map_node_t));
+        if (node == NULL) return -1;
+        node->left = maps->spare_nodes;
+        maps->spare_nodes = node;
+        maps->num_spare_nodes++;
+    }
+    return 0;
+}
+
+map_node_t *tree_private(map_list_t *maps, map_node_t *tree) {
+    if (tree->refs == 1) return tree;
+
+    map_node_t *copy = tree_node(maps, MAP_LOW(tree), MAP_HIGH(tree),
+                                 MAP_PERMS(tree));
+    /* tree_reserve() set aside enough nodes */
+    assert(copy != NULL);
+    copy_map(tree, copy);
+    copy->height = tree->height;
+    copy->left = tree->left;
+    copy->right = tree->right;
+    if (copy->left != NULL) node_get(copy->left);
+    if (copy->right != NULL) node_get(copy->right);
+
+    /* the other lists may have dropped theirs meanwhile */
+    tree_destroy(tree);
+    return copy;
+}
+
 void tree_destroy(map_node_t *tree) {
     if (tree == NULL) return;
+    if (node_put(tree) > 0) return;
     tree_destroy(tree->left);
     tree_destroy(tree->right);
-    free(tree);
+    tree_node_release(tree);
 }
 
-map_node_t *tree_insert(map_node_t *tree, map_node_t *node) {
+map_node_t *tree_insert(map_list_t *maps, map_node_t *tree, map_node_t *node) {
     if (tree == NULL) return node;
 
+    tree = tree_private(maps, tree);
     if (MAP_LOW(node) < MAP_LOW(tree)) {
         assert(MAP_HIGH(node) < MAP_LOW(tree));
-        tree->left = tree_insert(tree->left, node);
+        tree->left = tree_insert(maps, tree->left, node);
     } else {
         assert(MAP_HIGH(tree) < MAP_LOW(node));
-        tree->right = tree_insert(tree->right, node);
+        tree->right = tree_insert(maps, tree->right, node);
     }
 
     update_height(tree);
@@ -185,55 +477,54 @@ map_node_t *tree_insert(map_node_t *tree, map_node_t *node) {
 
     if (balance > 1) {
         if (get_balance(tree->right) < 0) {
-            tree->right = rotate_right(tree->right);
+            tree->right = rotate_right(maps, tree->right);
         }
-        return rotate_left(tree);
+        return rotate_left(maps, tree);
     }
 
     if (balance < -1) {
         if (get_balance(tree->left) > 0) {
-            tree->left = rotate_left(tree->left);
+            tree->left = rotate_left(maps, tree->left);
         }
-        return rotate_right(tree);
+        return rotate_right(maps, tree);
     }
 
     return tree;
 }
 
 map_node_t *tree_find(map_node_t *tree, uint32_t low, uint32_t high) {
-    if (tree == NULL) return NULL;
-
-    if (high < MAP_LOW(tree)) {
-        return tree_find(tree->left, low, high);
-    } else if (MAP_HIGH(tree) < low) {
-        return tree_find(tree->right, low, high);
+    int depth;
+    for (depth = 0; tree != NULL && depth < MAPS_MAX_DEPTH; depth++) {
+        if (high < MAP_LOW(tree)) tree = tree->left;
+        else if (MAP_HIGH(tree) < low) tree = tree->right;
+        else return tree;
     }
-
-    return tree;
+    return NULL;
 }
 
-map_node_t *tree_delete(map_node_t *tree, uint32_t low) {
+map_node_t *tree_delete(map_list_t *maps, map_node_t *tree, uint32_t low) {
+    tree = tree_private(maps, tree);
     if (MAP_LOW(tree) < low) {
-        tree->right = tree_delete(tree->right, low);
+        tree->right = tree_delete(maps, tree->right, low);
     } else if (low < MAP_LOW(tree)) {
-        tree->left = tree_delete(tree->left, low);
+        tree->left = tree_delete(maps, tree->left, low);
     } else {
         assert(MAP_LOW(tree) == low);
         map_node_t *temp;
         if (tree->left == NULL && tree->right == NULL) {
-            free(tree);
+            tree_node_release(tree);
             return NULL;
         } else if (tree->left == NULL) {
             temp = tree->right;
-            free(tree);
+            tree_node_release(tree);
             return temp;
         } else if (tree->right == NULL) {
             temp = tree->left;
-            free(tree);
+            tree_node_release(tree);
             return temp;
         } else {
             copy_map(smallest_node(tree->right), tree);
-            tree->right = tree_delete(tree->right, MAP_LOW(tree));
+            tree->right = tree_delete(maps, tree->right, MAP_LOW(tree));
         }
     }
 
@@ -242,45 +533,21 @@ map_node_t *tree_delete(map_node_t *tree, uint32_t low) {
 
     if (balance > 1) {
         if (get_balance(tree->right) < 0) {
-            tree->right = rotate_right(tree->right);
+            tree->right = rotate_right(maps, tree->right);
         }
-        return rotate_left(tree);
+        return rotate_left(maps, tree);
     }
 
     if (balance < -1) {
         if (get_balance(tree->left) > 0) {
-            tree->left = rotate_left(tree->left);
+            tree->left = rotate_left(maps, tree->left);
         }
-        return rotate_right(tree);
+        return rotate_right(maps, tree);
     }
 
     return tree;
 }
 
-map_node_t *tree_copy(map_node_t *tree) {
-    if (tree == NULL) return NULL;
-
-    map_node_t *copy = malloc(sizeof(map_node_t));
-    if (copy == NULL) return NULL;
-    copy_map(tree, copy);
-    copy->height = tree->height;
-
-    copy->left = tree_copy(tree->left);
-    if (copy->left == NULL && tree->left != NULL) {
-        free(copy);
-        return NULL;
-    }
-
-    copy->right = tree_copy(tree->right);
-    if (copy->right == NULL && tree->right != NULL) {
-        tree_destroy(copy->left);
-        free(copy);
-        return NULL;
-    }
-
-    return copy;
-}
-
 void tree_print(map_node_t *tree) {
     if (tree == NULL) return;
     tree_print(tree->left);
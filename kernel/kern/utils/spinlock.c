@@ -0,0 +1,78 @@
+/** @file spinlock.c
+ *  @brief Implements spinlocks.
+ *
+ *  The lock word is taken with an atomic xchg. A CPU that finds the lock
+ *  held waits with plain reads, which stay in its own cache, and only tries
+ *  the xchg again once the lock looks free.
+ *
+ *  @author Qiaoyu Deng (qdeng)
+ *  @bug none known
+ */
+
+#include <assert.h>
+#include <x86/asm.h>                /* disable_interrupts enable_interrupts */
+#include <x86/eflags.h>             /* get_eflags, EFL_IF */
+#include <smp/smp.h>                /* smp_get_cpu */
+
+#include "utils/spinlock.h"
+
+/**
+ * Atomically swaps a value into memory.
+ * @param  ptr the word
+ * @param  val the new value
+ * @return     the old value
+ */
+static int xchg(volatile int *ptr, int val) {
+    __asm__ __volatile__("xchgl %0, %1"
+                         : "+r"(val), "+m"(*ptr)
+                         :
+                         : "memory");
+    return val;
+}
+
+void spin_init(spinlock_t *lock) {
+    lock->locked = 0;
+    lock->cpu = -1;
+    lock->eflags = 0;
+}
+
+/**
+ * Takes a lock, spinning until it is free. Interrupts stay disabled until
+ * the lock is released. A CPU must not take a lock it already holds.
+ * @param lock the lock
+ */
+void spin_lock(spinlock_t *lock) {
+    uint32_t eflags = get_eflags();
+    disable_interrupts();
+    assert(!spin_held(lock));
+
+    while (xchg(&lock->locked, 1) != 0) {
+        while (lock->locked) __asm__ __volatile__("pause");
+    }
+    lock->cpu = smp_get_cpu();
+    lock->eflags = eflags;
+}
+
+/**
+ * Releases a lock, and enables interrupts again if they were enabled when
+ * it was taken.
+ * @param lock the lock, held by this CPU
+ */
+void spin_unlock(spinlock_t *lock) {
+    assert(spin_held(lock));
+    uint32_t eflags = lock->eflags;
+    lock->cpu = -1;
+    xchg(&lock->locked, 0);
+
+    if (eflags & EFL_IF) enable_interrupts();
+}
+
+/**
+ * Checks whether this CPU holds a lock. Only a CPU running with interrupts
+ * disabled can hold one, so the answer cannot change under the caller.
+ * @param  lock the lock
+ * @return      1 if this CPU holds the lock, 0 otherwise
+ */
+int spin_held(spinlock_t *lock) {
+    return lock->locked && lock->cpu == smp_get_cpu();
+}
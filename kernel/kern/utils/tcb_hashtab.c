@@ -71,6 +71,40 @@ thread_t *tcb_hashtab_get(int tid) {
     return NULL;
 }
 
+/**
+ * @brief      Get tcb according to its tid, keeping its bucket locked so the
+ *             thread cannot be removed and freed until the caller is done.
+ *             The bucket must be released by tcb_hashtab_cli_unlock() with
+ *             the scheduler locked.
+ * @param  tid thread's tid
+ * @return     pointer to tcb when find it in table, NULL when cannot find it,
+ *             in which case the bucket is not locked
+ */
+thread_t *tcb_hashtab_get_locked(int tid) {
+    int idx = tid % HASH_LEN;
+    list_t *obj_list = tcb_hashtab.tcb_list[idx];
+    kern_mutex_t *obj_mutex = &(tcb_hashtab.mutex[idx]);
+
+    kern_mutex_lock(obj_mutex);
+    tcb_tb_node_t *node_rover = get_first_node(obj_list);
+    while (node_rover != NULL) {
+        thread_t *thr_rover = TABLE_NODE_TO_TCB(node_rover);
+        if (thr_rover->tid == tid) return thr_rover;
+        node_rover = get_next_node(obj_list, node_rover);
+    }
+    kern_mutex_unlock(obj_mutex);
+    return NULL;
+}
+
+/**
+ * @brief     Release the bucket locked by tcb_hashtab_get_locked(). Must be
+ *            called with the scheduler locked.
+ * @param tid tid the bucket was locked for
+ */
+void tcb_hashtab_cli_unlock(int tid) {
+    cli_kern_mutex_unlock(&(tcb_hashtab.mutex[tid % HASH_LEN]));
+}
+
 /**
  * @brief     Remove thread control block from hash table.
  * @param tcb the pointer to tcb
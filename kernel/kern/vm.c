@@ -12,8 +12,11 @@
 #include <stdlib.h>
 #include <malloc.h>             /* malloc */
 #include <string.h>             /* memset */
-#include <page.h>               /* PAGE_SIZE */
+#include <syscall.h>            /* PAGE_SIZE */
 #include <assert.h>
+#include <smp/smp.h>            /* MAX_CPUS, smp_get_cpu */
+#include <smp/apic.h>           /* LAPIC_VIRT_BASE */
+#include <smp/mptable.h>        /* smp_lapic_base */
 
 /* x86 specific includes */
 #include <x86/cr.h>             /* set_cr3, set_cr4, set_esp0 */
@@ -25,7 +28,13 @@
 #include "vm.h"
 #include "vm_internal.h"
 #include "asm_page_inval.h"     /* asm_page_inval */
+#include "asm_cpuid.h"          /* asm_cpuid_edx */
 #include "utils/kern_mutex.h"
+#include "utils/kern_sem.h"
+#include "utils/spinlock.h"
+#include "scheduler.h"          /* sche_lock */
+#include "swap.h"               /* swap_store swap_load swap_put */
+#include "page_cache.h"         /* page_cache_reclaim */
 
 /* DEBUG */
 #define print_line lprintf("line %d", __LINE__)
@@ -41,16 +50,100 @@ static uint32_t zfod_frame;
 static int num_free_frames;
 static kern_mutex_t num_free_frames_mutex;
 
-static uint32_t first_free_frame;
-static kern_mutex_t first_free_frame_mutex;
-/* physical frames allocator */
+/* one page_t for every physical frame, indexed by frame number */
+static page_t *pages;
+static int num_pages;
+/* buddy allocator, free_areas[k] links free blocks of 2^k frames */
+static free_area_t free_areas[NUM_ORDERS];
+static kern_mutex_t free_areas_mutex;
+/**
+ * free frames that are already zeroed, refilled by the idle threads. Since an
+ * idle thread must never block, the pool is protected by a spinlock instead
+ * of a mutex. Each pooled frame holds a reservation of its own, so that the
+ * frames reserved by tasks are always left in free_areas.
+ */
+static page_t *zero_pool;
+static int zero_pool_frames;
+static unsigned int zero_pool_hits;
+static unsigned int zero_pool_misses;
+static spinlock_t zero_pool_lock;
+/* the counters below */
+static spinlock_t vm_stats_lock;
+static unsigned int cr3_loads;
+static unsigned int cr3_loads_avoided;
+static unsigned int demand_faults;
+static unsigned int tlb_full_flushes;
+static unsigned int tlb_page_invals;
+static unsigned int tlb_flushes_avoided;
+static unsigned int fault_around_pages;
+/* zeroed page tables ready for reuse */
+static uint32_t *page_tab_cache[PAGE_TAB_CACHE_SIZE];
+static int page_tab_cache_size;
+static kern_mutex_t page_tab_cache_mutex;
+/* protects refcount and owner of every page_t */
+static kern_mutex_t page_ref_mutex;
+/* next frame the reclaim scanner looks at, like the hand of a clock */
+static int clock_hand;
+/* only one thread at a time moves the clock hand */
+static kern_mutex_t reclaim_mutex;
+/* page directory each CPU has loaded, updated with the scheduler locked */
+static uint32_t *loaded_page_dirs[MAX_CPUS];
+/* threads of a task may edit the same page table */
+static spinlock_t page_tab_lock;
+/**
+ * same-page merging state, only used by the boot CPU's idle thread, which
+ * never blocks, so it is protected by the scheduler lock
+ */
+static merge_entry_t merge_stable[MERGE_TABLE_SIZE];
+static merge_entry_t merge_unstable[MERGE_TABLE_SIZE];
+static int merge_hand;
+static unsigned int zero_merges;
+
+/**
+ * when the direct map is enabled, all of physical memory is mapped with 4MB
+ * pages from direct_map_low up to DIRECT_MAP_HIGH, and kmap() just returns
+ * direct_map_low + frame. Otherwise direct_map_low is 0.
+ */
+static uint32_t direct_map_low;
+/* page table shared by every address space, holding the kmap slots */
+static uint32_t *kmap_page_tab;
+/* bit i is set while slot i is in use */
+static uint32_t kmap_slots_used;
+static spinlock_t kmap_lock;
+/* counts free slots, not including KMAP_IDLE_SLOT */
+static kern_sem_t kmap_sem;
+/* only one thread at a time may wait for a slot while holding another */
+static kern_mutex_t kmap_pair_mutex;
 
+static void free_area_add(page_t *page, int order);
+static void free_area_remove(page_t *page);
+static page_t *free_area_take(int order);
+static void free_area_merge(page_t *page, int order);
+static void *kmap_slot(int slot, uint32_t frame);
+static void kunmap_slot(int slot);
+static int direct_map_init(int machine_frames);
+static page_t *zero_pool_take(void);
+static void zero_pool_drain(void);
+static int cow_fault_large(uint32_t addr);
+static uint32_t *page_tab_alloc(uint32_t *page_dir);
+static void page_tab_free(uint32_t *page_dir, uint32_t *page_tab);
+static int reclaim_frames(int n);
+static int evict_page(page_t *page);
+static uint32_t *evict_candidate(page_t *page);
+static void merge_page(page_t *page);
+static void merge_release(page_t *page);
+static uint32_t page_hash(const uint32_t *data);
+static int page_dir_loaded_elsewhere(uint32_t *page_dir);
 
 /**
  * Set up kernel virtual memory, set paging and create free physical frames list
  * which is used to allocate new physical frames.
+ * @param  use_direct_map whether to map all physical memory with 4MB pages if
+ *                        the processor supports it, instead of reaching
+ *                        frames through the kmap slots
+ * @return                0 as success, -1 as failure
  */
-int vm_init() {
+int vm_init(int use_direct_map) {
     kern_page_dir = smemalign(PAGE_SIZE, PAGE_SIZE);
     if (kern_page_dir == NULL) return -1;
     memset(kern_page_dir, 0, PAGE_SIZE);
@@ -58,7 +151,10 @@ int vm_init() {
     uint32_t frame = 0;
     int flags = PTE_WRITE | PTE_PRESENT;
 
-    /* 16MB kernel memory only needs 4(NUM_KERN_TABLES) page table  */
+    /*
+     * 16MB kernel memory only needs 4(NUM_KERN_TABLES) page table. The pages
+     * are global, so their translations survive cr3 reloads (CR4_PGE).
+     */
     uint32_t *page_tab_addr;
     int i, j;
     for (i = 0; i < NUM_KERN_TABLES; i++) {
@@ -69,94 +165,914 @@ int vm_init() {
         kern_page_dir[i] = (uint32_t)page_tab_addr | flags;
 
         for (j = 0; j < NUM_PT_ENTRIES; j++) {
-            page_tab_addr[j] = frame | flags;
+            page_tab_addr[j] = frame | flags | PTE_GLOBAL;
             frame += PAGE_SIZE;
         }
     }
 
+    /* the kmap page table is shared by all page directories */
+    kmap_page_tab = smemalign(PAGE_SIZE, PAGE_SIZE);
+    if (kmap_page_tab == NULL) return -1;
+    memset(kmap_page_tab, 0, PAGE_SIZE);
+    kern_page_dir[KMAP_PD_INDEX] = (uint32_t)kmap_page_tab | flags;
+    kmap_slots_used = 0;
+
+    int machine_frames = machine_phys_frames();
+    direct_map_low = 0;
+    if (use_direct_map && direct_map_init(machine_frames) < 0) {
+        lprintf("direct map unavailable, using kmap slots");
+    }
+
+    /*
+     * CR0_WP makes the kernel respect read-only user mappings as well, so a
+     * kernel write into a copy-on-write or ZFOD page faults like a user one.
+     */
     set_cr3((uint32_t)kern_page_dir);
-    set_cr0(get_cr0() | CR0_PG);
+    set_cr0(get_cr0() | CR0_PG | CR0_WP);
     set_cr4(get_cr4() | CR4_PGE);
 
-    int machine_frames = machine_phys_frames();
-    kern_mutex_init(&first_free_frame_mutex);
+    kern_mutex_init(&free_areas_mutex);
     kern_mutex_init(&num_free_frames_mutex);
-    first_free_frame = frame;
-    num_free_frames = machine_frames - NUM_KERN_PAGES - 1;
+    kern_mutex_init(&page_ref_mutex);
+    kern_mutex_init(&kmap_pair_mutex);
+    kern_mutex_init(&page_tab_cache_mutex);
+    kern_mutex_init(&reclaim_mutex);
+    spin_init(&zero_pool_lock);
+    spin_init(&vm_stats_lock);
+    spin_init(&page_tab_lock);
+    spin_init(&kmap_lock);
+    page_tab_cache_size = 0;
+    kern_sem_init(&kmap_sem, KMAP_NUM_SLOTS - 1);
 
+    num_pages = machine_frames;
+    pages = malloc(machine_frames * sizeof(page_t));
+    if (pages == NULL) return -1;
+    memset(pages, 0, machine_frames * sizeof(page_t));
+    memset(free_areas, 0, sizeof(free_areas));
+    zero_pool = NULL;
+    zero_pool_frames = 0;
+
+    /* kernel frames and the ZFOD frame never reach the allocator */
+    for (i = 0; i < NUM_KERN_PAGES; i++) pages[i].flags = PAGE_KERNEL;
     zfod_frame = PAGE_SIZE * (machine_frames - 1);
-    access_physical(zfod_frame);
-    memset((void *)RW_PHYS_VA, 0, PAGE_SIZE);
+    FRAME_TO_PAGE(zfod_frame)->flags = PAGE_KERNEL;
+    memset(kmap_slot(KMAP_IDLE_SLOT, zfod_frame), 0, PAGE_SIZE);
+    kunmap_slot(KMAP_IDLE_SLOT);
+
+    /* hand the rest of memory to the buddy allocator in aligned blocks */
+    num_free_frames = machine_frames - NUM_KERN_PAGES - 1;
+    clock_hand = NUM_KERN_PAGES;
+    merge_hand = NUM_KERN_PAGES;
+    int last = machine_frames - 1;
+    i = NUM_KERN_PAGES;
+    while (i < last) {
+        int order = MAX_ORDER;
+        while ((i & ((1 << order) - 1)) || i + (1 << order) > last) order--;
+        free_area_add(&pages[i], order);
+        i += 1 << order;
+    }
+
+    return 0;
+}
 
-    uint32_t last_frame = zfod_frame - PAGE_SIZE;
-    access_physical(last_frame);
-    *((uint32_t *)RW_PHYS_VA) = 0;
+/**
+ * Maps all of physical memory right below the user stack's page table with
+ * 4MB (PSE) pages, so that any frame can be reached by a plain pointer.
+ * The page directory entries are shared by all address spaces just like the
+ * 16MB kernel identity map. Must be called before paging is enabled.
+ * @param  machine_frames number of physical frames
+ * @return                0 as success, -1 if the processor has no PSE or
+ *                        there is too much memory to map
+ */
+static int direct_map_init(int machine_frames) {
+    if (!(asm_cpuid_edx(CPUID_FEATURES) & CPUID_EDX_PSE)) return -1;
 
-    while (frame < last_frame) {
-        access_physical(frame);
-        *((uint32_t *)RW_PHYS_VA) = frame + PAGE_SIZE;
-        frame += PAGE_SIZE;
+    int num_tables = (machine_frames + NUM_PT_ENTRIES - 1) / NUM_PT_ENTRIES;
+    if (num_tables > DIRECT_MAP_MAX_TABLES) return -1;
+
+    direct_map_low = DIRECT_MAP_HIGH - num_tables * LARGE_PAGE_SIZE;
+    int pd_low = PD_INDEX(direct_map_low);
+    int i;
+    for (i = 0; i < num_tables; i++) {
+        kern_page_dir[pd_low + i] = (i * LARGE_PAGE_SIZE) | PTE_GLOBAL |
+                                    PDE_PAGE_SIZE | PDE_WRITE | PDE_PRESENT;
     }
+    set_cr4(get_cr4() | CR4_PSE);
 
+    lprintf("direct map: %d MB at 0x%08x", num_tables * 4,
+            (unsigned int)direct_map_low);
+    return 0;
+}
+
+/**
+ * Gets the start of the direct map of physical memory.
+ * @return virtual address of physical address 0, 0 if there is no direct map
+ */
+uint32_t get_direct_map_low(void) {
+    return direct_map_low;
+}
+
+/**
+ * Turns paging on for an application processor, the way vm_init() did for
+ * the boot processor, with the kernel's page directory loaded.
+ */
+void vm_init_cpu(void) {
+    if (direct_map_low != 0) set_cr4(get_cr4() | CR4_PSE);
+    set_cr3((uint32_t)kern_page_dir);
+    set_cr0(get_cr0() | CR0_PG | CR0_WP);
+    set_cr4(get_cr4() | CR4_PGE);
+}
+
+/**
+ * Maps the local APIC's registers at LAPIC_VIRT_BASE in place of the kernel
+ * memory there, uncached since they are device registers. The kernel's page
+ * tables are shared, so every CPU and address space sees them.
+ */
+void vm_map_lapic(void) {
+    uint32_t pde = kern_page_dir[PD_INDEX(LAPIC_VIRT_BASE)];
+    uint32_t *page_tab = ENTRY_TO_ADDR(pde);
+    page_tab[PT_INDEX(LAPIC_VIRT_BASE)] = (uint32_t)smp_lapic_base() |
+                                          PTE_GLOBAL | PTE_NO_CACHE |
+                                          PTE_WRITE_THROUGH | PTE_WRITE |
+                                          PTE_PRESENT;
+    asm_page_inval((void *)LAPIC_VIRT_BASE);
+}
+
+/**
+ * Links the first page of a free block into the free area of its order.
+ * Assumes free_areas_mutex is held (or that we are still booting).
+ * @param page  first page of the block
+ * @param order log2 of the number of frames in the block
+ */
+static void free_area_add(page_t *page, int order) {
+    free_area_t *area = &free_areas[order];
+    page->flags = PAGE_FREE;
+    page->order = order;
+    page->prev = NULL;
+    page->next = area->head;
+    if (area->head != NULL) area->head->prev = page;
+    area->head = page;
+    area->num_blocks++;
+}
+
+/**
+ * Unlinks a free block from the free area of its order.
+ * Assumes free_areas_mutex is held.
+ * @param page first page of the block
+ */
+static void free_area_remove(page_t *page) {
+    free_area_t *area = &free_areas[page->order];
+    if (page->prev != NULL) page->prev->next = page->next;
+    else area->head = page->next;
+    if (page->next != NULL) page->next->prev = page->prev;
+    area->num_blocks--;
+
+    page->next = page->prev = NULL;
+    page->flags = 0;
+}
+
+/**
+ * Takes a free block of exactly 2^order frames out of the free areas,
+ * splitting a larger block when there is none of the right size. The unused
+ * halves go back to the lower free areas.
+ * Assumes free_areas_mutex is held.
+ * @param  order log2 of the number of frames
+ * @return       first page of the block, NULL if no block is left
+ */
+static page_t *free_area_take(int order) {
+    int cur_order = order;
+    while (cur_order <= MAX_ORDER && free_areas[cur_order].head == NULL) {
+        cur_order++;
+    }
+    if (cur_order > MAX_ORDER) return NULL;
+
+    page_t *page = free_areas[cur_order].head;
+    free_area_remove(page);
+    while (cur_order > order) {
+        cur_order--;
+        free_area_add(page + (1 << cur_order), cur_order);
+    }
+    page->order = order;
+    return page;
+}
+
+/**
+ * Puts a block back into the free areas, merging it with its buddy as long
+ * as the buddy is free and of the same size.
+ * Assumes free_areas_mutex is held.
+ * @param page  first page of the block
+ * @param order log2 of the number of frames in the block
+ */
+static void free_area_merge(page_t *page, int order) {
+    int index = page - pages;
+    while (order < MAX_ORDER) {
+        int buddy_index = index ^ (1 << order);
+        if (buddy_index >= num_pages) break;
+        page_t *buddy = &pages[buddy_index];
+        if (!(buddy->flags & PAGE_FREE) || buddy->order != order) break;
+
+        free_area_remove(buddy);
+        index &= ~(1 << order);
+        order++;
+    }
+    free_area_add(&pages[index], order);
+}
+
+/**
+ * Allocates 2^order physically contiguous frames, aligned to their size.
+ * The frames are not accounted for in num_free_frames; callers reserve with
+ * dec_num_free_frames() first. A single frame comes from the zero pool when
+ * free_areas has none left, so it may happen to be zeroed.
+ * @param  order log2 of the number of frames, at most MAX_ORDER
+ * @return       physical address of the first frame, 0 if no block is left
+ */
+uint32_t alloc_frames(int order) {
+    assert(order >= 0 && order <= MAX_ORDER);
+
+    kern_mutex_lock(&free_areas_mutex);
+    page_t *page = free_area_take(order);
+    kern_mutex_unlock(&free_areas_mutex);
+    if (page == NULL && order == 0) page = zero_pool_take();
+    if (page == NULL) return 0;
+
+    page->refcount = 1;
+    page->owner = (void *)get_cr3();
+    return PAGE_TO_FRAME(page);
+}
+
+/**
+ * Frees a block returned by alloc_frames().
+ * @param addr  physical address of the first frame of the block
+ * @param order the order the block was allocated with
+ */
+void free_frames(uint32_t addr, int order) {
+    page_t *page = FRAME_TO_PAGE(addr);
+    assert(!(page->flags & (PAGE_FREE | PAGE_KERNEL)));
+    page->refcount = 0;
+    page->owner = NULL;
+
+    kern_mutex_lock(&free_areas_mutex);
+    free_area_merge(page, order);
+    kern_mutex_unlock(&free_areas_mutex);
+}
+
+/**
+ * Starts collecting the pages of an address space whose mappings are about
+ * to be removed or write-protected.
+ * @param gather   the gather
+ * @param page_dir the page directory the pages are mapped in
+ */
+void tlb_gather_init(tlb_gather_t *gather, uint32_t *page_dir) {
+    gather->page_dir = page_dir;
+    gather->num_pages = 0;
+}
+
+/**
+ * Records a page whose translation has to be dropped by tlb_gather_flush().
+ * Frames it mapped must not be freed before then.
+ * @param gather the gather
+ * @param addr   virtual address in the page, or in a large page
+ */
+void tlb_gather_page(tlb_gather_t *gather, uint32_t addr) {
+    if (gather->num_pages < TLB_GATHER_MAX) {
+        gather->addrs[gather->num_pages] = addr & PAGE_ALIGN_MASK;
+    }
+    gather->num_pages++;
+}
+
+/**
+ * Drops the stale translations of the pages collected so far. Nothing has
+ * to be done unless the address space is loaded, since loading it flushes
+ * them. Up to TLB_GATHER_MAX pages are invalidated one by one, and beyond
+ * that reloading cr3 flushes every non-global entry at once. Only this CPU's
+ * TLB is flushed: the threads of a task all run on one CPU.
+ * @param gather the gather, empty again afterwards
+ */
+void tlb_gather_flush(tlb_gather_t *gather) {
+    int num_pages = gather->num_pages;
+    if (num_pages == 0) return;
+    gather->num_pages = 0;
+
+    spin_lock(&vm_stats_lock);
+    if ((uint32_t)gather->page_dir != get_cr3()) {
+        tlb_flushes_avoided += num_pages;
+    } else if (num_pages > TLB_GATHER_MAX) {
+        set_cr3((uint32_t)gather->page_dir);
+        tlb_full_flushes++;
+        tlb_flushes_avoided += num_pages - 1;
+    } else {
+        int i;
+        for (i = 0; i < num_pages; i++) {
+            asm_page_inval((void *)gather->addrs[i]);
+        }
+        tlb_page_invals += num_pages;
+    }
+    spin_unlock(&vm_stats_lock);
+}
+
+/**
+ * Empties a frame batch.
+ * @param batch the batch
+ */
+void frame_batch_init(frame_batch_t *batch) {
+    batch->head = NULL;
+    batch->num_frames = 0;
+}
+
+/**
+ * Pushes a frame onto a batch, using the page_t list link of the frame.
+ * @param batch the batch
+ * @param page  page_t of the frame
+ */
+static void frame_batch_push(frame_batch_t *batch, page_t *page) {
+    page->next = batch->head;
+    batch->head = page;
+    batch->num_frames++;
+}
+
+/**
+ * Takes a frame off a batch filled by get_frames_batch(). The frame is not
+ * zeroed.
+ * @param  batch the batch
+ * @return       physical address of the frame, 0 if the batch is empty
+ */
+uint32_t frame_batch_pop(frame_batch_t *batch) {
+    page_t *page = batch->head;
+    if (page == NULL) return 0;
+
+    batch->head = page->next;
+    batch->num_frames--;
+    page->next = NULL;
+    return PAGE_TO_FRAME(page);
+}
+
+/**
+ * Drops a reference to a frame like put_frame(), but a frame that is no
+ * longer mapped is added to the batch instead of going straight back to the
+ * allocator. Kernel frames are ignored.
+ * @param batch the batch
+ * @param frame physical address of the frame
+ */
+void put_frame_batched(frame_batch_t *batch, uint32_t frame) {
+    page_t *page = FRAME_TO_PAGE(frame);
+    if (page->flags & PAGE_KERNEL) return;
+
+    kern_mutex_lock(&page_ref_mutex);
+    int refs = --page->refcount;
+    kern_mutex_unlock(&page_ref_mutex);
+
+    assert(refs >= 0);
+    if (refs == 0 && page->order > 0) free_frames(frame, page->order);
+    else if (refs == 0) frame_batch_push(batch, page);
+}
+
+/**
+ * Gives every frame of a batch back to the buddy allocator with a single
+ * acquisition of free_areas_mutex. The batch is empty afterwards.
+ * Reservations are not touched; callers return them with one
+ * inc_num_free_frames() call.
+ * @param batch the batch
+ */
+void free_frames_batch(frame_batch_t *batch) {
+    if (batch->head == NULL) return;
+
+    kern_mutex_lock(&free_areas_mutex);
+    page_t *page = batch->head;
+    while (page != NULL) {
+        page_t *next = page->next;
+        page->refcount = 0;
+        page->owner = NULL;
+        free_area_merge(page, 0);
+        page = next;
+    }
+    kern_mutex_unlock(&free_areas_mutex);
+
+    frame_batch_init(batch);
+}
+
+/**
+ * Allocates n single frames into a batch with a single acquisition of
+ * free_areas_mutex. The frames are not zeroed, since callers usually map them
+ * and then fill or clear them through their virtual address. As with
+ * alloc_frames(), the frames must already be reserved, and the zero pool is
+ * drawn on once free_areas runs out.
+ * @param  batch the batch to fill, must be empty
+ * @param  n     number of frames
+ * @return       0 as success, -1 if there are not n free frames
+ */
+int get_frames_batch(frame_batch_t *batch, int n) {
+    frame_batch_init(batch);
+    uint32_t owner = get_cr3();
+
+    kern_mutex_lock(&free_areas_mutex);
+    while (batch->num_frames < n) {
+        page_t *page = free_area_take(0);
+        if (page == NULL) break;
+        page->refcount = 1;
+        page->owner = (void *)owner;
+        frame_batch_push(batch, page);
+    }
+    kern_mutex_unlock(&free_areas_mutex);
+
+    while (batch->num_frames < n) {
+        page_t *page = zero_pool_take();
+        if (page == NULL) break;
+        page->refcount = 1;
+        page->owner = (void *)owner;
+        frame_batch_push(batch, page);
+    }
+
+    if (batch->num_frames < n) {
+        free_frames_batch(batch);
+        return -1;
+    }
     return 0;
 }
 
 // assumes it's in cr3
+/*
+ * Inside a 4MB large page, the entry returned describes the 4KB frame at addr
+ * with the flags of the page directory entry, so callers that only look at
+ * PTE_PRESENT, PTE_WRITE or PTE_COW need not care about the page size.
+ */
 uint32_t get_pte(uint32_t addr) {
     uint32_t *page_dir = (uint32_t *)get_cr3();
     int pd_index = PD_INDEX(addr);
     int pt_index = PT_INDEX(addr);
+    uint32_t pde = page_dir[pd_index];
 
-    if (!(page_dir[pd_index] & PTE_PRESENT)) return 0;
-    else {
-        uint32_t *page_tab = ENTRY_TO_ADDR(page_dir[pd_index]);
+    if (!(pde & PTE_PRESENT)) return 0;
+    else if (pde & PDE_PAGE_SIZE) {
+        uint32_t frame = (pde & LARGE_PAGE_MASK) + pt_index * PAGE_SIZE;
+        return frame | (pde & PAGE_FLAG_MASK & ~PDE_PAGE_SIZE);
+    } else {
+        uint32_t *page_tab = ENTRY_TO_ADDR(pde);
         return page_tab[pt_index];
     }
 }
 
+/**
+ * Gets the page directory entry covering addr in the current address space.
+ * @param  addr virtual address
+ * @return      the page directory entry
+ */
+uint32_t get_pde(uint32_t addr) {
+    uint32_t *page_dir = (uint32_t *)get_cr3();
+    return page_dir[PD_INDEX(addr)];
+}
+
+/**
+ * Backs the 4MB aligned region at addr with a zeroed large page, if nothing
+ * is mapped there yet and a free 4MB block is left. The frames must already
+ * be reserved.
+ * @param  addr 4MB aligned user address
+ * @return      0 as success, -1 if a 4KB mapping has to be used instead
+ */
+int map_large_page(uint32_t addr) {
+    uint32_t *page_dir = (uint32_t *)get_cr3();
+    int pd_index = PD_INDEX(addr);
+    if (page_dir[pd_index] & PDE_PRESENT) return -1;
+
+    uint32_t frame = alloc_frames(LARGE_PAGE_ORDER);
+    if (frame == 0) return -1;
+
+    int i;
+    for (i = 0; i < FRAMES_PER_LARGE_PAGE; i++) {
+        void *frame_addr = kmap(frame + i * PAGE_SIZE);
+        memset(frame_addr, 0, PAGE_SIZE);
+        kunmap(frame_addr);
+    }
+    page_dir[pd_index] =
+        frame | PDE_PAGE_SIZE | PTE_USER | PTE_WRITE | PTE_PRESENT;
+    return 0;
+}
+
+/**
+ * Removes the large page mapped at addr and drops its reference.
+ * @param addr 4MB aligned user address
+ */
+void unmap_large_page(uint32_t addr) {
+    uint32_t *page_dir = (uint32_t *)get_cr3();
+    int pd_index = PD_INDEX(addr);
+    uint32_t pde = page_dir[pd_index];
+    assert((pde & PDE_PRESENT) && (pde & PDE_PAGE_SIZE));
+
+    page_dir[pd_index] = 0;
+    asm_page_inval((void *)addr);
+    put_frame(pde & LARGE_PAGE_MASK);
+}
+
+/**
+ * Breaks the large page mapped at addr up into 4KB pages, so that part of it
+ * can be unmapped. A private large page keeps its frames, which become
+ * separate blocks; a copy-on-write one is first copied as on a write fault.
+ * @param  addr 4MB aligned user address
+ * @return      0 as success, -1 if out of kernel memory
+ */
+int split_large_page(uint32_t addr) {
+    uint32_t *page_dir = (uint32_t *)get_cr3();
+    int pd_index = PD_INDEX(addr);
+    uint32_t pde = page_dir[pd_index];
+    assert((pde & PDE_PRESENT) && (pde & PDE_PAGE_SIZE));
+
+    uint32_t frame = pde & LARGE_PAGE_MASK;
+    if (get_frame_ref(frame) > 1) {
+        if (cow_fault_large(addr) < 0) return -1;
+        pde = page_dir[pd_index];
+        /* the copy may have been made with 4KB pages already */
+        if (!(pde & PDE_PAGE_SIZE)) return 0;
+        frame = pde & LARGE_PAGE_MASK;
+    }
+
+    uint32_t *page_tab = page_tab_alloc(page_dir);
+    if (page_tab == NULL) return -1;
+    FRAME_TO_PAGE((uint32_t)page_tab)->refcount = NUM_PT_ENTRIES;
+
+    uint32_t flags = pde & PAGE_FLAG_MASK & ~PDE_PAGE_SIZE;
+    int i;
+    kern_mutex_lock(&page_ref_mutex);
+    for (i = 0; i < FRAMES_PER_LARGE_PAGE; i++) {
+        page_t *page = FRAME_TO_PAGE(frame + i * PAGE_SIZE);
+        page->flags = 0;
+        page->order = 0;
+        page->refcount = 1;
+        page->owner = page_dir;
+        page->vaddr = addr + i * PAGE_SIZE;
+        page_tab[i] = (frame + i * PAGE_SIZE) | flags;
+    }
+    page_dir[pd_index] =
+        (uint32_t)page_tab | PTE_USER | PTE_WRITE | PTE_PRESENT;
+    kern_mutex_unlock(&page_ref_mutex);
+    asm_page_inval((void *)addr);
+    return 0;
+}
+
+/**
+ * Sets a page table entry in the current address space. The page table is
+ * allocated on first use, and given back once its last entry is cleared.
+ * @param  addr       virtual address
+ * @param  frame_addr physical address of the frame, 0 to clear the entry
+ * @param  flags      flags of the entry
+ * @return            0 as success, -1 if no page table could be allocated
+ */
 int set_pte(uint32_t addr, uint32_t frame_addr, int flags) {
     uint32_t *page_dir = (uint32_t *)get_cr3();
     int pd_index = PD_INDEX(addr);
     int pt_index = PT_INDEX(addr);
+    uint32_t new_pte = frame_addr | flags;
 
+    assert(!(page_dir[pd_index] & PDE_PAGE_SIZE));
     if (!(page_dir[pd_index] & PTE_PRESENT)) {
-        void *ret = smemalign(PAGE_SIZE, PAGE_SIZE);
+        if (new_pte == 0) return 0;
+        uint32_t *ret = page_tab_alloc(page_dir);
         if (ret == NULL) return -1;
-        memset(ret, 0, PAGE_SIZE);
 
         page_dir[pd_index] = (uint32_t)ret;
         page_dir[pd_index] |= PTE_USER | PTE_WRITE | PTE_PRESENT;
     }
 
     uint32_t *page_tab = ENTRY_TO_ADDR(page_dir[pd_index]);
-    page_tab[pt_index] = frame_addr | flags;
+    page_t *page_tab_meta = FRAME_TO_PAGE((uint32_t)page_tab);
+    int empty = 0;
 
+    spin_lock(&page_tab_lock);
+    uint32_t old_pte = page_tab[pt_index];
+    page_tab[pt_index] = new_pte;
+    if (new_pte & PTE_PRESENT) {
+        /* remember where the frame is mapped, for the reclaim scanner */
+        page_t *page = FRAME_TO_PAGE(frame_addr);
+        if (!(page->flags & PAGE_KERNEL)) {
+            page->owner = page_dir;
+            page->vaddr = addr & PAGE_ALIGN_MASK;
+        }
+    }
+    if (old_pte == 0 && new_pte != 0) {
+        page_tab_meta->refcount++;
+    } else if (old_pte != 0 && new_pte == 0) {
+        if (--page_tab_meta->refcount == 0) {
+            page_dir[pd_index] = 0;
+            empty = 1;
+        }
+    }
+    spin_unlock(&page_tab_lock);
+
+    if (empty) {
+        /* drop any cached translation through the old page table */
+        asm_page_inval((void *)addr);
+        page_tab_free(page_dir, page_tab);
+    }
     return 0;
 }
 
+/**
+ * Gets a zeroed page table for an address space, from the cache if possible.
+ * @param  page_dir the page directory the table is for
+ * @return          the page table, NULL if out of kernel memory
+ */
+static uint32_t *page_tab_alloc(uint32_t *page_dir) {
+    uint32_t *page_tab = NULL;
+    kern_mutex_lock(&page_tab_cache_mutex);
+    if (page_tab_cache_size > 0) {
+        page_tab = page_tab_cache[--page_tab_cache_size];
+    }
+    kern_mutex_unlock(&page_tab_cache_mutex);
+
+    if (page_tab == NULL) {
+        page_tab = smemalign(PAGE_SIZE, PAGE_SIZE);
+        if (page_tab == NULL) return NULL;
+        memset(page_tab, 0, PAGE_SIZE);
+    }
+
+    FRAME_TO_PAGE((uint32_t)page_tab)->refcount = 0;
+    FRAME_TO_PAGE((uint32_t)page_tab)->owner = page_dir;
+    FRAME_TO_PAGE((uint32_t)page_dir)->refcount++;
+    return page_tab;
+}
+
+/**
+ * Gives back a page table whose entries are all zero, keeping it in the cache
+ * unless the cache is full.
+ * @param page_dir the page directory the table belonged to
+ * @param page_tab the page table
+ */
+static void page_tab_free(uint32_t *page_dir, uint32_t *page_tab) {
+    FRAME_TO_PAGE((uint32_t)page_tab)->owner = NULL;
+    FRAME_TO_PAGE((uint32_t)page_dir)->refcount--;
+
+    kern_mutex_lock(&page_tab_cache_mutex);
+    if (page_tab_cache_size < PAGE_TAB_CACHE_SIZE) {
+        page_tab_cache[page_tab_cache_size++] = page_tab;
+        page_tab = NULL;
+    }
+    kern_mutex_unlock(&page_tab_cache_mutex);
+
+    if (page_tab != NULL) sfree(page_tab, PAGE_SIZE);
+}
+
+/**
+ * Allocates a single zeroed frame. A frame from the zero pool is taken first,
+ * so that the caller does not pay for clearing it. Otherwise this is the order
+ * 0 fast path of the buddy allocator: a free order 0 block is taken directly
+ * when one exists, and zeroed here. The frame starts with one reference, owned
+ * by the address space currently in cr3.
+ * @return physical address of the frame
+ */
 uint32_t get_frame() {
-    kern_mutex_lock(&first_free_frame_mutex);
-    uint32_t frame = first_free_frame;
-    assert(frame != 0);
+    page_t *page = zero_pool_take();
+    spin_lock(&zero_pool_lock);
+    if (page != NULL) zero_pool_hits++;
+    else zero_pool_misses++;
+    spin_unlock(&zero_pool_lock);
+
+    if (page != NULL) {
+        page->refcount = 1;
+        page->owner = (void *)get_cr3();
+        return PAGE_TO_FRAME(page);
+    }
 
-    access_physical(frame);
-    first_free_frame = *((uint32_t *)RW_PHYS_VA);
+    kern_mutex_lock(&free_areas_mutex);
+    page = free_areas[0].head;
+    if (page != NULL) free_area_remove(page);
+    kern_mutex_unlock(&free_areas_mutex);
 
-    memset((void *)RW_PHYS_VA, 0, PAGE_SIZE);
-    kern_mutex_unlock(&first_free_frame_mutex);
+    uint32_t frame;
+    if (page != NULL) {
+        page->order = 0;
+        page->refcount = 1;
+        page->owner = (void *)get_cr3();
+        frame = PAGE_TO_FRAME(page);
+    } else {
+        frame = alloc_frames(0);
+        assert(frame != 0);
+    }
+
+    void *addr = kmap(frame);
+    memset(addr, 0, PAGE_SIZE);
+    kunmap(addr);
     return frame;
 }
 
+/**
+ * Moves up to ZERO_POOL_REFILL_BATCH free frames into the zero pool, clearing
+ * them on the way. Called in a loop by the idle threads, so the clearing
+ * happens while nothing else wants the CPU.
+ *
+ * An idle thread may neither block on nor be preempted while holding a
+ * mutex, so each frame is reserved and taken with the scheduler locked, which
+ * keeps any mutex from changing hands, and only if nobody holds
+ * free_areas_mutex or num_free_frames_mutex at that moment, so that frames
+ * reserved by tasks stay in free_areas. The frame is then cleared with
+ * nothing locked, so idle CPUs clear frames side by side and a thread that
+ * wakes up is not delayed. Without the direct map it is cleared through
+ * KMAP_IDLE_SLOT, which is never handed out by kmap(); only the boot CPU runs
+ * then. Several idle threads may overfill the pool by a frame each.
+ */
+void zero_pool_refill(void) {
+    int i;
+    for (i = 0; i < ZERO_POOL_REFILL_BATCH; i++) {
+        if (zero_pool_frames >= ZERO_POOL_SIZE) return;
+
+        page_t *page = NULL;
+        sche_lock();
+        if (!free_areas_mutex.is_locked && !num_free_frames_mutex.is_locked &&
+                num_free_frames > 0) {
+            page = free_area_take(0);
+            if (page != NULL) num_free_frames--;
+        }
+        sche_unlock();
+        if (page == NULL) return;
+
+        if (direct_map_low != 0) {
+            memset((void *)(direct_map_low + PAGE_TO_FRAME(page)), 0,
+                   PAGE_SIZE);
+        } else {
+            memset(kmap_slot(KMAP_IDLE_SLOT, PAGE_TO_FRAME(page)), 0,
+                   PAGE_SIZE);
+            kunmap_slot(KMAP_IDLE_SLOT);
+        }
+
+        spin_lock(&zero_pool_lock);
+        page->flags = PAGE_ZEROED;
+        page->next = zero_pool;
+        zero_pool = page;
+        zero_pool_frames++;
+        spin_unlock(&zero_pool_lock);
+    }
+}
+
+/**
+ * Takes a zeroed frame out of the pool for a caller that has reserved a
+ * frame, and gives back the reservation the pool held for it.
+ * @return the page of the frame, NULL if the pool is empty
+ */
+static page_t *zero_pool_take(void) {
+    spin_lock(&zero_pool_lock);
+    page_t *page = zero_pool;
+    if (page != NULL) {
+        zero_pool = page->next;
+        zero_pool_frames--;
+    }
+    spin_unlock(&zero_pool_lock);
+    if (page == NULL) return NULL;
+
+    page->next = NULL;
+    page->flags = 0;
+    page->order = 0;
+    inc_num_free_frames(1);
+    return page;
+}
+
+/**
+ * Gives every frame of the zero pool back to the buddy allocator, along with
+ * its reservation. Called when tasks are short of frames.
+ */
+static void zero_pool_drain(void) {
+    frame_batch_t batch;
+    frame_batch_init(&batch);
+
+    spin_lock(&zero_pool_lock);
+    batch.head = zero_pool;
+    batch.num_frames = zero_pool_frames;
+    zero_pool = NULL;
+    zero_pool_frames = 0;
+    spin_unlock(&zero_pool_lock);
+
+    int num_frames = batch.num_frames;
+    free_frames_batch(&batch);
+    if (num_frames > 0) inc_num_free_frames(num_frames);
+}
+
+/**
+ * Gives a single frame back to the buddy allocator.
+ * @param frame physical address of the frame
+ */
 void free_frame(uint32_t frame) {
-    kern_mutex_lock(&first_free_frame_mutex);
-    access_physical(frame);
+    free_frames(frame, 0);
+}
+
+/**
+ * Fills in physical memory statistics, including how fragmented the free
+ * memory in the buddy allocator is.
+ * @param stats structure to fill in
+ */
+void vm_get_stats(vm_stats_t *stats) {
+    memset(stats, 0, sizeof(vm_stats_t));
+    stats->total_frames = num_pages;
+
+    kern_mutex_lock(&num_free_frames_mutex);
+    stats->unreserved_frames = num_free_frames;
+    kern_mutex_unlock(&num_free_frames_mutex);
+
+    int order;
+    stats->largest_free_order = -1;
+    kern_mutex_lock(&free_areas_mutex);
+    for (order = 0; order <= MAX_ORDER; order++) {
+        int num_blocks = free_areas[order].num_blocks;
+        stats->free_blocks[order] = num_blocks;
+        stats->free_frames += num_blocks << order;
+        if (num_blocks > 0) stats->largest_free_order = order;
+    }
+    kern_mutex_unlock(&free_areas_mutex);
+
+    kern_mutex_lock(&page_tab_cache_mutex);
+    stats->page_tables_cached = page_tab_cache_size;
+    kern_mutex_unlock(&page_tab_cache_mutex);
+
+    spin_lock(&zero_pool_lock);
+    stats->zero_pool_frames = zero_pool_frames;
+    stats->zero_pool_hits = zero_pool_hits;
+    stats->zero_pool_misses = zero_pool_misses;
+    spin_unlock(&zero_pool_lock);
+
+    spin_lock(&vm_stats_lock);
+    stats->cr3_loads = cr3_loads;
+    stats->cr3_loads_avoided = cr3_loads_avoided;
+    stats->demand_faults = demand_faults;
+    stats->tlb_full_flushes = tlb_full_flushes;
+    stats->tlb_page_invals = tlb_page_invals;
+    stats->tlb_flushes_avoided = tlb_flushes_avoided;
+    stats->fault_around_pages = fault_around_pages;
+    spin_unlock(&vm_stats_lock);
+
+    stats->page_tables = page_dir_num_tables((uint32_t *)get_cr3());
+
+    sche_lock();
+    stats->zero_merges = zero_merges;
+    sche_unlock();
+
+    /* a racy count is good enough for statistics */
+    int i;
+    for (i = NUM_KERN_PAGES; i < num_pages; i++) {
+        if (pages[i].flags & PAGE_MERGED) {
+            stats->merged_frames++;
+            stats->merged_pages += pages[i].refcount;
+        }
+    }
+}
+
+/**
+ * Adds a reference to a frame that is about to be mapped by another page
+ * table entry. A shared frame no longer has a single owner.
+ * @param frame physical address of the frame
+ */
+void inc_frame_ref(uint32_t frame) {
+    page_t *page = FRAME_TO_PAGE(frame);
+    kern_mutex_lock(&page_ref_mutex);
+    page->refcount++;
+    page->owner = NULL;
+    kern_mutex_unlock(&page_ref_mutex);
+}
+
+/**
+ * Gets the number of page table entries that currently map a frame.
+ * @param  frame physical address of the frame
+ * @return       reference count
+ */
+int get_frame_ref(uint32_t frame) {
+    kern_mutex_lock(&page_ref_mutex);
+    int refs = FRAME_TO_PAGE(frame)->refcount;
+    kern_mutex_unlock(&page_ref_mutex);
+    return refs;
+}
+
+/**
+ * Drops a reference to a frame, and gives the frame back to the allocator
+ * once nobody maps it anymore. Kernel frames such as the ZFOD frame are never
+ * freed. For the first frame of a large page, the whole block is freed.
+ * @param frame physical address of the frame
+ */
+void put_frame(uint32_t frame) {
+    page_t *page = FRAME_TO_PAGE(frame);
+    if (page->flags & PAGE_KERNEL) return;
+
+    kern_mutex_lock(&page_ref_mutex);
+    int refs = --page->refcount;
+    kern_mutex_unlock(&page_ref_mutex);
 
-    *((uint32_t *)RW_PHYS_VA) = first_free_frame;
-    first_free_frame = frame;
-    kern_mutex_unlock(&first_free_frame_mutex);
+    assert(refs >= 0);
+    if (refs == 0) free_frames(frame, page->order);
 }
 
 int dec_num_free_frames(int n) {
+    kern_mutex_lock(&num_free_frames_mutex);
+    int missing = n - num_free_frames;
+    if (missing <= 0) num_free_frames -= n;
+    kern_mutex_unlock(&num_free_frames_mutex);
+    if (missing <= 0) return 0;
+
+    /* the frames held by the zero pool are the cheapest to get back */
+    zero_pool_drain();
+    kern_mutex_lock(&num_free_frames_mutex);
+    missing = n - num_free_frames;
+    if (missing <= 0) num_free_frames -= n;
+    kern_mutex_unlock(&num_free_frames_mutex);
+    if (missing <= 0) return 0;
+
+    /* drop cached program pages nobody maps, then evict cold pages to the
+     * swap store, and try again */
+    missing -= page_cache_reclaim(missing);
+    if (missing > 0) reclaim_frames(missing);
+
     int ret = 0;
     kern_mutex_lock(&num_free_frames_mutex);
     if (num_free_frames < n) ret = -1;
@@ -177,82 +1093,198 @@ uint32_t *page_dir_init() {
     memset(page_dir, 0, PAGE_SIZE);
 
     int i;
-    for (i = 0; i < NUM_KERN_TABLES; i++) {
+    /* kernel memory, the direct map and the kmap slots are shared */
+    for (i = 0; i < NUM_PD_ENTRIES; i++) {
         page_dir[i] = kern_page_dir[i];
     }
+    FRAME_TO_PAGE((uint32_t)page_dir)->refcount = 0;
+    FRAME_TO_PAGE((uint32_t)page_dir)->owner = NULL;
     return page_dir;
 }
 
+/**
+ * Gets the number of page table pages an address space is using, not counting
+ * the tables shared with the kernel.
+ * @param  page_dir the page directory
+ * @return          number of page tables
+ */
+int page_dir_num_tables(uint32_t *page_dir) {
+    return FRAME_TO_PAGE((uint32_t)page_dir)->refcount;
+}
+
+/**
+ * Tears down the user part of an address space. Frames that are no longer
+ * mapped anywhere are collected in a batch and handed back to the allocator
+ * at once, and the reservations of all present pages are returned with a
+ * single call, instead of taking the allocator locks once per page. If the
+ * address space is loaded its stale translations are dropped before any of
+ * the frames are freed.
+ * @param  page_dir page directory to clear
+ * @return          0
+ */
 int page_dir_clear(uint32_t *page_dir) {
+    frame_batch_t batch;
+    frame_batch_init(&batch);
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, page_dir);
+    int num_present = 0;
+
     int i, j;
     for (i = NUM_KERN_TABLES; i < NUM_PD_ENTRIES; i++) {
         uint32_t pde = page_dir[i];
         if ((pde & PDE_PRESENT) == 0) continue;
+        /* shared kernel entries are neither cleared nor copied */
+        if (kern_page_dir[i] & PDE_PRESENT) continue;
+
+        if (pde & PDE_PAGE_SIZE) {
+            page_dir[i] = 0;
+            /* large pages are freed right away, not batched */
+            tlb_gather_page(&gather, INDEX_TO_ADDR(i, 0));
+            tlb_gather_flush(&gather);
+            num_present += FRAMES_PER_LARGE_PAGE;
+            put_frame(pde & LARGE_PAGE_MASK);
+            continue;
+        }
         uint32_t *page_tab = ENTRY_TO_ADDR(pde);
 
+        kern_mutex_lock(&page_ref_mutex);
         for (j = 0; j < NUM_PT_ENTRIES; j++) {
             uint32_t pte = page_tab[j];
-            if ((pte & PTE_PRESENT) == 0) continue;
-
-            // don't mess with the RW_PHYS reserved page
-            if (i == RW_PHYS_PD_INDEX && j == RW_PHYS_PT_INDEX) continue;
+            if (pte == 0) continue;
             page_tab[j] = 0;
-            uint32_t frame = pte & PAGE_ALIGN_MASK;
-            if (frame != zfod_frame) free_frame(frame);
-            inc_num_free_frames(1);
+            if ((pte & PTE_PRESENT) == 0) {
+                /* swapped out pages hold a slot instead of a reservation */
+                if (pte & PTE_SWAPPED) swap_put(PTE_TO_SLOT(pte));
+                continue;
+            }
+            num_present++;
+            tlb_gather_page(&gather, INDEX_TO_ADDR(i, j));
+
+            page_t *page = FRAME_TO_PAGE(pte & PAGE_ALIGN_MASK);
+            if (page->flags & PAGE_KERNEL) continue;
+            assert(page->refcount > 0);
+            if (--page->refcount == 0) frame_batch_push(&batch, page);
         }
+        kern_mutex_unlock(&page_ref_mutex);
 
+        /* every entry is zero again, so the table can be reused as is */
         page_dir[i] = 0;
-        sfree(page_tab, PAGE_SIZE);
+        page_tab_free(page_dir, page_tab);
     }
 
+    tlb_gather_flush(&gather);
+    free_frames_batch(&batch);
+    inc_num_free_frames(num_present);
     return 0;
 }
 
+/**
+ * Clears an address space and frees its page directory.
+ * @param page_dir page directory returned by page_dir_init()
+ */
+void page_dir_destroy(uint32_t *page_dir) {
+    /* keep the reclaim scanner away from the pages from now on */
+    FRAME_TO_PAGE((uint32_t)page_dir)->owner = NULL;
+    page_dir_clear(page_dir);
+    sfree(page_dir, PAGE_SIZE);
+}
+
+/**
+ * Copies the user part of an address space for fork. Instead of copying frame
+ * contents, every present frame is shared between the two page directories.
+ * Writable pages are write-protected in both and marked PTE_COW, so the first
+ * write from either side gets a private copy in cow_fault(). Only page tables
+ * are allocated here, which keeps fork cheap no matter how much memory the
+ * parent has touched.
+ *
+ * A frame is still reserved for every shared page, so breaking the sharing
+ * later can never run out of memory.
+ *
+ * @param  new_page_dir  page directory of the child, must be empty
+ * @param  old_page_dir  page directory of the parent, must be loaded in cr3
+ * @return               0 as success, -1 as failure
+ */
 int page_dir_copy(uint32_t *new_page_dir, uint32_t *old_page_dir) {
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, old_page_dir);
     int i, j;
     int fail = 0;
     for (i = NUM_KERN_TABLES; i < NUM_PD_ENTRIES; i++) {
         uint32_t old_pde = old_page_dir[i];
         if ((old_pde & PDE_PRESENT) == 0) continue;
+        if (kern_page_dir[i] & PDE_PRESENT) continue;
+
+        if (old_pde & PDE_PAGE_SIZE) {
+            /* a large page is shared copy-on-write as a whole */
+            if (dec_num_free_frames(FRAMES_PER_LARGE_PAGE) < 0) {
+                fail = 1;
+                break;
+            }
+            inc_frame_ref(old_pde & LARGE_PAGE_MASK);
+            if (old_pde & PTE_WRITE) {
+                old_pde = (old_pde & ~PTE_WRITE) | PTE_COW;
+                old_page_dir[i] = old_pde;
+                tlb_gather_page(&gather, INDEX_TO_ADDR(i, 0));
+            }
+            new_page_dir[i] = old_pde;
+            continue;
+        }
         int new_pde_flag = old_pde & PAGE_FLAG_MASK;
         uint32_t *old_page_tab = ENTRY_TO_ADDR(old_pde);
 
-        uint32_t *new_page_tab = smemalign(PAGE_SIZE, PAGE_SIZE);
+        /* reserve one frame per shared page with a single call */
+        int num_present = 0;
+        int num_swapped = 0;
+        for (j = 0; j < NUM_PT_ENTRIES; j++) {
+            if (old_page_tab[j] & PTE_PRESENT) num_present++;
+            else if (old_page_tab[j] & PTE_SWAPPED) num_swapped++;
+        }
+        if (num_present + num_swapped == 0) continue;
+        if (dec_num_free_frames(num_present) < 0) {
+            fail = 1;
+            break;
+        }
+
+        uint32_t *new_page_tab = page_tab_alloc(new_page_dir);
         if (new_page_tab == NULL) {
+            inc_num_free_frames(num_present);
             fail = 1;
             break;
         }
-        memset(new_page_tab, 0, PAGE_SIZE);
+        FRAME_TO_PAGE((uint32_t)new_page_tab)->refcount =
+            num_present + num_swapped;
         new_page_dir[i] = (uint32_t)new_page_tab | new_pde_flag;
 
+        kern_mutex_lock(&page_ref_mutex);
         for (j = 0; j < NUM_PT_ENTRIES; j++) {
             uint32_t old_pte = old_page_tab[j];
-            if ((old_pte & PTE_PRESENT) == 0) continue;
-
-            if (dec_num_free_frames(1) < 0) {
-                fail = 1;
-                break;
-            }
-
-            uint32_t frame = old_pte & PAGE_ALIGN_MASK;
-            if (frame == zfod_frame) {
-                new_page_tab[j] = old_pte;
+            if ((old_pte & PTE_PRESENT) == 0) {
+                /* a swapped out page is shared through its slot */
+                if (old_pte & PTE_SWAPPED) {
+                    swap_dup(PTE_TO_SLOT(old_pte));
+                    new_page_tab[j] = old_pte;
+                }
                 continue;
             }
 
-            // don't mess with the RW_PHYS reserved page
-            if (i == RW_PHYS_PD_INDEX && j == RW_PHYS_PT_INDEX) continue;
-            uint32_t new_physical_frame = get_frame();
-            int new_pte_flag = old_pte & PAGE_FLAG_MASK;
-            uint32_t new_pte = new_physical_frame | new_pte_flag;
-
-            uint32_t virtual_addr = ((uint32_t)i << 22) | ((uint32_t)j << 12);
-            write_physical(new_physical_frame, (void *)virtual_addr, PAGE_SIZE);
-            new_page_tab[j] = new_pte;
+            page_t *page = FRAME_TO_PAGE(old_pte & PAGE_ALIGN_MASK);
+            if (!(page->flags & PAGE_KERNEL)) {
+                page->refcount++;
+                page->owner = NULL;
+                if (old_pte & PTE_WRITE) {
+                    old_pte = (old_pte & ~PTE_WRITE) | PTE_COW;
+                    old_page_tab[j] = old_pte;
+                    tlb_gather_page(&gather, INDEX_TO_ADDR(i, j));
+                }
+            }
+            new_page_tab[j] = old_pte;
         }
-        if (fail) break;
+        kern_mutex_unlock(&page_ref_mutex);
     }
+
+    /* the parent may still have writable translations cached in the TLB */
+    tlb_gather_flush(&gather);
+
     if (fail) {
         page_dir_clear(new_page_dir);
         return -1;
@@ -260,43 +1292,540 @@ int page_dir_copy(uint32_t *new_page_dir, uint32_t *old_page_dir) {
     return 0;
 }
 
-// maps RW_PHYS_VA to physical address addr
-void access_physical(uint32_t addr) {
-    asm_page_inval((void *)RW_PHYS_VA);
-    uint32_t entry = addr & PAGE_ALIGN_MASK;
-    set_pte(RW_PHYS_VA, entry, PTE_WRITE | PTE_PRESENT);
+/**
+ * Resolves a write fault on a copy-on-write page in the current address
+ * space. If the frame is no longer shared it is simply made writable again,
+ * otherwise the page is copied into a new frame reserved during fork. Must
+ * be called with the task's vm_mutex held, or two threads faulting on the
+ * same page would both copy it and one of their writes would be lost.
+ * @param  addr  faulting virtual address
+ * @return       0 if the fault was resolved, -1 if the page is not COW or
+ *               no frame is left for the copy
+ */
+int cow_fault(uint32_t addr) {
+    kern_mutex_t *lock = FRAME_TO_PAGE(get_cr3())->owner;
+    assert(lock == NULL || lock->mutex_holder == (void *)get_cur_tcb());
+
+    uint32_t pte = get_pte(addr);
+    if (!(pte & PTE_PRESENT) || !(pte & PTE_COW)) return -1;
+    if (get_pde(addr) & PDE_PAGE_SIZE) return cow_fault_large(addr);
+
+    uint32_t page_addr = addr & PAGE_ALIGN_MASK;
+    uint32_t frame = pte & PAGE_ALIGN_MASK;
+    int flags = ((pte & PAGE_FLAG_MASK) & ~PTE_COW) | PTE_WRITE;
+
+    if (get_frame_ref(frame) == 1) {
+        /* every other sharer already took its own copy */
+        FRAME_TO_PAGE(frame)->flags &= ~PAGE_MERGED;
+        FRAME_TO_PAGE(frame)->owner = (void *)get_cr3();
+        set_pte(page_addr, frame, flags);
+    } else {
+        /* the reservation was made in fork, and the frame is overwritten */
+        uint32_t new_frame = alloc_frames(0);
+        if (new_frame == 0) return -1;
+        copy_frame(new_frame, frame);
+        set_pte(page_addr, new_frame, flags);
+        put_frame(frame);
+    }
+    asm_page_inval((void *)page_addr);
+    return 0;
 }
 
-void read_physical(void *virtual_dest, uint32_t phys_src, uint32_t n) {
-    kern_mutex_lock(&first_free_frame_mutex);
+/**
+ * Resolves a write fault on a copy-on-write large page. A private copy is
+ * made in a new 4MB block if one is free; otherwise the page is broken up
+ * into 4KB pages, all copied at once into the frames reserved during fork.
+ * @param  addr  faulting virtual address
+ * @return       0 if the fault was resolved, -1 if out of kernel memory
+ */
+static int cow_fault_large(uint32_t addr) {
+    uint32_t *page_dir = (uint32_t *)get_cr3();
+    int pd_index = PD_INDEX(addr);
+    uint32_t pde = page_dir[pd_index];
+    uint32_t frame = pde & LARGE_PAGE_MASK;
+    uint32_t flags = ((pde & PAGE_FLAG_MASK) & ~PTE_COW) | PTE_WRITE;
+    int i;
+
+    if (get_frame_ref(frame) == 1) {
+        FRAME_TO_PAGE(frame)->owner = (void *)page_dir;
+        page_dir[pd_index] = frame | flags;
+    } else {
+        uint32_t new_frame = alloc_frames(LARGE_PAGE_ORDER);
+        if (new_frame != 0) {
+            for (i = 0; i < FRAMES_PER_LARGE_PAGE; i++) {
+                copy_frame(new_frame + i * PAGE_SIZE, frame + i * PAGE_SIZE);
+            }
+            page_dir[pd_index] = new_frame | flags;
+        } else {
+            frame_batch_t batch;
+            if (get_frames_batch(&batch, FRAMES_PER_LARGE_PAGE) < 0) return -1;
+            uint32_t *page_tab = page_tab_alloc(page_dir);
+            if (page_tab == NULL) {
+                free_frames_batch(&batch);
+                return -1;
+            }
+            FRAME_TO_PAGE((uint32_t)page_tab)->refcount = NUM_PT_ENTRIES;
+            for (i = 0; i < FRAMES_PER_LARGE_PAGE; i++) {
+                new_frame = frame_batch_pop(&batch);
+                copy_frame(new_frame, frame + i * PAGE_SIZE);
+                page_tab[i] = new_frame | (flags & ~PDE_PAGE_SIZE);
+            }
+            page_dir[pd_index] =
+                (uint32_t)page_tab | PTE_USER | PTE_WRITE | PTE_PRESENT;
+        }
+        put_frame(frame);
+    }
+    asm_page_inval((void *)(addr & LARGE_PAGE_MASK));
+    return 0;
+}
 
-    access_physical(phys_src);
+/**
+ * Points a kmap slot at a frame.
+ * @param  slot  slot index
+ * @param  frame physical address of the frame
+ * @return       virtual address of the slot
+ */
+static void *kmap_slot(int slot, uint32_t frame) {
+    uint32_t addr = KMAP_VA_LOW + slot * PAGE_SIZE;
+    kmap_page_tab[PT_INDEX(addr)] =
+        (frame & PAGE_ALIGN_MASK) | PTE_WRITE | PTE_PRESENT;
+    return (void *)addr;
+}
+
+/**
+ * Clears a kmap slot and drops its stale translation.
+ * @param slot slot index
+ */
+static void kunmap_slot(int slot) {
+    uint32_t addr = KMAP_VA_LOW + slot * PAGE_SIZE;
+    kmap_page_tab[PT_INDEX(addr)] = 0;
+    asm_page_inval((void *)addr);
+}
+
+/**
+ * Temporarily maps a physical frame into the kmap area, which is present in
+ * every address space, so it can be used without switching cr3. Blocks while
+ * all slots are in use. With the direct map this is just pointer arithmetic.
+ * A thread must not call kmap() again while holding a slot; use copy_frame()
+ * to map two frames at once.
+ * @param  frame physical address of the frame
+ * @return       virtual address the frame is mapped at
+ */
+void *kmap(uint32_t frame) {
+    if (direct_map_low != 0) {
+        return (void *)(direct_map_low + (frame & PAGE_ALIGN_MASK));
+    }
+    kern_sem_wait(&kmap_sem);
+
+    spin_lock(&kmap_lock);
+    int slot = 0;
+    while (kmap_slots_used & (1 << slot)) slot++;
+    kmap_slots_used |= 1 << slot;
+    spin_unlock(&kmap_lock);
+
+    return kmap_slot(slot, frame);
+}
+
+/**
+ * Releases a slot taken by kmap().
+ * @param addr the address returned by kmap()
+ */
+void kunmap(void *addr) {
+    if (direct_map_low != 0) return;
+    int slot = ((uint32_t)addr - KMAP_VA_LOW) / PAGE_SIZE;
+    assert(slot >= 0 && slot < KMAP_IDLE_SLOT);
+    kunmap_slot(slot);
+
+    spin_lock(&kmap_lock);
+    kmap_slots_used &= ~(1 << slot);
+    spin_unlock(&kmap_lock);
+
+    kern_sem_signal(&kmap_sem);
+}
+
+/**
+ * Copies the contents of one frame into another, with both mapped at once.
+ * Taking the second slot while holding the first could deadlock against
+ * other such threads, so that part is serialized by kmap_pair_mutex.
+ * @param dest physical address of the destination frame
+ * @param src  physical address of the source frame
+ */
+void copy_frame(uint32_t dest, uint32_t src) {
+    if (direct_map_low != 0) {
+        memcpy(kmap(dest), kmap(src), PAGE_SIZE);
+        return;
+    }
+    kern_mutex_lock(&kmap_pair_mutex);
+    void *src_addr = kmap(src);
+    void *dest_addr = kmap(dest);
+    kern_mutex_unlock(&kmap_pair_mutex);
+
+    memcpy(dest_addr, src_addr, PAGE_SIZE);
+
+    kunmap(dest_addr);
+    kunmap(src_addr);
+}
+
+void read_physical(void *virtual_dest, uint32_t phys_src, uint32_t n) {
+    void *addr = kmap(phys_src);
     uint32_t page_offset = phys_src & ~PAGE_ALIGN_MASK;
 
     int len;
     if (page_offset + n < PAGE_SIZE) len = n;
     else len = PAGE_SIZE - page_offset;
 
-    uint32_t virtual_src = RW_PHYS_VA + page_offset;
-    memcpy(virtual_dest, (void *)virtual_src, len);
-
-    kern_mutex_unlock(&first_free_frame_mutex);
+    memcpy(virtual_dest, (char *)addr + page_offset, len);
+    kunmap(addr);
 }
 
 void write_physical(uint32_t phys_dest, void *virtual_src, uint32_t n) {
-    kern_mutex_lock(&first_free_frame_mutex);
-
-    access_physical(phys_dest);
+    void *addr = kmap(phys_dest);
     uint32_t page_offset = (uint32_t)virtual_src & ~PAGE_ALIGN_MASK;
 
     int len;
     if (page_offset + n < PAGE_SIZE) len = n;
     else len = PAGE_SIZE - page_offset;
 
-    uint32_t virtual_dest = RW_PHYS_VA + page_offset;
-    memcpy((void *)virtual_dest, virtual_src, len);
+    memcpy((char *)addr + page_offset, virtual_src, len);
+    kunmap(addr);
+}
+
+/**
+ * Looks for private pages with the same contents as other pages, so that
+ * they can share one frame. Called by the boot CPU's idle thread, it scans a
+ * batch of frames and returns, and never blocks: each page is handled with
+ * the scheduler locked, so that no mutex changes hands meanwhile, and skipped
+ * if a mutex it needs is held. Comparing two frames needs the direct map, so
+ * nothing is merged without it.
+ *
+ * Pages of zeroes are mapped to the ZFOD frame. Other pages are hashed and
+ * looked up in a table of merged frames, then in a table of pages seen
+ * before. A page matching one of those is mapped read-only and
+ * copy-on-write to the same frame, and its own frame is freed. A write to
+ * it goes through cow_fault(), which breaks the sharing again.
+ */
+void merge_scan(void) {
+    if (direct_map_low == 0) return;
+
+    int i;
+    for (i = 0; i < MERGE_SCAN_BATCH; i++) {
+        sche_lock();
+        if (page_ref_mutex.is_locked || free_areas_mutex.is_locked) {
+            sche_unlock();
+            return;
+        }
+        page_t *page = &pages[merge_hand];
+        if (++merge_hand == num_pages) merge_hand = NUM_KERN_PAGES;
+        merge_page(page);
+        sche_unlock();
+    }
+}
+
+/**
+ * Merges one page with an identical page, if there is one, or remembers it
+ * for later. Must be called with the scheduler locked.
+ * @param page the page
+ */
+static void merge_page(page_t *page) {
+    uint32_t *pte_ptr = evict_candidate(page);
+    if (pte_ptr == NULL) return;
+
+    uint32_t frame = PAGE_TO_FRAME(page);
+    uint32_t *data = (uint32_t *)(direct_map_low + frame);
+    uint32_t *page_dir = page->owner;
+    uint32_t vaddr = page->vaddr;
+    int current = ((uint32_t)page_dir == get_cr3());
+    uint32_t flags = *pte_ptr & PAGE_FLAG_MASK &
+                     ~(PTE_WRITE | PTE_ACCESSED | PTE_DIRTY);
+
+    uint32_t hash = page_hash(data);
+    if (hash == 0) {
+        /* the hash of a page is 0 exactly when it holds only zeroes */
+        *pte_ptr = zfod_frame | (flags & ~PTE_COW);
+        if (current) asm_page_inval((void *)vaddr);
+        merge_release(page);
+        zero_merges++;
+        return;
+    }
+
+    int index = hash % MERGE_TABLE_SIZE;
+    merge_entry_t *stable = &merge_stable[index];
+    if (stable->frame != 0 && stable->hash == hash &&
+            (FRAME_TO_PAGE(stable->frame)->flags & PAGE_MERGED) &&
+            memcmp((void *)(direct_map_low + stable->frame), data,
+                   PAGE_SIZE) == 0) {
+        FRAME_TO_PAGE(stable->frame)->refcount++;
+        *pte_ptr = stable->frame | flags | PTE_COW;
+        if (current) asm_page_inval((void *)vaddr);
+        merge_release(page);
+        return;
+    }
+
+    merge_entry_t *unstable = &merge_unstable[index];
+    if (unstable->frame != 0 && unstable->frame != frame &&
+            unstable->hash == hash) {
+        page_t *other = FRAME_TO_PAGE(unstable->frame);
+        uint32_t *other_pte = evict_candidate(other);
+        if (other_pte != NULL && other->owner == unstable->page_dir &&
+                other->vaddr == unstable->vaddr &&
+                memcmp((void *)(direct_map_low + unstable->frame), data,
+                       PAGE_SIZE) == 0) {
+            /* the page seen before becomes the shared frame */
+            *other_pte &= ~(PTE_WRITE | PTE_ACCESSED | PTE_DIRTY);
+            *other_pte |= PTE_COW;
+            if ((uint32_t)other->owner == get_cr3()) {
+                asm_page_inval((void *)other->vaddr);
+            }
+            other->flags |= PAGE_MERGED;
+            other->owner = NULL;
+            other->refcount++;
+
+            *pte_ptr = unstable->frame | flags | PTE_COW;
+            if (current) asm_page_inval((void *)vaddr);
+            merge_release(page);
+
+            *stable = *unstable;
+            unstable->frame = 0;
+            return;
+        }
+    }
+
+    unstable->frame = frame;
+    unstable->hash = hash;
+    unstable->page_dir = page_dir;
+    unstable->vaddr = vaddr;
+}
+
+/**
+ * Frees the frame of a page that was merged away. Must be called with the
+ * scheduler locked, while free_areas_mutex is not locked.
+ * @param page the page, no longer mapped anywhere
+ */
+static void merge_release(page_t *page) {
+    page->refcount = 0;
+    page->owner = NULL;
+    free_area_merge(page, 0);
+}
+
+/**
+ * Hashes the contents of a page, one word at a time.
+ * @param  data the page
+ * @return      the hash, which is 0 only for a page of zeroes
+ */
+static uint32_t page_hash(const uint32_t *data) {
+    uint32_t hash = 0;
+    int i;
+    for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+        hash = (hash ^ data[i]) * 16777619;
+    }
+    if (hash == 0) {
+        /* make room for the hash of the zero page */
+        for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+            if (data[i] != 0) return 1;
+        }
+    }
+    return hash;
+}
+
+/**
+ * Registers the mutex a task holds while it changes the user mappings of its
+ * address space. The reclaim scanner leaves the pages of an address space
+ * alone while its mutex is locked.
+ * @param page_dir page directory returned by page_dir_init()
+ * @param lock     the task's mutex
+ */
+void vm_set_page_dir_lock(uint32_t *page_dir, kern_mutex_t *lock) {
+    FRAME_TO_PAGE((uint32_t)page_dir)->owner = lock;
+}
+
+/**
+ * Brings a swapped out page of the current address space back into a new
+ * frame, reserving the frame first.
+ * @param  addr  faulting virtual address, whose entry must be swapped out
+ * @return       0 as success, -1 if no frame could be reserved or taken
+ */
+int swap_in_page(uint32_t addr) {
+    uint32_t page_addr = addr & PAGE_ALIGN_MASK;
+    uint32_t pte = get_pte(page_addr);
+    assert(!(pte & PTE_PRESENT) && (pte & PTE_SWAPPED));
+
+    if (dec_num_free_frames(1) < 0) return -1;
+    uint32_t frame = alloc_frames(0);
+    if (frame == 0) {
+        inc_num_free_frames(1);
+        return -1;
+    }
+
+    int slot = PTE_TO_SLOT(pte);
+    void *dest = kmap(frame);
+    swap_load(slot, dest);
+    kunmap(dest);
+
+    /* the page table is still there, since the entry is not zero */
+    int flags = (pte & PAGE_FLAG_MASK & ~PTE_SWAPPED) | PTE_PRESENT;
+    set_pte(page_addr, frame, flags);
+    swap_put(slot);
+    swap_count_refault();
+    return 0;
+}
+
+/**
+ * Evicts up to n cold pages of user memory into the compressed swap store,
+ * giving their frames and reservations back. Frames are visited in order
+ * like the hand of a clock: a page whose accessed bit is set has the bit
+ * cleared and gets another round, and a page whose bit is still clear the
+ * next time the hand comes by is evicted.
+ * @param  n  number of frames wanted
+ * @return    number of pages evicted
+ */
+static int reclaim_frames(int n) {
+    int evicted = 0;
+    int scanned;
+    /* two sweeps are enough to clear every accessed bit and come back */
+    int max_scan = 2 * (num_pages - NUM_KERN_PAGES);
+
+    kern_mutex_lock(&reclaim_mutex);
+    for (scanned = 0; scanned < max_scan && evicted < n; scanned++) {
+        page_t *page = &pages[clock_hand];
+        if (++clock_hand == num_pages) clock_hand = NUM_KERN_PAGES;
+        if (evict_page(page) == 0) evicted++;
+    }
+    kern_mutex_unlock(&reclaim_mutex);
+
+    if (evicted > 0) inc_num_free_frames(evicted);
+    return evicted;
+}
+
+/**
+ * Ages a page, or evicts it if it was not accessed since the last visit.
+ * The page is compressed with the scheduler unlocked after clearing its
+ * dirty bit, and only replaced by its swap entry if it is still mapped the
+ * same way and was not written in the meantime.
+ * @param  page  the page
+ * @return       0 if the page was evicted, -1 otherwise
+ */
+static int evict_page(page_t *page) {
+    uint32_t frame = PAGE_TO_FRAME(page);
+
+    sche_lock();
+    uint32_t *pte_ptr = evict_candidate(page);
+    if (pte_ptr == NULL) {
+        sche_unlock();
+        return -1;
+    }
+    uint32_t *page_dir = page->owner;
+    uint32_t vaddr = page->vaddr;
+    uint32_t pte = *pte_ptr;
+    if (pte & PTE_ACCESSED) {
+        *pte_ptr = pte & ~PTE_ACCESSED;
+    } else {
+        *pte_ptr = pte & ~PTE_DIRTY;
+    }
+    /* other address spaces have no cached translations */
+    if ((uint32_t)page_dir == get_cr3()) asm_page_inval((void *)vaddr);
+    sche_unlock();
+    if (pte & PTE_ACCESSED) return -1;
+
+    void *src = kmap(frame);
+    int slot = swap_store(src);
+    kunmap(src);
+    if (slot < 0) return -1;
 
-    kern_mutex_unlock(&first_free_frame_mutex);
+    sche_lock();
+    pte_ptr = evict_candidate(page);
+    if (pte_ptr == NULL || page->owner != page_dir || page->vaddr != vaddr ||
+            (*pte_ptr & PTE_DIRTY)) {
+        sche_unlock();
+        swap_put(slot);
+        return -1;
+    }
+    pte = *pte_ptr;
+    *pte_ptr = SLOT_TO_PTE(slot) | PTE_SWAPPED |
+               (pte & PAGE_FLAG_MASK & ~(PTE_PRESENT | PTE_ACCESSED));
+    if ((uint32_t)page_dir == get_cr3()) asm_page_inval((void *)vaddr);
+    page->owner = NULL;
+    sche_unlock();
+
+    put_frame(frame);
+    swap_count_eviction();
+    return 0;
+}
+
+/**
+ * Checks whether a page may be evicted: it must be a private 4KB page of
+ * anonymous memory, still mapped where it was last mapped, in an address
+ * space whose task is not changing its mappings, and which no other CPU has
+ * loaded, since its TLB could not be flushed. Must be called with the
+ * scheduler locked.
+ * @param  page  the page
+ * @return       the page table entry mapping the page, or NULL
+ */
+static uint32_t *evict_candidate(page_t *page) {
+    if (page->flags & (PAGE_FREE | PAGE_KERNEL)) return NULL;
+    if (page->order != 0 || page->refcount != 1) return NULL;
+
+    uint32_t *page_dir = page->owner;
+    if (page_dir == NULL) return NULL;
+    kern_mutex_t *lock = FRAME_TO_PAGE((uint32_t)page_dir)->owner;
+    if (lock == NULL || lock->is_locked) return NULL;
+    if (page_dir_loaded_elsewhere(page_dir)) return NULL;
+
+    uint32_t pde = page_dir[PD_INDEX(page->vaddr)];
+    if (!(pde & PDE_PRESENT) || (pde & PDE_PAGE_SIZE)) return NULL;
+    if (kern_page_dir[PD_INDEX(page->vaddr)] & PDE_PRESENT) return NULL;
+
+    uint32_t *pte_ptr = (uint32_t *)ENTRY_TO_ADDR(pde) + PT_INDEX(page->vaddr);
+    uint32_t pte = *pte_ptr;
+    if (!(pte & PTE_PRESENT)) return NULL;
+    if ((pte & PAGE_ALIGN_MASK) != PAGE_TO_FRAME(page)) return NULL;
+    /* read-only program pages are left to the page cache */
+    if (!(pte & (PTE_WRITE | PTE_COW))) return NULL;
+    return pte_ptr;
+}
+
+/**
+ * Counts a page fault handled by demand_fault().
+ * @param num_around the number of pages mapped ahead of the faulting one
+ */
+void vm_count_demand_fault(int num_around) {
+    spin_lock(&vm_stats_lock);
+    demand_faults++;
+    fault_around_pages += num_around;
+    spin_unlock(&vm_stats_lock);
+}
+
+/**
+ * Checks whether another CPU has an address space loaded.
+ * Must be called with the scheduler locked.
+ * @param  page_dir the page directory
+ * @return          1 if it is loaded on another CPU, 0 otherwise
+ */
+static int page_dir_loaded_elsewhere(uint32_t *page_dir) {
+    int self = smp_get_cpu();
+    int cpu;
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (cpu != self && loaded_page_dirs[cpu] == page_dir) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Switches to another address space for a context switch. cr3 is only
+ * reloaded, flushing the non-global TLB entries, if the page directory is not
+ * loaded already. Must be called with the scheduler locked, or while booting.
+ * @param page_dir the page directory to switch to, or NULL to keep the
+ *                 current one for a thread that only uses kernel memory
+ */
+void vm_switch_page_dir(uint32_t *page_dir) {
+    spin_lock(&vm_stats_lock);
+    if (page_dir == NULL || get_cr3() == (uint32_t)page_dir) {
+        cr3_loads_avoided++;
+    } else {
+        cr3_loads++;
+        set_cr3((uint32_t)page_dir);
+    }
+    spin_unlock(&vm_stats_lock);
+    loaded_page_dirs[smp_get_cpu()] = (uint32_t *)get_cr3();
 }
 
 uint32_t *get_kern_page_dir(void) {
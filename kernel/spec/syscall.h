@@ -75,6 +75,17 @@ int readfile(char *filename, char *buf, int count, int offset);
 /* "Special" */
 void misbehave(int mode);
 
+/* Kernel extensions */
+#include <vm_stats.h>
+int get_vm_stats(vm_stats_t *stats);
+int map_file(char *filename, void *base);
+int grow_pages(void *base, int len);
+int remove_pages_range(void *base, int len);
+/* priority hints for set_priority(), from most to least favoured */
+#define PRIORITY_HIGH 0
+#define PRIORITY_LOW 3
+int set_priority(int priority);
+
 /* Project 4 F2010 */
 #include <ureg.h> /* may be directly included by kernel guts */
 typedef void (*swexn_handler_t)(void *arg, ureg_t *ureg);
@@ -0,0 +1,77 @@
+/** @file vm_stats.h
+ *  @brief Physical memory statistics shared by the kernel and user programs.
+ *  @author Newton Xie (ncx)
+ *  @author Qiaoyu Deng (qdeng)
+ *  @bug No known bugs.
+ */
+
+#ifndef _VM_STATS_H_
+#define _VM_STATS_H_
+
+/* buddy block orders reported, from one frame (0) up to 4MB (10) */
+#define VM_STATS_ORDERS 11
+
+/** @brief  Snapshot of the kernel's physical memory state.
+ *
+ *  free_frames counts frames sitting in the buddy allocator, while
+ *  unreserved_frames counts frames that no task has reserved yet.
+ *  free_blocks[k] is the number of free blocks of 2^k contiguous frames.
+ *  The zero pool holds free frames cleared ahead of time by the idle thread,
+ *  which are not counted as unreserved while they sit there; hits and misses
+ *  count single frame allocations served from it or not.
+ *  Every context switch either reloads cr3, flushing the user part of the
+ *  TLB, or avoids it because the address space is still loaded.
+ *  demand_faults counts faults on untouched or swapped out pages, which
+ *  also mapped fault_around_pages pages following the faulting ones.
+ *  Bulk unmaps and write-protects invalidate stale TLB entries either page
+ *  by page (tlb_page_invals) or with one full flush (tlb_full_flushes), and
+ *  tlb_flushes_avoided counts the page invalidations saved by doing so.
+ *  page_tables is the number of page table pages used by the calling task.
+ *  Read-only program pages are shared through a page cache of
+ *  page_cache_frames frames, or mapped straight from the kernel's copy of
+ *  the program image (page_cache_direct faults) where it is page aligned.
+ *  Under memory pressure cold pages are evicted into a compressed store of
+ *  swap_pages pages taking swap_bytes bytes, and swap_refaults counts the
+ *  pages faulted back in. Identical private pages found in idle time share
+ *  one of merged_frames read-only frames, mapped merged_pages times between
+ *  them, and zero_merges pages of zeroes were mapped to the ZFOD frame.
+ *  Region lookups by the calling task are answered from its lookup cache
+ *  (maps_cache_hits) or by walking its region tree (maps_cache_misses).
+ *  Threads run on cpus_online CPUs, and threads_stolen counts the threads a
+ *  CPU with nothing to run took from a busier one.
+ */
+typedef struct vm_stats {
+    int total_frames;
+    int free_frames;
+    int unreserved_frames;
+    int largest_free_order;
+    int free_blocks[VM_STATS_ORDERS];
+    int zero_pool_frames;
+    unsigned int zero_pool_hits;
+    unsigned int zero_pool_misses;
+    unsigned int cr3_loads;
+    unsigned int cr3_loads_avoided;
+    unsigned int demand_faults;
+    unsigned int fault_around_pages;
+    unsigned int tlb_full_flushes;
+    unsigned int tlb_page_invals;
+    unsigned int tlb_flushes_avoided;
+    int page_tables;
+    int page_tables_cached;
+    int page_cache_frames;
+    unsigned int page_cache_hits;
+    unsigned int page_cache_direct;
+    int swap_pages;
+    int swap_bytes;
+    unsigned int swap_evictions;
+    unsigned int swap_refaults;
+    int merged_frames;
+    int merged_pages;
+    unsigned int zero_merges;
+    unsigned int maps_cache_hits;
+    unsigned int maps_cache_misses;
+    int cpus_online;
+    unsigned int threads_stolen;
+} vm_stats_t;
+
+#endif /* _VM_STATS_H_ */
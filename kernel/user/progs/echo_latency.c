@@ -0,0 +1,103 @@
+/**
+ * @file   echo_latency.c
+ * @brief  Measures how quickly an interactive task is served while N CPU
+ *         bound spinners run. Each round trip wakes a helper that answers
+ *         at once, as a shell waking up for a keystroke would, and waits for
+ *         it; with a single FIFO run queue every wakeup waits behind all the
+ *         spinners. The last column has the spinners hint PRIORITY_LOW.
+ * @author Qiaoyu Deng (qdeng)
+ * @bug    No known bugs
+ */
+
+#include <syscall.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define ROUNDS 20
+#define MAX_SPINNERS 8
+/* ticks the spinners get to settle into the lower levels first */
+#define SETTLE_TICKS 50
+
+/**
+ * Starts spinners that burn CPU until the deadline.
+ * @return 0 as success, -1 if fork failed
+ */
+static int start_spinners(int num, int priority, unsigned int deadline) {
+    int i;
+    for (i = 0; i < num; i++) {
+        int tid = fork();
+        if (tid < 0) return -1;
+        if (tid == 0) {
+            set_priority(priority);
+            while (get_ticks() < deadline) continue;
+            exit(0);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Times round trips to a helper task.
+ * @param total     set to the total ticks of all round trips
+ * @param max_ticks set to the slowest round trip
+ * @param reaped    incremented for each spinner reaped on the way
+ * @return 0 as success, -1 if fork failed
+ */
+static int round_trips(unsigned int *total, unsigned int *max_ticks,
+                       int *reaped) {
+    int i;
+    int status;
+
+    *total = 0;
+    *max_ticks = 0;
+    for (i = 0; i < ROUNDS; i++) {
+        unsigned int start = get_ticks();
+        int tid = fork();
+        if (tid < 0) return -1;
+        if (tid == 0) exit(0);
+        /* a spinner that already hit its deadline may come first */
+        while (wait(&status) != tid) (*reaped)++;
+        unsigned int ticks = get_ticks() - start;
+        *total += ticks;
+        if (ticks > *max_ticks) *max_ticks = ticks;
+    }
+    return 0;
+}
+
+/**
+ * Runs one measurement with num spinners.
+ * @return 0 as success, -1 as failure
+ */
+static int measure(int num, int priority, unsigned int *total,
+                   unsigned int *max_ticks) {
+    /* generous enough for a FIFO scheduler to get through the rounds */
+    unsigned int deadline = get_ticks() + SETTLE_TICKS +
+                            ROUNDS * (2 * num + 4) * 2;
+    int status;
+    int reaped = 0;
+
+    if (start_spinners(num, priority, deadline) < 0) return -1;
+    sleep(SETTLE_TICKS);
+    int ret = round_trips(total, max_ticks, &reaped);
+    for (; reaped < num; reaped++) wait(&status);
+    return ret;
+}
+
+int main() {
+    int num;
+
+    printf("spinners  avg ticks  max ticks  avg ticks (spinners low)\n");
+    for (num = 0; num <= MAX_SPINNERS; num = (num == 0) ? 1 : num * 2) {
+        unsigned int total, max_ticks, low_total, low_max;
+        if (measure(num, PRIORITY_HIGH, &total, &max_ticks) < 0 ||
+                measure(num, PRIORITY_LOW, &low_total, &low_max) < 0) {
+            printf("fork failed\n");
+            return -1;
+        }
+        printf("%8d  %5u.%02u  %9u  %8u.%02u\n", num,
+               total / ROUNDS, total * 100 / ROUNDS % 100, max_ticks,
+               low_total / ROUNDS, low_total * 100 / ROUNDS % 100);
+    }
+
+    return 0;
+}
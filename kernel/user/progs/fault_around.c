@@ -0,0 +1,99 @@
+/**
+ * @file   fault_around.c
+ * @brief  Measures demand faults per megabyte of fresh new_pages() memory
+ *         for a few access patterns. Without fault-around every touched page
+ *         takes its own fault, which is the "before" column; sequential walks
+ *         should need far fewer once the fault-around window has widened.
+ * @author Qiaoyu Deng (qdeng)
+ * @bug    No known bugs
+ */
+
+#include <syscall.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define HEAP_BASE 0x40000000
+#define MEGABYTE (1024 * 1024)
+/* regions are kept under 4MB so that writes never get a large page */
+#define NUM_REGIONS 4
+#define PAGES_PER_MB (MEGABYTE / PAGE_SIZE)
+#define STRIDE_PAGES 8
+
+#define SEQ_WRITE 0
+#define SEQ_READ 1
+#define REVERSE_WRITE 2
+#define STRIDED_WRITE 3
+#define NUM_PATTERNS 4
+
+/* keeps the reads of the sequential read walk */
+static volatile int sink;
+
+static const char *names[NUM_PATTERNS] = {
+    "sequential write", "sequential read", "reverse write", "strided write"
+};
+
+/**
+ * Touches one megabyte region with the given pattern.
+ * @return the number of pages touched
+ */
+static int walk(volatile char *region, int pattern) {
+    int page;
+    int touched = 0;
+
+    switch (pattern) {
+    case SEQ_WRITE:
+        for (page = 0; page < PAGES_PER_MB; page++, touched++)
+            region[page * PAGE_SIZE] = 1;
+        break;
+    case SEQ_READ:
+        for (page = 0; page < PAGES_PER_MB; page++, touched++)
+            sink += region[page * PAGE_SIZE];
+        break;
+    case REVERSE_WRITE:
+        for (page = PAGES_PER_MB - 1; page >= 0; page--, touched++)
+            region[page * PAGE_SIZE] = 1;
+        break;
+    case STRIDED_WRITE:
+        for (page = 0; page < PAGES_PER_MB; page += STRIDE_PAGES, touched++)
+            region[page * PAGE_SIZE] = 1;
+        break;
+    }
+
+    return touched;
+}
+
+int main() {
+    vm_stats_t before;
+    vm_stats_t after;
+    int pattern;
+
+    printf("pattern           pages/MB  faults/MB before  faults/MB after  "
+           "ticks\n");
+    for (pattern = 0; pattern < NUM_PATTERNS; pattern++) {
+        char *base = (char *)HEAP_BASE;
+        int i;
+        for (i = 0; i < NUM_REGIONS; i++) {
+            if (new_pages(base + i * MEGABYTE, MEGABYTE) < 0) {
+                printf("new_pages failed\n");
+                return -1;
+            }
+        }
+
+        int touched = 0;
+        get_vm_stats(&before);
+        unsigned int start = get_ticks();
+        for (i = 0; i < NUM_REGIONS; i++)
+            touched += walk(base + i * MEGABYTE, pattern);
+        unsigned int ticks = get_ticks() - start;
+        get_vm_stats(&after);
+
+        printf("%-16s  %8d  %16d  %15u  %5u\n", names[pattern],
+               touched / NUM_REGIONS, touched / NUM_REGIONS,
+               (after.demand_faults - before.demand_faults) / NUM_REGIONS,
+               ticks);
+
+        for (i = 0; i < NUM_REGIONS; i++) remove_pages(base + i * MEGABYTE);
+    }
+
+    return 0;
+}
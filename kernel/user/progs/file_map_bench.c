@@ -0,0 +1,73 @@
+/**
+ * @file   file_map_bench.c
+ * @brief  Compares reading a file with readfile() against mapping it with
+ *         map_file(). The file (this program, by default) is read NUM_PASSES
+ *         times each way, and the mapped bytes are checked against the ones
+ *         read.
+ * @author Qiaoyu Deng (qdeng)
+ * @bug    No known bugs
+ */
+
+#include <syscall.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAP_BASE 0x40000000
+#define CHUNK_SIZE PAGE_SIZE
+#define NUM_PASSES 20
+
+static char chunk[CHUNK_SIZE];
+
+int main(int argc, char **argv) {
+    char *filename = argc > 1 ? argv[1] : "file_map_bench";
+    int pass;
+    int offset;
+    int ret;
+    unsigned int sum = 0;
+
+    unsigned int start = get_ticks();
+    for (pass = 0; pass < NUM_PASSES; pass++) {
+        offset = 0;
+        while ((ret = readfile(filename, chunk, CHUNK_SIZE, offset)) > 0) {
+            sum += chunk[ret - 1];
+            offset += ret;
+        }
+        if (ret < 0) {
+            printf("readfile failed on %s\n", filename);
+            return -1;
+        }
+    }
+    unsigned int read_ticks = get_ticks() - start;
+    int len = offset;
+
+    start = get_ticks();
+    for (pass = 0; pass < NUM_PASSES; pass++) {
+        char *file = (char *)MAP_BASE;
+        if (map_file(filename, file) != len) {
+            printf("map_file failed on %s\n", filename);
+            return -1;
+        }
+        for (offset = 0; offset < len; offset += CHUNK_SIZE) {
+            int end = offset + CHUNK_SIZE < len ? offset + CHUNK_SIZE : len;
+            sum += file[end - 1];
+        }
+        if (pass == 0) {
+            /* the mapping must hold exactly the bytes readfile() returns */
+            for (offset = 0; offset < len; offset += CHUNK_SIZE) {
+                ret = readfile(filename, chunk, CHUNK_SIZE, offset);
+                if (memcmp(chunk, file + offset, ret) != 0) {
+                    printf("mapped bytes differ at offset %d\n", offset);
+                    return -1;
+                }
+            }
+        }
+        remove_pages(file);
+    }
+    unsigned int map_ticks = get_ticks() - start;
+
+    printf("%s: %d bytes, %d passes\n", filename, len, NUM_PASSES);
+    printf("readfile: %u ticks, map_file: %u ticks (checksum %u)\n",
+           read_ticks, map_ticks, sum);
+    return 0;
+}
@@ -0,0 +1,54 @@
+/**
+ * @file   fork_latency.c
+ * @brief  Measures fork()+wait() latency while the parent's resident size
+ *         grows. With copy-on-write fork the cost per fork should stay roughly
+ *         flat instead of growing with the number of touched pages.
+ * @author Qiaoyu Deng (qdeng)
+ * @bug    No known bugs
+ */
+
+#include <syscall.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define HEAP_BASE 0x40000000
+#define MAX_MEGABYTES 16
+#define MEGABYTE (1024 * 1024)
+#define NUM_FORKS 100
+
+int main() {
+    int resident;
+    int status;
+
+    printf("resident(MB)  forks  ticks  ticks/100 forks\n");
+    for (resident = 0; resident <= MAX_MEGABYTES; resident += 4) {
+        if (resident > 0) {
+            /* grow the resident set by touching 4MB of fresh memory */
+            char *chunk = (char *)(HEAP_BASE + (resident - 4) * MEGABYTE);
+            if (new_pages(chunk, 4 * MEGABYTE) < 0) {
+                printf("new_pages failed at %dMB\n", resident);
+                return -1;
+            }
+            int offset;
+            for (offset = 0; offset < 4 * MEGABYTE; offset += PAGE_SIZE)
+                chunk[offset] = 1;
+        }
+
+        int i;
+        unsigned int start = get_ticks();
+        for (i = 0; i < NUM_FORKS; i++) {
+            int tid = fork();
+            if (tid == 0) exit(0);
+            if (tid < 0) {
+                printf("fork failed at %dMB\n", resident);
+                return -1;
+            }
+            wait(&status);
+        }
+        unsigned int ticks = get_ticks() - start;
+        printf("%12d  %5d  %5u  %u\n", resident, NUM_FORKS, ticks,
+               ticks * 100 / NUM_FORKS);
+    }
+
+    return 0;
+}
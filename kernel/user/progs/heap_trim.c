@@ -0,0 +1,69 @@
+/**
+ * @file   heap_trim.c
+ * @brief  Checks partial removal with remove_pages_range() and heap regions
+ *         grown with grow_pages(), then frees a large malloc() block to show
+ *         the heap being trimmed: unreserved frames should come back.
+ * @author Qiaoyu Deng (qdeng)
+ * @bug    No known bugs
+ */
+
+#include <syscall.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define BASE ((char *)0x40000000)
+#define BIG_BLOCK (1024 * 1024)
+
+#define CHECK(cond)                                           \
+    do {                                                      \
+        if (!(cond)) {                                        \
+            printf("heap_trim: line %d failed\n", __LINE__);  \
+            return -1;                                        \
+        }                                                     \
+    } while (0)
+
+/**
+ * Gets the number of frames no task has reserved.
+ * @return the number of unreserved frames
+ */
+static int unreserved(void) {
+    vm_stats_t stats;
+    if (get_vm_stats(&stats) < 0) return -1;
+    return stats.unreserved_frames;
+}
+
+int main() {
+    /* a hole in the middle leaves two regions of their own */
+    CHECK(new_pages(BASE, 8 * PAGE_SIZE) == 0);
+    BASE[0] = 1;
+    BASE[5 * PAGE_SIZE] = 1;
+    CHECK(remove_pages_range(BASE + 2 * PAGE_SIZE, 2 * PAGE_SIZE) == 0);
+    CHECK(remove_pages_range(BASE + 2 * PAGE_SIZE, PAGE_SIZE) < 0);
+    CHECK(new_pages(BASE + 2 * PAGE_SIZE, 2 * PAGE_SIZE) == 0);
+    CHECK(remove_pages(BASE + 2 * PAGE_SIZE) == 0);
+    CHECK(BASE[5 * PAGE_SIZE] == 1);
+    CHECK(remove_pages(BASE + 4 * PAGE_SIZE) == 0);
+    CHECK(BASE[0] == 1);
+    CHECK(remove_pages(BASE) == 0);
+
+    /* grown pages join the region below and lose their own start */
+    CHECK(new_pages(BASE, PAGE_SIZE) == 0);
+    CHECK(grow_pages(BASE + PAGE_SIZE, 3 * PAGE_SIZE) == 0);
+    CHECK(remove_pages(BASE + PAGE_SIZE) < 0);
+    CHECK(remove_pages(BASE) == 0);
+    CHECK(new_pages(BASE, 4 * PAGE_SIZE) == 0);
+    CHECK(remove_pages(BASE) == 0);
+
+    int before = unreserved();
+    char *block = malloc(BIG_BLOCK);
+    CHECK(block != NULL);
+    int grown = unreserved();
+    free(block);
+    int after = unreserved();
+
+    printf("unreserved frames: %d before malloc, %d after, %d after free\n",
+           before, grown, after);
+    CHECK(after > grown);
+    printf("heap_trim: passed\n");
+    return 0;
+}
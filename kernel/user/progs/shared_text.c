@@ -0,0 +1,76 @@
+/**
+ * @file   shared_text.c
+ * @brief  Measures resident memory of many concurrent copies of one program.
+ *         Runs NUM_COPIES copies of itself that each touch all of their text
+ *         and rodata, and prints how many frames they use between them. With
+ *         shared read-only pages each copy should only cost its private
+ *         data, bss and stack pages and its page tables.
+ * @author Qiaoyu Deng (qdeng)
+ * @bug    No known bugs
+ */
+
+#include <syscall.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define NUM_COPIES 50
+#define TABLE_SIZE (16 * 1024)
+#define SETTLE_TICKS 200
+#define CHILD_TICKS 1000
+
+/* read-only data every copy touches, 64KB in rodata */
+static const int table[TABLE_SIZE] = { 1, 2, 3 };
+
+static int child(void) {
+    int i;
+    int sum = 0;
+    for (i = 0; i < TABLE_SIZE; i += PAGE_SIZE / sizeof(int)) sum += table[i];
+    sleep(CHILD_TICKS);
+    return sum;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "child") == 0) return child();
+
+    vm_stats_t before;
+    vm_stats_t after;
+    char *args[] = { "shared_text", "child", NULL };
+    int i;
+    int status;
+
+    if (get_vm_stats(&before) < 0) {
+        printf("get_vm_stats failed\n");
+        return -1;
+    }
+
+    for (i = 0; i < NUM_COPIES; i++) {
+        int tid = fork();
+        if (tid == 0) {
+            exec("shared_text", args);
+            exit(-1);
+        }
+        if (tid < 0) {
+            printf("fork failed after %d copies\n", i);
+            return -1;
+        }
+    }
+
+    /* let every copy fault its pages in and go to sleep */
+    sleep(SETTLE_TICKS);
+    get_vm_stats(&after);
+
+    /* frames cleared by the idle thread are still free */
+    int used = (before.free_frames + before.zero_pool_frames) -
+               (after.free_frames + after.zero_pool_frames);
+    printf("%d copies: %d frames resident, %d.%02d frames per copy\n",
+           NUM_COPIES, used, used / NUM_COPIES,
+           (used % NUM_COPIES) * 100 / NUM_COPIES);
+    printf("shared pages: %d frames cached, %u hits, %u mapped in place\n",
+           after.page_cache_frames,
+           after.page_cache_hits - before.page_cache_hits,
+           after.page_cache_direct - before.page_cache_direct);
+
+    for (i = 0; i < NUM_COPIES; i++) wait(&status);
+    return 0;
+}
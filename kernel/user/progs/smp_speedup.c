@@ -0,0 +1,79 @@
+/**
+ * @file   smp_speedup.c
+ * @brief  Measures how well CPU bound work spreads over the CPUs. N workers,
+ *         each a task of its own, do the same fixed amount of work each; on
+ *         a single CPU that takes N times as long as one worker, so the
+ *         speedup is N times the time of one worker over the time of N. The
+ *         threads of one task stay on one CPU, so workers are forked rather
+ *         than created as threads, and start out next to their parent until
+ *         idle CPUs take them.
+ * @author Qiaoyu Deng (qdeng)
+ * @bug    No known bugs
+ */
+
+#include <syscall.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define MAX_WORKERS 8
+/* iterations per worker, a few dozen ticks of work on one CPU */
+#define WORK_LOOPS 20000000
+
+/**
+ * Burns CPU for a fixed number of iterations.
+ * @return a value depending on every iteration
+ */
+static unsigned int work(void) {
+    volatile unsigned int sum = 0;
+    unsigned int i;
+    for (i = 0; i < WORK_LOOPS; i++) sum += i ^ (sum >> 3);
+    return sum;
+}
+
+/**
+ * Runs num workers at once and waits for all of them.
+ * @return the ticks taken, or 0 if fork failed
+ */
+static unsigned int measure(int num) {
+    unsigned int start = get_ticks();
+    int status;
+    int i;
+
+    for (i = 0; i < num; i++) {
+        int tid = fork();
+        if (tid < 0) return 0;
+        if (tid == 0) exit(work() & 1);
+    }
+    for (i = 0; i < num; i++) wait(&status);
+
+    unsigned int ticks = get_ticks() - start;
+    return ticks > 0 ? ticks : 1;
+}
+
+int main() {
+    vm_stats_t before, after;
+    unsigned int one = 0;
+    int num;
+
+    if (get_vm_stats(&before) < 0) return -1;
+    printf("%d cpus\n", before.cpus_online);
+    printf("workers  ticks  speedup\n");
+    for (num = 1; num <= MAX_WORKERS; num *= 2) {
+        unsigned int ticks = measure(num);
+        if (ticks == 0) {
+            printf("fork failed\n");
+            return -1;
+        }
+        if (num == 1) one = ticks;
+
+        /* in hundredths */
+        unsigned int speedup = num * one * 100 / ticks;
+        printf("%7d  %5u  %4u.%02u\n", num, ticks,
+               speedup / 100, speedup % 100);
+    }
+
+    if (get_vm_stats(&after) < 0) return -1;
+    printf("threads stolen: %u\n",
+           after.threads_stolen - before.threads_stolen);
+    return 0;
+}
@@ -0,0 +1,69 @@
+/**
+ * @file   switch_cost.c
+ * @brief  Runs a mix of compute-bound, yielding and sleeping tasks and
+ *         reports, once per second, how many context switches reloaded cr3
+ *         (flushing the user TLB) and how many kept the address space loaded.
+ * @author Qiaoyu Deng (qdeng)
+ * @bug    No known bugs
+ */
+
+#include <syscall.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/* the timer interrupts every 10ms */
+#define TICKS_PER_SECOND 100
+#define NUM_SECONDS 5
+
+/**
+ * Work done by one child until the deadline: 0 spins, 1 yields, 2 sleeps.
+ * @param kind     what kind of work to do
+ * @param deadline tick at which to stop
+ */
+void work(int kind, unsigned int deadline) {
+    volatile int sum = 0;
+    while (get_ticks() < deadline) {
+        if (kind == 0) {
+            int i;
+            for (i = 0; i < 10000; i++) sum += i;
+        } else if (kind == 1) {
+            yield(-1);
+        } else {
+            sleep(1);
+        }
+    }
+}
+
+int main() {
+    unsigned int deadline = get_ticks() + NUM_SECONDS * TICKS_PER_SECOND;
+
+    int kind;
+    for (kind = 0; kind < 6; kind++) {
+        int tid = fork();
+        if (tid == 0) {
+            work(kind % 3, deadline);
+            exit(0);
+        }
+        if (tid < 0) {
+            printf("fork failed\n");
+            return -1;
+        }
+    }
+
+    vm_stats_t before, after;
+    get_vm_stats(&before);
+    printf("second  cr3 loads/s  loads avoided/s\n");
+    int second;
+    for (second = 1; second <= NUM_SECONDS; second++) {
+        sleep(TICKS_PER_SECOND);
+        get_vm_stats(&after);
+        printf("%6d  %11u  %15u\n", second,
+               after.cr3_loads - before.cr3_loads,
+               after.cr3_loads_avoided - before.cr3_loads_avoided);
+        before = after;
+    }
+
+    int status;
+    for (kind = 0; kind < 6; kind++) wait(&status);
+    return 0;
+}
@@ -0,0 +1,71 @@
+/**
+ * @file   vm_stats.c
+ * @brief  Prints physical memory statistics, e.g. after running fork_bomb, to
+ *         show how fragmented the buddy allocator's free memory has become.
+ * @author Qiaoyu Deng (qdeng)
+ * @bug    No known bugs
+ */
+
+#include <syscall.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+int main() {
+    vm_stats_t stats;
+    if (get_vm_stats(&stats) < 0) {
+        printf("get_vm_stats failed\n");
+        return -1;
+    }
+
+    printf("frames: %d total, %d free, %d unreserved\n",
+           stats.total_frames, stats.free_frames, stats.unreserved_frames);
+
+    int order;
+    int frames_below = 0;
+    printf("order  blocks  unusable(%%)\n");
+    for (order = 0; order < VM_STATS_ORDERS; order++) {
+        /*
+         * unusable free space index: the share of free frames that sit in
+         * blocks too small to satisfy an allocation of this order
+         */
+        int unusable = 0;
+        if (stats.free_frames > 0)
+            unusable = frames_below * 100 / stats.free_frames;
+        printf("%5d  %6d  %11d\n", order, stats.free_blocks[order], unusable);
+        frames_below += stats.free_blocks[order] << order;
+    }
+    printf("largest free block order: %d\n", stats.largest_free_order);
+    printf("zero pool: %d frames, %u hits, %u misses\n",
+           stats.zero_pool_frames, stats.zero_pool_hits,
+           stats.zero_pool_misses);
+    printf("cr3: %u loads, %u avoided\n",
+           stats.cr3_loads, stats.cr3_loads_avoided);
+    printf("demand faults: %u, %u pages mapped around them\n",
+           stats.demand_faults, stats.fault_around_pages);
+    printf("tlb: %u full flushes, %u page invalidations, %u avoided\n",
+           stats.tlb_full_flushes, stats.tlb_page_invals,
+           stats.tlb_flushes_avoided);
+    printf("page tables: %d in use by this task, %d cached\n",
+           stats.page_tables, stats.page_tables_cached);
+    printf("shared pages: %d frames cached, %u hits, %u mapped in place\n",
+           stats.page_cache_frames, stats.page_cache_hits,
+           stats.page_cache_direct);
+
+    /* compression ratio of what is stored, in tenths */
+    int ratio = 0;
+    if (stats.swap_bytes > 0)
+        ratio = stats.swap_pages * PAGE_SIZE * 10 / stats.swap_bytes;
+    printf("swap: %d pages in %d bytes (%d.%d:1), %u evictions, %u refaults\n",
+           stats.swap_pages, stats.swap_bytes, ratio / 10, ratio % 10,
+           stats.swap_evictions, stats.swap_refaults);
+    printf("merged: %d frames shared by %d pages (%d saved), "
+           "%u zero pages\n",
+           stats.merged_frames, stats.merged_pages,
+           stats.merged_pages - stats.merged_frames, stats.zero_merges);
+    printf("region lookups: %u cached, %u tree walks\n",
+           stats.maps_cache_hits, stats.maps_cache_misses);
+    printf("cpus: %d online, %u threads stolen\n",
+           stats.cpus_online, stats.threads_stolen);
+
+    return 0;
+}